@@ -0,0 +1,46 @@
+// shared by the benchmarks, which include it after ../shell.c
+// every result is printed for people and, when $BENCH_RESULTS names a
+// file, also appended to it as a csv line: bench,name,value,unit
+// bench/run.sh turns those lines into csv or json and compares them
+// against a baseline (a unit ending in /s is better when higher)
+#ifndef BENCH_H
+#define BENCH_H
+
+// where the lines for people go; a benchmark that sends stdout to
+// /dev/null points it at a copy of the original stdout
+FILE* bench_output;
+
+void bench_result(const char* bench, const char* name, double value, const char* unit) {
+	if (bench_output == NULL)
+		bench_output = stdout;
+	fprintf(bench_output, "%s: %-36s %12.3f %s\n", bench, name, value, unit);
+	fflush(bench_output);
+
+	char* path = getenv("BENCH_RESULTS");
+	if (path == NULL)
+		return;
+	FILE* results = fopen(path, "a");
+	if (results == NULL) {
+		perror("Error BENCH_RESULTS");
+		return;
+	}
+	fprintf(results, "%s,%s,%.6g,%s\n", bench, name, value, unit);
+	fclose(results);
+}
+
+// a size from the environment, with an optional K, M or G suffix
+size_t bench_size(const char* variable, size_t fallback) {
+	char* text = getenv(variable);
+	if (text == NULL)
+		return fallback;
+	char* end;
+	size_t size = strtoull(text, &end, 10);
+	switch (*end) {
+	case 'G': case 'g': size <<= 10; // fall through
+	case 'M': case 'm': size <<= 10; // fall through
+	case 'K': case 'k': size <<= 10;
+	}
+	return size;
+}
+
+#endif
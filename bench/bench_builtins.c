@@ -0,0 +1,119 @@
+// builtin throughput benchmark: cat, grep, wc, sort and cp on generated files of
+// 1 MB up to $BENCH_MAX_BYTES (default 64M, 4G for the full range), and
+// ls on a directory of $BENCH_FILES files (default 10000), all run in
+// this process the way the shell runs them, with stdout on /dev/null
+// the fixtures live in $BENCH_DIR (default /tmp) and the page cache is
+// warm, so the numbers are for cached files
+// build: gcc -O2 -DSHELL_NO_MAIN bench/bench_builtins.c -lreadline -lpthread -ldl -o bench_builtins
+#include "../shell.c"
+#include "bench.h"
+
+// best of three runs of a builtin, in seconds
+double run_builtin(char** argv) {
+	int argc = 0;
+	while (argv[argc])
+		++argc;
+
+	double best = 0;
+	for (int round = 0; round < 3; ++round) {
+		struct timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		find_command(argv, argc);
+		fflush(stdout);
+		double seconds = elapsed_seconds(&start);
+		if (exit_status > 1) {
+			fprintf(stderr, "%s failed\n", argv[0]);
+			exit(1);
+		}
+		if (round == 0 || seconds < best)
+			best = seconds;
+	}
+	return best;
+}
+
+// lines of text with a needle on every 1000th line
+void generate_file(const char* path, size_t size) {
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	struct text_buffer buffer = {NULL, 0, 0};
+	char line[128];
+	for (size_t written = 0, i = 0; written < size; ++i) {
+		int length = snprintf(line, sizeof(line), "%zu the quick brown fox jumps over the lazy dog %s\n",
+			i, i % 1000 == 0 ? "needle" : "hay");
+		buffer_append(&buffer, line, length);
+		written += length;
+		if (buffer.length > (4 << 20) || written >= size)
+			buffer_flush(&buffer, fd);
+	}
+	free(buffer.data);
+	close(fd);
+}
+
+int main(int argc, char** argv) {
+	size_t max_bytes = bench_size("BENCH_MAX_BYTES", 64 << 20);
+	size_t no_files = bench_size("BENCH_FILES", 10000);
+	char* dir = getenv("BENCH_DIR") ? getenv("BENCH_DIR") : "/tmp";
+	register_builtins(builtins, sizeof(builtins) / sizeof(*builtins));
+
+	char root[MAX_PATH_LENGTH];
+	snprintf(root, sizeof(root), "%s/bench_builtins_XXXXXX", dir);
+	if (mkdtemp(root) == NULL) {
+		perror("Error mkdtemp");
+		return 1;
+	}
+
+	// results go to the real stdout, the builtins write to /dev/null
+	bench_output = fdopen(dup(STDOUT_FILENO), "w");
+	int null = open("/dev/null", O_WRONLY);
+	dup2(null, STDOUT_FILENO);
+	close(null);
+
+	char source[2 * MAX_PATH_LENGTH], copy[2 * MAX_PATH_LENGTH], name[64];
+	snprintf(source, sizeof(source), "%s/input.txt", root);
+	snprintf(copy, sizeof(copy), "%s/copy.txt", root);
+
+	for (size_t size = 1 << 20; size <= max_bytes; size *= 8) {
+		generate_file(source, size);
+		double mb = size / 1e6;
+
+		sprintf(name, "cat_%zuMB", size >> 20);
+		bench_result("builtins", name, mb / run_builtin((char*[]){"cat", source, NULL}), "MB/s");
+
+		sprintf(name, "grep_%zuMB", size >> 20);
+		bench_result("builtins", name, mb / run_builtin((char*[]){"grep", "needle", source, NULL}), "MB/s");
+
+		sprintf(name, "grep_regex_%zuMB", size >> 20);
+		bench_result("builtins", name, mb / run_builtin((char*[]){"grep", "-E", "ne+dle$", source, NULL}), "MB/s");
+
+		sprintf(name, "wc_%zuMB", size >> 20);
+		bench_result("builtins", name, mb / run_builtin((char*[]){"wc", source, NULL}), "MB/s");
+
+		sprintf(name, "sort_%zuMB", size >> 20);
+		bench_result("builtins", name, mb / run_builtin((char*[]){"sort", "-k", "2", source, NULL}), "MB/s");
+
+		// a cap of an eighth of the input makes sort merge runs from disk
+		char cap[32];
+		sprintf(cap, "%zuK", size >> 13);
+		sprintf(name, "sort_spill_%zuMB", size >> 20);
+		bench_result("builtins", name, mb / run_builtin((char*[]){"sort", "-S", cap, "-k", "2", source, NULL}), "MB/s");
+
+		sprintf(name, "cp_%zuMB", size >> 20);
+		bench_result("builtins", name, mb / run_builtin((char*[]){"cp", source, copy, NULL}), "MB/s");
+		unlink(copy);
+	}
+	unlink(source);
+
+	char entries[2 * MAX_PATH_LENGTH], path[3 * MAX_PATH_LENGTH];
+	snprintf(entries, sizeof(entries), "%s/entries", root);
+	mkdir(entries, 0755);
+	for (size_t i = 0; i < no_files; ++i) {
+		snprintf(path, sizeof(path), "%s/file_%zu", entries, i);
+		close(open(path, O_WRONLY | O_CREAT, 0644));
+	}
+
+	bench_result("builtins", "ls", run_builtin((char*[]){"ls", entries, NULL}) * 1e3, "ms");
+	bench_result("builtins", "ls_long", run_builtin((char*[]){"ls", "-l", entries, NULL}) * 1e3, "ms");
+
+	char* remove_argv[] = {"rm", "-r", root, NULL};
+	find_command(remove_argv, 3);
+	return 0;
+}
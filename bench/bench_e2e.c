@@ -0,0 +1,108 @@
+// end to end benchmark: generated scripts run by run_script, the way
+// `shell script` runs them (lexing, parsing, lookup, redirections,
+// forks and spawns included), with stdout on /dev/null
+// - script: 10000 lines of builtins, lists and redirections
+// - and_chain: lines of 1000 commands joined by && (and ||)
+// - pipeline_N: N stages of cat over a 1 MB file, as builtins (forked)
+//   and as programs (spawned)
+// build: gcc -O2 -DSHELL_NO_MAIN bench/bench_e2e.c -lreadline -lpthread -ldl -o bench_e2e
+#include "../shell.c"
+#include "bench.h"
+
+char script_path[] = "/tmp/bench_e2e_script_XXXXXX";
+char input_path[] = "/tmp/bench_e2e_input_XXXXXX";
+
+// best of three runs of the script, in seconds
+double run_generated(struct text_buffer* script) {
+	int fd = open(script_path, O_WRONLY | O_TRUNC);
+	buffer_flush(script, fd);
+	close(fd);
+
+	double best = 0;
+	for (int round = 0; round < 3; ++round) {
+		fd = open(script_path, O_RDONLY);
+		struct timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		run_script(fd);
+		fflush(stdout);
+		double seconds = elapsed_seconds(&start);
+		close(fd);
+		if (round == 0 || seconds < best)
+			best = seconds;
+	}
+	return best;
+}
+
+int main(int argc, char** argv) {
+	init(false);
+	close(mkstemp(script_path));
+	int input = mkstemp(input_path);
+	char line[4096];
+	for (int i = 0; i < (1 << 20) / 64; ++i)
+		write_all(input, line, snprintf(line, sizeof(line), "%062d\n", i));
+	close(input);
+
+	bench_output = fdopen(dup(STDOUT_FILENO), "w");
+	int null = open("/dev/null", O_WRONLY);
+	dup2(null, STDOUT_FILENO);
+	close(null);
+
+	struct text_buffer script = {NULL, 0, 0};
+	int no_lines = 10000;
+	for (int i = 0; i < no_lines; ++i) {
+		switch (i % 4) {
+		case 0:
+			sprintf(line, "echo line %d\n", i);
+			break;
+		case 1:
+			sprintf(line, "true && echo yes %d || echo no\n", i);
+			break;
+		case 2:
+			sprintf(line, "false ; echo 'quoted %d' > /dev/null\n", i);
+			break;
+		default:
+			sprintf(line, "echo %d >> /dev/null # a comment\n", i);
+		}
+		buffer_puts(&script, line);
+	}
+	double seconds = run_generated(&script);
+	bench_result("e2e", "script_10k", seconds * 1e3, "ms");
+	bench_result("e2e", "script_10k_lines", no_lines / seconds / 1e3, "Klines/s");
+
+	int no_chains = 100, chain_length = 1000;
+	for (int i = 0; i < no_chains; ++i) {
+		for (int j = 0; j < chain_length; ++j)
+			buffer_puts(&script, j == 0 ? "true" : j % 10 ? " && true" : " || false");
+		buffer_puts(&script, "\n");
+	}
+	seconds = run_generated(&script);
+	bench_result("e2e", "and_chain", seconds * 1e9 / (no_chains * chain_length), "ns/command");
+
+	int stages[] = {2, 8, 32};
+	for (int s = 0; s < 3; ++s) {
+		for (int program = 0; program < 2; ++program) {
+			// a path makes cat a program instead of the builtin
+			const char* cat = program ? path_lookup("cat") : "cat";
+			if (cat == NULL)
+				continue;
+			for (int i = 0; i < 10; ++i) {
+				buffer_puts(&script, cat);
+				buffer_puts(&script, " ");
+				buffer_puts(&script, input_path);
+				for (int j = 1; j < stages[s]; ++j) {
+					buffer_puts(&script, " | ");
+					buffer_puts(&script, cat);
+				}
+				buffer_puts(&script, "\n");
+			}
+
+			char name[64];
+			sprintf(name, "pipeline_%d_%s", stages[s], program ? "programs" : "builtins");
+			bench_result("e2e", name, run_generated(&script) * 1e3 / 10, "ms");
+		}
+	}
+
+	unlink(script_path);
+	unlink(input_path);
+	return 0;
+}
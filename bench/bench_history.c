@@ -0,0 +1,74 @@
+// history benchmark: loading a million entry history file, and
+// substring search through the trigram index against comparing every
+// entry
+// build: gcc -O2 -DSHELL_NO_MAIN bench/bench_history.c -lreadline -lpthread -ldl -o bench_history
+#include "../shell.c"
+#include "bench.h"
+
+int main(int argc, char** argv) {
+	int no_entries = argc > 1 ? atoi(argv[1]) : 1000000;
+	const char* words[] = {"git", "make", "ls", "grep", "cat", "cd", "echo", "vim", "ssh", "docker"};
+
+	char path[] = "/tmp/bench_history_XXXXXX";
+	int fd = mkstemp(path);
+	struct text_buffer buffer = {NULL, 0, 0};
+	char line[128];
+	srand(1);
+	for (int i = 0; i < no_entries; ++i) {
+		uint32_t length = snprintf(line, sizeof(line), "%s %s -v file_%d.txt %x",
+			words[rand() % 10], words[rand() % 10], rand() % 100000, rand());
+		buffer_append(&buffer, (char*)&length, sizeof(length));
+		buffer_append(&buffer, line, length);
+	}
+	buffer_flush(&buffer, fd);
+	close(fd);
+
+	setenv("HISTFILE", path, 1);
+	sprintf(line, "%d", no_entries);
+	setenv("HISTSIZE", line, 1);
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	history_open();
+	bench_result("history", "open", elapsed_seconds(&start) * 1e3, "ms");
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	history_load();
+	printf("history: %d entries\n", history.no_entries);
+	bench_result("history", "load", elapsed_seconds(&start) * 1e3, "ms");
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	trigram_index_build();
+	bench_result("history", "index", elapsed_seconds(&start) * 1e3, "ms");
+	printf("history: %u trigrams\n", history.no_trigrams);
+
+	const char* patterns[] = {"file_4242.", "docker vim", "deadbe", "no such command"};
+	for (int p = 0; p < 4; ++p) {
+		size_t length = strlen(patterns[p]);
+		int found = 0, scanned_found = 0;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (int id = history_search_back(patterns[p], history.no_entries); id >= 0; id = history_search_back(patterns[p], id))
+			++found;
+		double indexed = elapsed_seconds(&start);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (int id = 0; id < history.no_entries; ++id)
+			scanned_found += history_matches(id, patterns[p], length);
+		double scanned = elapsed_seconds(&start);
+
+		if (found != scanned_found) {
+			fprintf(stderr, "history: %s: %d matches through the index, %d by a scan\n", patterns[p], found, scanned_found);
+			return 1;
+		}
+
+		char name[64];
+		sprintf(name, "search_%d_index", p);
+		bench_result("history", name, indexed * 1e3, "ms");
+		sprintf(name, "search_%d_scan", p);
+		bench_result("history", name, scanned * 1e3, "ms");
+	}
+
+	unlink(path);
+	return 0;
+}
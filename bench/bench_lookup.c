@@ -0,0 +1,107 @@
+// command lookup benchmark: the double-array trie against the
+// 256-way pointer trie it replaced
+// build: gcc -O2 -DSHELL_NO_MAIN bench/bench_lookup.c -lreadline -lpthread -ldl -o bench_lookup
+#include "../shell.c"
+#include "bench.h"
+
+// the previous lookup structure, kept here only for comparison
+struct pointer_trie {
+	int index;
+	struct pointer_trie* children[SIGMA];
+};
+
+size_t pointer_trie_bytes = 0;
+
+struct pointer_trie* pointer_trie_node() {
+	struct pointer_trie* node = calloc(1, sizeof(*node));
+	node->index = -1;
+	pointer_trie_bytes += sizeof(*node);
+	return node;
+}
+
+void pointer_trie_insert(struct pointer_trie* root, const char* str, int index) {
+	for (const unsigned char* letter = (const unsigned char*)str; *letter; ++letter) {
+		if (root->children[*letter] == NULL)
+			root->children[*letter] = pointer_trie_node();
+		root = root->children[*letter];
+	}
+	root->index = index;
+}
+
+int pointer_trie_search(struct pointer_trie* root, const char* str) {
+	for (const unsigned char* letter = (const unsigned char*)str; *letter; ++letter) {
+		root = root->children[*letter];
+		if (root == NULL)
+			return -1;
+	}
+	return root->index;
+}
+
+int main(int argc, char** argv) {
+	long no_lookups = argc > 1 ? atol(argv[1]) : 20000000;
+
+	register_builtins(builtins, sizeof(builtins) / sizeof(*builtins));
+
+	struct pointer_trie* root = pointer_trie_node();
+	for (int i = 0; i < no_commands; ++i)
+		pointer_trie_insert(root, commands[i]->name, i);
+
+	// every builtin plus as many misses (typos, prefixes, external names)
+	int no_words = 2 * no_commands;
+	const char** words = malloc(no_words * sizeof(*words));
+	for (int i = 0; i < no_commands; ++i) {
+		char* miss = malloc(strlen(commands[i]->name) + 2);
+		if (i % 2)
+			sprintf(miss, "%sx", commands[i]->name);
+		else
+			sprintf(miss, "%.*s", (int)strlen(commands[i]->name) - 1, commands[i]->name);
+		words[i] = commands[i]->name;
+		words[no_commands + i] = miss;
+	}
+
+	for (int i = 0; i < no_words; ++i)
+		if (pointer_trie_search(root, words[i]) != da_search(&command_table, words[i])) {
+			fprintf(stderr, "lookup mismatch on %s\n", words[i]);
+			return 1;
+		}
+
+	// hot: one copy of each structure, always in cache
+	// cold: lookups rotate over many copies, so the cost is the cache
+	// lines a lookup touches, like a shell whose tables were evicted by
+	// the commands it ran
+	for (int cold = 0; cold < 2; ++cold) {
+		int no_copies = cold ? 1024 : 1;
+		struct pointer_trie** roots = malloc(no_copies * sizeof(*roots));
+		struct double_array* tables = malloc(no_copies * sizeof(*tables));
+		roots[0] = root;
+		tables[0] = command_table;
+		for (int c = 1; c < no_copies; ++c) {
+			roots[c] = pointer_trie_node();
+			for (int i = 0; i < no_commands; ++i)
+				pointer_trie_insert(roots[c], commands[i]->name, i);
+			tables[c].size = command_table.size;
+			tables[c].slots = malloc(command_table.size * sizeof(struct da_slot));
+			memcpy(tables[c].slots, command_table.slots, command_table.size * sizeof(struct da_slot));
+		}
+
+		for (int variant = 0; variant < 2; ++variant) {
+			struct timespec start;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+
+			long found = 0;
+			for (long i = 0; i < no_lookups; ++i) {
+				const char* word = words[(i * 7) % no_words];
+				int c = (i * 40503) % no_copies;
+				found += variant == 0 ? pointer_trie_search(roots[c], word) : da_search(&tables[c], word);
+			}
+
+			double seconds = elapsed_seconds(&start);
+			size_t bytes = variant == 0 ? pointer_trie_bytes / (cold ? no_copies : 1) : command_table.size * sizeof(struct da_slot);
+			char name[64];
+			sprintf(name, "%s_%s", cold ? "cold" : "hot", variant == 0 ? "pointer_trie" : "double_array");
+			printf("lookup: %s: %zu bytes (checksum %ld)\n", name, bytes, found);
+			bench_result("lookup", name, seconds * 1e9 / no_lookups, "ns");
+		}
+	}
+	return 0;
+}
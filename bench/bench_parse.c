@@ -0,0 +1,84 @@
+// parse benchmark: lexes big generated scripts line by line, and lexes
+// and parses them into command trees (the argvs of every command)
+// build: gcc -O2 -DSHELL_NO_MAIN bench/bench_parse.c -lreadline -lpthread -ldl -o bench_parse
+#include "../shell.c"
+#include "bench.h"
+
+// one line of a generated script, picked from a few shapes so every
+// kind of token shows up
+int generate_line(char* line, unsigned seed) {
+	switch (seed % 6) {
+	case 0:
+		return sprintf(line, "ls -l dir%u", seed);
+	case 1:
+		return sprintf(line, "cat file%u.txt | grep -E \"err(or)? %u\" | cat -n", seed, seed);
+	case 2:
+		return sprintf(line, "mkdir d%u && cd d%u || echo 'could not enter d%u'", seed, seed, seed);
+	case 3:
+		return sprintf(line, "grep needle < input%u.txt > output%u.txt ; echo done", seed, seed);
+	case 4:
+		return sprintf(line, "echo \"a long quoted argument with | and && inside %u\" x\\ y # comment", seed);
+	default:
+		return sprintf(line, "cp -r src%u dst%u && rm -r src%u && echo moved", seed, seed, seed);
+	}
+}
+
+int main(int argc, char** argv) {
+	long no_lines = argc > 1 ? atol(argv[1]) : 1000000;
+	int rounds = argc > 2 ? atoi(argv[2]) : 5;
+
+	// the script is generated up front so only parsing is timed
+	char** lines = malloc(no_lines * sizeof(*lines));
+	size_t total_bytes = 0;
+	char line[256];
+	for (long i = 0; i < no_lines; ++i) {
+		int length = generate_line(line, (unsigned)(i * 2654435761u));
+		lines[i] = strdup(line);
+		total_bytes += length;
+	}
+
+	struct arena arena = {NULL, NULL};
+	long no_pipelines = 0, no_tokens = 0;
+
+	// the best of a few rounds, lexing only and then the whole parse
+	for (int parse = 0; parse < 2; ++parse) {
+		double best = 0;
+		for (int round = 0; round < rounds; ++round) {
+			struct timespec start;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+
+			no_pipelines = no_tokens = 0;
+			for (long i = 0; i < no_lines; ++i) {
+				arena_reset(&arena);
+				if (!parse) {
+					struct token* tokens;
+					no_tokens += lex_line(&arena, lines[i], &tokens);
+					continue;
+				}
+
+				struct command_line* parsed = parse_input(&arena, lines[i]);
+				if (parsed == NULL) {
+					fprintf(stderr, "parse error: %s\n", lines[i]);
+					return 1;
+				}
+				no_pipelines += parsed->no_pipelines;
+			}
+
+			double seconds = elapsed_seconds(&start);
+			if (round == 0 || seconds < best)
+				best = seconds;
+		}
+
+		if (!parse) {
+			printf("parse: %ld lines, %.1f MB, %ld tokens\n", no_lines, total_bytes / 1e6, no_tokens);
+			bench_result("parse", "lex", total_bytes / 1e6 / best, "MB/s");
+			bench_result("parse", "lex_lines", no_lines / 1e6 / best, "Mlines/s");
+		}
+		else {
+			printf("parse: %ld pipelines\n", no_pipelines);
+			bench_result("parse", "parse", total_bytes / 1e6 / best, "MB/s");
+			bench_result("parse", "parse_lines", no_lines / 1e6 / best, "Mlines/s");
+		}
+	}
+	return 0;
+}
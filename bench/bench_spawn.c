@@ -0,0 +1,56 @@
+// spawn latency benchmark: fork + execve, the way programs used to be
+// started, against spawn_program (posix_spawn), with the shell grown
+// to a few address space sizes
+// build: gcc -O2 -DSHELL_NO_MAIN bench/bench_spawn.c -lreadline -lpthread -ldl -o bench_spawn
+#include "../shell.c"
+#include "bench.h"
+
+// the previous launch path, kept here only for comparison
+pid_t fork_program(char* path, char** argv) {
+	pid_t child = fork();
+	if (child == 0) {
+		execve(path, argv, environ);
+		_exit(127);
+	}
+	return child;
+}
+
+int main(int argc, char** argv) {
+	int no_spawns = argc > 1 ? atoi(argv[1]) : 200;
+
+	char* true_argv[] = {"true", NULL};
+	char* true_path = path_lookup("true");
+	if (true_path == NULL) {
+		fprintf(stderr, "true not found in $PATH\n");
+		return 1;
+	}
+
+	size_t grown = 0;
+	size_t sizes[] = {0, 256 << 20, 1024 << 20};
+
+	for (int s = 0; s < 3; ++s) {
+		// touch the memory so its page tables exist and fork copies them
+		char* memory = malloc(sizes[s] - grown + 1);
+		memset(memory, 1, sizes[s] - grown);
+		grown = sizes[s];
+
+		for (int variant = 0; variant < 2; ++variant) {
+			struct timespec start;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+
+			for (int i = 0; i < no_spawns; ++i) {
+				pid_t child = variant == 0 ? fork_program(true_path, true_argv) : spawn_program(true_argv, -1, -1, NULL, 0, -1, -1);
+				if (child < 0 || wait_status(child) != 0) {
+					fprintf(stderr, "spawn failed\n");
+					return 1;
+				}
+			}
+
+			double seconds = elapsed_seconds(&start);
+			char name[64];
+			sprintf(name, "%s_%zuMB", variant == 0 ? "fork_execve" : "posix_spawn", grown >> 20);
+			bench_result("spawn", name, seconds * 1e6 / no_spawns, "us");
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,85 @@
+#!/bin/sh
+# build and run the benchmarks from the repository root
+#
+# usage: bench/run.sh [-o file] [-j] [-c baseline] [-t percent] [bench...]
+#   -o file      save the results in file, as csv: bench,name,value,unit
+#   -j           save them as json instead
+#   -c baseline  compare with results saved as csv before; a result worse
+#                by more than the threshold is a regression, and the
+#                script fails if there is one
+#   -t percent   the threshold, 10 by default
+#   bench        the benchmarks to run (parse, lookup, builtins, e2e...),
+#                all of them by default
+# the benchmarks also read BENCH_MAX_BYTES, BENCH_FILES and BENCH_DIR
+# (see bench_builtins.c)
+set -e
+cd "$(dirname "$0")/.."
+mkdir -p bench/bin
+
+output=
+json=0
+baseline=
+threshold=10
+while getopts o:jc:t: option; do
+	case $option in
+	o) output=$OPTARG ;;
+	j) json=1 ;;
+	c) baseline=$OPTARG ;;
+	t) threshold=$OPTARG ;;
+	*) sed -n '4,14p' "$0" >&2; exit 2 ;;
+	esac
+done
+shift $((OPTIND - 1))
+
+benches=$*
+if [ -z "$benches" ]; then
+	for bench in bench/bench_*.c; do
+		name=$(basename "$bench" .c)
+		benches="$benches ${name#bench_}"
+	done
+fi
+
+results=$(mktemp)
+trap 'rm -f "$results"' EXIT
+export BENCH_RESULTS="$results"
+
+for name in $benches; do
+	gcc -O2 -DSHELL_NO_MAIN "bench/bench_$name.c" -lreadline -lpthread -ldl -o "bench/bin/bench_$name"
+	echo "== $name"
+	"./bench/bin/bench_$name"
+done
+
+if [ -n "$output" ]; then
+	if [ "$json" = 1 ]; then
+		awk -F, 'BEGIN { printf "[" }
+			{ printf "%s\n  {\"bench\": \"%s\", \"name\": \"%s\", \"value\": %s, \"unit\": \"%s\"}", (NR > 1 ? "," : ""), $1, $2, $3, $4 }
+			END { printf "\n]\n" }' "$results" > "$output"
+	else
+		cp "$results" "$output"
+	fi
+fi
+
+if [ -n "$baseline" ]; then
+	echo "== compared with $baseline (threshold $threshold%)"
+	# a rate (unit ending in /s) is better higher, anything else lower
+	awk -F, -v threshold="$threshold" '
+		NR == FNR { base[$1 "," $2] = $3; next }
+		{
+			key = $1 "," $2
+			if (!(key in base) || base[key] == 0) {
+				printf "%-48s %14.3f %-10s new\n", key, $3, $4
+				next
+			}
+			change = ($3 - base[key]) / base[key] * 100
+			worse = $4 ~ /\/s$/ ? -change : change
+			verdict = worse > threshold ? "REGRESSION" : worse < -threshold ? "better" : ""
+			regressions += (verdict == "REGRESSION")
+			printf "%-48s %14.3f %-10s %+7.1f%% %s\n", key, $3, $4, change, verdict
+		}
+		END {
+			if (regressions) {
+				printf "%d regression(s)\n", regressions
+				exit 1
+			}
+		}' "$baseline" "$results"
+fi
@@ -0,0 +1,26 @@
+// example plugin: adds a "hello" builtin
+// build: gcc -shared -fPIC plugins/example.c -o example.so
+// use:   load ./example.so
+#include <stdio.h>
+#include "../shell_plugin.h"
+
+void funct_hello(char** args) {
+	exit_status = 1;
+	printf("hello");
+	for (int i = 0; args[i] != NULL; ++i)
+		printf(" %s", args[i]);
+	printf("\n");
+	exit_status = 0;
+}
+
+const struct builtin example_builtins[] = {
+	{"hello", funct_hello, 0, -1, BUILTIN_PIPE_SAFE},
+};
+
+const struct shell_plugin example_plugin = {
+	SHELL_PLUGIN_VERSION, example_builtins, 1,
+};
+
+const struct shell_plugin* shell_plugin_init(void) {
+	return &example_plugin;
+}
@@ -1 +1 @@
-gcc shell.c -L/usr/include -lreadline -o shell && ./shell
+gcc shell.c -L/usr/include -lreadline -lpthread -ldl -rdynamic -o shell && ./shell
@@ -3,6 +3,8 @@
 // Gr 234
 
 
+#define _GNU_SOURCE
+
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -10,6 +12,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h> 
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -20,13 +23,61 @@
 #include <sys/wait.h>
 #include<readline/readline.h>
 #include<readline/history.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <pwd.h>
+#include <grp.h>
+#include <dlfcn.h>
+#include <spawn.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/inotify.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "shell_plugin.h"
 
 // define constants
-#define MAX_INPUT_LENGTH 1024
 #define SIGMA 256
 #define MAX_PATH_LENGTH 1024
-#define MAX_COMMANDS_HISTORY 20
-#define MAX_NUMBER_ARGUMENTS 50
+#define ARENA_BLOCK_SIZE (64 << 10)
+#define COPY_BUFFER_SIZE (1 << 20)
+#define GREP_READ_SIZE (1 << 20)
+#define GREP_CHUNK_SIZE (8 << 20)
+#define GREP_MAX_SPANS 64
+#define CAT_BUFFER_SIZE (1 << 20)
+#define WC_BUFFER_SIZE (1 << 20)
+#define WC_CHUNK_SIZE (16 << 20)
+#define WC_PARALLEL_MIN (64 << 20)
+#define TAIL_RECHECK_MS 1000
+#define TAIL_WATCH_EVENTS (IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF)
+#define SORT_READ_SIZE (1 << 20)
+#define SORT_RUN_BLOCK (256 << 10)
+#define SORT_MEMORY ((size_t)256 << 20)
+#define SORT_MIN_MEMORY ((size_t)4 << 20)
+#define SORT_PARALLEL_MIN 65536
+#define SORT_SLICE_RECORDS 65536
+#define LS_DENTS_SIZE (1 << 16)
+#define LS_FLUSH_SIZE (8 << 20)
+#define PATH_CHECK_INTERVAL 1
+#define SCRIPT_BLOCK_SIZE (1 << 16)
+#define HISTORY_SIZE 100000
+#define HISTORY_FILE ".shell_history"
+#define TRIGRAM_COMMON 16
+#define TRACE_RING_SIZE (1 << 16)
+#define STATS_BUCKETS 24
+#define OUTPUT_BUFFER_SIZE (64 << 10)
+#define TRACE_FILE "shell_trace.json"
+#define TRIGRAM_MIN_COMMON 4096
 
 // define colours
 #define GREEN "\x1b[92m"
@@ -37,98 +88,191 @@
 #define MAGENTA "\x1b[35m"
 
 char cwd[MAX_PATH_LENGTH];
-char commands_history[MAX_COMMANDS_HISTORY][MAX_INPUT_LENGTH];
-char stdin_buffer[MAX_INPUT_LENGTH];
-char stdout_buffer[MAX_INPUT_LENGTH];
-char pipe_buffer[MAX_INPUT_LENGTH];
 int exit_status, kill_signal = 0;
-bool stdin_redirect = false, stdout_redirect = false;
+bool in_pipeline = false; // true inside a forked pipeline stage
 pid_t pid = -1;
 static volatile int keepRunning = 1;
 
 
-// trie implementation
-struct Trie {
-	int index; // -1 if it is not the end of a command
-	struct Trie* children[SIGMA];
-	int min_arg, max_arg;
+// command lookup: a double-array trie
+// the child of state s for the byte c is the slot t = base[s] + c,
+// and it exists only if check[t] == s, so a lookup is one array step
+// per character; the end of a name is a child on the byte '\0' whose
+// base is the index of the command
+struct da_slot {
+	int base, check;
+};
+
+struct double_array {
+	struct da_slot* slots;
+	int size;
 };
 
-typedef struct Trie* TrieNode;
+// every builtin the shell knows (its own and the loaded ones),
+// indexed by the trie values
+const struct builtin** commands = NULL;
+int no_commands = 0;
 
-TrieNode get_new_node() {
-	TrieNode node = (TrieNode)malloc(sizeof(struct Trie));
-	node->index = -1;
-	node->min_arg = 0;
-	node->max_arg = 0;
-	memset(node->children, 0, sizeof(node->children));
-	return node;
+struct double_array command_table;
+
+void da_reserve(struct double_array* da, int size) {
+	if (size <= da->size)
+		return;
+
+	int new_size = da->size ? da->size : 256;
+	while (new_size < size)
+		new_size *= 2;
+
+	da->slots = realloc(da->slots, new_size * sizeof(*da->slots));
+	for (int i = da->size; i < new_size; ++i)
+		da->slots[i] = (struct da_slot){0, -1};
+	da->size = new_size;
 }
 
-TrieNode trie_root;
+// place the children of state, which are the bytes at depth of the
+// sorted names [lo, hi), and then their subtrees
+void da_insert_children(struct double_array* da, int state, char** names, int* values, int lo, int hi, int depth) {
+	unsigned char labels[SIGMA];
+	int no_labels = 0;
+	for (int i = lo; i < hi; ++i) {
+		unsigned char c = names[i][depth];
+		if (no_labels == 0 || labels[no_labels - 1] != c)
+			labels[no_labels++] = c;
+	}
+
+	// the first base where every child slot is free
+	int base = 1;
+	for (bool fits = false; !fits; ) {
+		fits = true;
+		for (int k = 0; k < no_labels; ++k) {
+			da_reserve(da, base + labels[k] + 1);
+			if (da->slots[base + labels[k]].check != -1) {
+				fits = false;
+				++base;
+				break;
+			}
+		}
+	}
 
-void insert(char* str, int v_min_arg, int v_max_arg, int idx_command) {
-	TrieNode node = trie_root;
+	da->slots[state].base = base;
+	// lookups never bound check, base + any byte must stay in the array
+	da_reserve(da, base + SIGMA);
+	for (int k = 0; k < no_labels; ++k)
+		da->slots[base + labels[k]].check = state;
 
-	for (char* letter = str; *letter; ++letter) {
-		if (node->children[*letter] == NULL) 
-			node->children[*letter] = get_new_node();
+	for (int k = 0, i = lo; k < no_labels; ++k) {
+		if (labels[k] == '\0') {
+			da->slots[base].base = values[i++];
+			continue;
+		}
 
-		node = node->children[*letter];
+		int j = i;
+		while (j < hi && (unsigned char)names[j][depth] == labels[k])
+			++j;
+		da_insert_children(da, base + labels[k], names, values, i, j, depth + 1);
+		i = j;
 	}
+}
 
-	node->index = idx_command;
-	node->min_arg = v_min_arg;
-	node->max_arg = v_max_arg;
+int compare_names(const void* a, const void* b) {
+	return strcmp(*(char**)a, *(char**)b);
 }
 
-int search(char* str, int* v_min_arg, int* v_max_arg) {
-	TrieNode node = trie_root;
+// build the trie over names; the value of names[i] is i, and a name
+// given more than once keeps its last index
+void da_build(struct double_array* da, char** names, int no_names) {
+	da->slots = NULL;
+	da->size = 0;
+	da_reserve(da, SIGMA);
+	// the root is never a child
+	da->slots[0].check = -2;
+
+	// sort (name, index) pairs, dropping duplicate names
+	char** sorted = malloc((no_names + 1) * sizeof(*sorted));
+	int* values = malloc((no_names + 1) * sizeof(*values));
+	memcpy(sorted, names, no_names * sizeof(*names));
+	qsort(sorted, no_names, sizeof(*sorted), compare_names);
+
+	int no_sorted = 0;
+	for (int i = 0; i < no_names; ++i) {
+		if (no_sorted > 0 && strcmp(sorted[no_sorted - 1], sorted[i]) == 0)
+			continue;
+		sorted[no_sorted++] = sorted[i];
+	}
+	for (int i = 0; i < no_sorted; ++i)
+		for (int j = no_names - 1; j >= 0; --j)
+			if (strcmp(names[j], sorted[i]) == 0) {
+				values[i] = j;
+				break;
+			}
 
-	for (char* letter = str; *letter; ++letter) {
-		if (node->children[*letter] == NULL) 
-			return -1;
+	if (no_sorted > 0)
+		da_insert_children(da, 0, sorted, values, 0, no_sorted, 0);
+
+	free(sorted);
+	free(values);
+}
 
-		node = node->children[*letter];
+// returns the value stored for str, or -1
+int da_search(struct double_array* da, const char* str) {
+	int state = 0;
+	int base = da->slots[0].base;
+
+	// the slot of a child holds both its check and its own base, so
+	// every step is one load
+	for (const unsigned char* letter = (const unsigned char*)str; ; ++letter) {
+		int next = base + *letter;
+		struct da_slot slot = da->slots[next];
+		if (slot.check != state)
+			return -1;
+		if (*letter == '\0')
+			return slot.base;
+		state = next;
+		base = slot.base;
 	}
+}
+
+// returns the index of a builtin and its argument bounds, or -1
+int search(char* str, int* v_min_arg, int* v_max_arg) {
+	int idx_command = da_search(&command_table, str);
+	if (idx_command == -1)
+		return -1;
 
-	*v_min_arg = node->min_arg;
-	*v_max_arg = node->max_arg;
-	return node->index;
+	*v_min_arg = commands[idx_command]->min_arg;
+	*v_max_arg = commands[idx_command]->max_arg;
+	return idx_command;
 }
 
-// validate a command
-// returns the command index if it is a valid command
-// returns -1 otherwise
-int valid_command(char* str) {
-	if (str == NULL || str == "")
-		return false;
+// add builtins to the lookup table; a name that is already known is
+// replaced by the new builtin
+void register_builtins(const struct builtin* builtins, int no_builtins) {
+	commands = realloc(commands, (no_commands + no_builtins) * sizeof(*commands));
+	for (int i = 0; i < no_builtins; ++i)
+		commands[no_commands++] = &builtins[i];
 
-	char* str_copy = malloc(MAX_INPUT_LENGTH * sizeof(*str_copy));
-	strcpy(str_copy, str);
+	char** names = malloc(no_commands * sizeof(*names));
+	for (int i = 0; i < no_commands; ++i)
+		names[i] = (char*)commands[i]->name;
 
-	char* token = strtok(str, " \n");
-	int command_min_arg, command_max_arg;
-	int idx_command = search(token, &command_min_arg, &command_max_arg);
+	free(command_table.slots);
+	da_build(&command_table, names, no_commands);
+	free(names);
+}
 
-	if (idx_command == -1) {
-		strcpy(str, str_copy);
-		free(str_copy);
+// validate a command given as an argv
+// returns the command index if it is a valid command
+// returns -1 otherwise
+int valid_command(char** argv, int argc) {
+	if (argv == NULL || argv[0] == NULL)
 		return -1;
-	}
-
-	int no_args = 0;
 
-	while (true) {
-		token = strtok(NULL, " \n");
-		if (token == NULL)
-			break;
+	int command_min_arg, command_max_arg;
+	int idx_command = search(argv[0], &command_min_arg, &command_max_arg);
 
-		++no_args;
-	}
+	if (idx_command == -1)
+		return -1;
 
-	strcpy(str, str_copy);
-	free(str_copy);
+	int no_args = argc - 1;
 
 	if (command_min_arg > no_args)
 		return -1;
@@ -141,918 +285,7382 @@ int valid_command(char* str) {
 
 
 
-// mantain history of commands
-struct History {
-	char command[MAX_INPUT_LENGTH];
-	struct History* next_line;
+// -------------------------- UTILS ------------------------------
+
+
+// per line bump allocator
+// everything a command line needs (the line, its words, the argvs and
+// temporary strings) is carved out of big blocks, and all of it is
+// released at once by resetting the arena when the line is done
+struct arena_block {
+	struct arena_block* next;
+	size_t size, used;
+	char data[];
 };
 
-typedef struct History* HistoryLine;
+struct arena {
+	struct arena_block* first;
+	struct arena_block* current;
+};
 
-HistoryLine first_line, last_line;
+struct arena line_arena;
 
-HistoryLine get_new_line() {
-	HistoryLine line = (HistoryLine)malloc((sizeof(struct History)));
-	memset(line->command, 0, sizeof(line->command));
-	line->next_line = NULL;
-	return line;
-}
+void* arena_alloc(struct arena* arena, size_t size) {
+	size = (size + 15) & ~(size_t)15;
 
-void add_command_to_history(char* str) {
-	HistoryLine line = get_new_line();
-	strcpy(line->command, str);
+	struct arena_block* block = arena->current;
+	while (block == NULL || block->used + size > block->size) {
+		// blocks stay allocated across resets, reuse the next one if it fits
+		if (block && block->next) {
+			block = block->next;
+			block->used = 0;
+			continue;
+		}
 
-	if (last_line == NULL) {
-		first_line = last_line = get_new_line();
-		first_line = last_line = line;
+		size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+		struct arena_block* new_block = malloc(sizeof(*new_block) + block_size);
+		new_block->size = block_size;
+		new_block->used = 0;
+
+		// a block that was too small is kept after the new one
+		new_block->next = block ? block->next : NULL;
+		if (block)
+			block->next = new_block;
+		else
+			arena->first = new_block;
+		block = new_block;
 	}
-	else {
-		last_line->next_line = line;
-		last_line = line;
-	}
-}
 
-void print_history() {
-	for (HistoryLine line = first_line; line; line = line->next_line) {
-		printf("%s\n", line->command);
-	}
+	arena->current = block;
+	void* memory = block->data + block->used;
+	block->used += size;
+	return memory;
 }
 
-// -------------------------- UTILS ------------------------------
+char* arena_strndup(struct arena* arena, const char* str, size_t length) {
+	char* copy = arena_alloc(arena, length + 1);
+	memcpy(copy, str, length);
+	copy[length] = '\0';
+	return copy;
+}
 
+char* arena_strdup(struct arena* arena, const char* str) {
+	return arena_strndup(arena, str, strlen(str));
+}
 
-//returns if the str contains any special char
-//if str is not valid it returns -2
-// no special char found -1
-//if a special char is found, it returns pos * 10 + type
-// type is 1 for ||, 2 for &&, 3 for <, 4 for >, 5 for |
-int token_str(char* str) {
-	char* next_char;
-	int difference;
-	for (next_char = str; *next_char != '\0' 
-	&& *next_char !='<' && *next_char != '>' 
-	&& *next_char != '|' && *next_char != '&'; 
-	++next_char) 
-	{}
-
-	if (*next_char == '\0') 
-		return -1;
+// O(1): the blocks are kept for the next line
+void arena_reset(struct arena* arena) {
+	arena->current = arena->first;
+	if (arena->first)
+		arena->first->used = 0;
+}
 
-	difference = next_char - str;
-
-	if (*next_char == '|' && *(next_char+1) == '|')
-		return (difference)*10 + 1;
-	if (*next_char == '|' && *(next_char+1) != '|')
-		return difference*10 + 5;
-	if (*next_char == '&' && *(next_char + 1) == '&')
-		return (difference)*10 + 2;
-	if (*next_char == '&' && *(next_char + 1) != '&')
-		return -2;
-	if (*next_char == '<')
-		return difference * 10 + 3;
-	if (*next_char == '>')
-		return difference * 10 + 4;
-	
-	return -2;
+// gives the blocks back
+void arena_free(struct arena* arena) {
+	while (arena->first) {
+		struct arena_block* block = arena->first;
+		arena->first = block->next;
+		free(block);
+	}
+	arena->current = NULL;
 }
 
-// trim ' ' and '\n'
-void trim(char* str) {
-	if (str == NULL)
-		return;
-	
-	int length = strlen(str);
-	int start = 0;
-	int end = length - 1;
-	while ((str[start] == ' ' || str[start] == '\n') && start < length)
-		start++;  
-	while ((str[end] == ' ' || str[end] == '\n') && end >= 0)
-		end--;
+// ------------------------- PARSER ------------------------------
+
+// the input line is read once by the lexer, which produces a token
+// stream (quotes and escapes are already resolved in the words), and
+// the parser turns the tokens into the command tree that is executed
+//
+//   line     := pipeline (('&&' | '||' | ';' | '&') pipeline)* '&'?
+//   pipeline := command ('|' command)*
+//   command  := (word | redirect)+
+//   redirect := ('<' | '>' | '>>' | '2>' | '2>>' | '&>' | '&>>' | '<<<') word
+//             | '2>&1' | '>&2'
+enum { TOKEN_WORD, TOKEN_PIPE, TOKEN_AND, TOKEN_OR, TOKEN_SEMI, TOKEN_BACKGROUND, TOKEN_REDIRECT, TOKEN_END };
+
+enum {
+	REDIRECT_IN, REDIRECT_OUT, REDIRECT_APPEND, REDIRECT_ERR, REDIRECT_ERR_APPEND,
+	REDIRECT_ALL, REDIRECT_ALL_APPEND, REDIRECT_HERE_STRING,
+	// the two without a word
+	REDIRECT_ERR_TO_OUT, REDIRECT_OUT_TO_ERR
+};
 
-	str[end - start + 1] = '\0';
-	str = str + start;
-}
+const char* redirect_operators[] = {"<", ">", ">>", "2>", "2>>", "&>", "&>>", "<<<", "2>&1", ">&2"};
 
-void copy_str(char* dest, char* src, int length) {
-	//experimental
-	//trim front and back spaces
+struct token {
+	int type;
+	int redirect; // the REDIRECT_ type of a TOKEN_REDIRECT
+	char* word;
+};
 
-	int start = 0;
-	int end = length - 1;
-	while (src[start] == ' ' && start < length)
-		start++;  
-	while (src[end] == ' ' && end >= 0)
-		end--;
+struct redirect {
+	int type;
+	char* file; // the word (the string of a here-string), NULL for 2>&1 and >&2
+};
 
-	for (int i = start; i <= end; i++)
-	{
-		dest[i - start] = src[i];
-	}
-	dest[end - start + 1] = '\0';
-}
+struct simple_command {
+	char** argv; // NULL terminated, the command name first
+	int argc;
+	struct redirect* redirects;
+	int no_redirects;
+};
 
-//returns if it can find the first word in src
-bool get_command_name(char* dest, char* src) {
+struct pipeline {
+	struct simple_command* commands;
+	int no_commands;
+	// how it is joined to the next pipeline: TOKEN_AND, TOKEN_OR,
+	// TOKEN_SEMI, TOKEN_BACKGROUND (it ends a list run in the background)
+	// or TOKEN_END
+	int next_operator;
+};
 
-	int dest_index, src_index, src_size;
-	dest_index = 0;
-	src_index = 0;
-	src_size = strlen(src);
-	
-	for (src_index = 0; src[src_index] == ' ' && src_index < src_size; ++src_index) {}
-	
-	if (src_index == src_size)
-		return false;
+struct command_line {
+	struct pipeline* pipelines;
+	int no_pipelines;
+};
 
-	for (; src[src_index] != ' ' && src_index < src_size; ++src_index)
-	{
-		dest[dest_index] = src[src_index];
-		++dest_index;
-	}
-	dest[dest_index] = '\0';
-	return true;
-}
+// returns the number of tokens (the last one is TOKEN_END), or -1 if a
+// quote is not closed
+int lex_line(struct arena* arena, const char* input, struct token** tokens_out) {
+	size_t length = strlen(input);
+	// every token but the end one takes at least one byte of the input
+	struct token* tokens = arena_alloc(arena, (length + 1) * sizeof(*tokens));
+	// the words never need more room than the input itself
+	char* word = arena_alloc(arena, length + 1);
+	const char* pos = input;
+	int no_tokens = 0;
 
-int get_arguments(char** arguments, char* command) {
-	int command_ptr = 0;
-	int command_size = strlen(command);
-	int args_counter = -1;
-
-	//remove the first word
-	while (command[command_ptr] == ' ' && command_ptr < command_size)
-		++command_ptr;
-	while (command[command_ptr] != ' ' && command_ptr < command_size)
-		++command_ptr;
-	while (command[command_ptr] == ' ' && command_ptr < command_size)
-		++command_ptr;
-
-	while (command_ptr < command_size) {
-		int arg_ptr = -1;
-		args_counter++;
-		//remove the beginning spaces
-		while (command[command_ptr] == ' ' && command_ptr < command_size)
-			command_ptr ++;
-		if (command_ptr == command_size)
-			break;
-		
-		if (command[command_ptr] == '"') {
-			++command_ptr;
-			while (command[command_ptr] != '"' && command_ptr < command_size)
-			{
-				arg_ptr++;
-				arguments[args_counter][arg_ptr] = command[command_ptr];
-				command_ptr++;
+	while (true) {
+		while (*pos == ' ' || *pos == '\t')
+			++pos;
+
+		// a comment runs until the end of the line
+		if (*pos == '#')
+			while (*pos && *pos != '\n')
+				++pos;
+
+		struct token* token = &tokens[no_tokens++];
+		token->word = NULL;
+
+		switch (*pos) {
+		case '\0':
+			token->type = TOKEN_END;
+			*tokens_out = tokens;
+			return no_tokens;
+		case '\n':
+		case ';':
+			token->type = TOKEN_SEMI;
+			++pos;
+			continue;
+		case '|':
+			token->type = pos[1] == '|' ? TOKEN_OR : TOKEN_PIPE;
+			pos += pos[1] == '|' ? 2 : 1;
+			continue;
+		case '&':
+			if (pos[1] == '>') {
+				token->type = TOKEN_REDIRECT;
+				token->redirect = pos[2] == '>' ? REDIRECT_ALL_APPEND : REDIRECT_ALL;
+				pos += pos[2] == '>' ? 3 : 2;
+				continue;
+			}
+			token->type = pos[1] == '&' ? TOKEN_AND : TOKEN_BACKGROUND;
+			pos += pos[1] == '&' ? 2 : 1;
+			continue;
+		case '<':
+			token->type = TOKEN_REDIRECT;
+			token->redirect = pos[1] == '<' && pos[2] == '<' ? REDIRECT_HERE_STRING : REDIRECT_IN;
+			pos += token->redirect == REDIRECT_HERE_STRING ? 3 : 1;
+			continue;
+		case '>':
+			token->type = TOKEN_REDIRECT;
+			if (pos[1] == '>') {
+				token->redirect = REDIRECT_APPEND;
+				pos += 2;
 			}
-			//the argument is invalid, so arguments must be empty
-			if (command_ptr == command_size) {
-				arguments[0][0] = '\0';
-				return -1;
+			else if (pos[1] == '&' && pos[2] == '2') {
+				token->redirect = REDIRECT_OUT_TO_ERR;
+				pos += 3;
+			}
+			else {
+				token->redirect = REDIRECT_OUT;
+				++pos;
 			}
-			command_ptr++;
-			arguments[args_counter][command_ptr] = '\0';
 			continue;
 		}
 
-		while (command[command_ptr] != ' ' && command_ptr < command_size) {
-			arg_ptr ++;
-			arguments[args_counter][arg_ptr] = command[command_ptr];
-			command_ptr ++;
+		// stderr redirections start like a word
+		if (pos[0] == '2' && pos[1] == '>') {
+			token->type = TOKEN_REDIRECT;
+			if (pos[2] == '>') {
+				token->redirect = REDIRECT_ERR_APPEND;
+				pos += 3;
+			}
+			else if (pos[2] == '&' && pos[3] == '1') {
+				token->redirect = REDIRECT_ERR_TO_OUT;
+				pos += 4;
+			}
+			else {
+				token->redirect = REDIRECT_ERR;
+				pos += 2;
+			}
+			continue;
 		}
-		arguments[args_counter][arg_ptr + 1] = '\0';
-	}
 
-	arguments[args_counter + 1][0] = '\0';
-	return args_counter + 1;
+		// a word: quotes may start and end anywhere inside it
+		token->type = TOKEN_WORD;
+		token->word = word;
+
+		while (*pos && !strchr(" \t\n;|&<>", *pos)) {
+			if (*pos == '\'') {
+				const char* end = strchr(pos + 1, '\'');
+				if (end == NULL)
+					return -1;
+				memcpy(word, pos + 1, end - pos - 1);
+				word += end - pos - 1;
+				pos = end + 1;
+			}
+			else if (*pos == '"') {
+				for (++pos; *pos != '"'; ++pos) {
+					if (*pos == '\0')
+						return -1;
+					if (*pos == '\\' && (pos[1] == '"' || pos[1] == '\\'))
+						++pos;
+					*word++ = *pos;
+				}
+				++pos;
+			}
+			else if (*pos == '\\' && pos[1] != '\0') {
+				*word++ = pos[1];
+				pos += 2;
+			}
+			else
+				*word++ = *pos++;
+		}
+		*word++ = '\0';
+	}
 }
 
-char** create_arguments_matrix() {
-	char** arguments;
-	arguments = malloc(MAX_NUMBER_ARGUMENTS * sizeof(*arguments));
+// returns NULL on a syntax error
+struct command_line* parse_line(struct arena* arena, struct token* tokens, int no_tokens) {
+	struct command_line* line = arena_alloc(arena, sizeof(*line));
+	// all the pipelines, commands, argvs and redirects are slices of
+	// pools sized from the number of tokens
+	line->pipelines = arena_alloc(arena, no_tokens * sizeof(*line->pipelines));
+	line->no_pipelines = 0;
+	struct simple_command* commands = arena_alloc(arena, no_tokens * sizeof(*commands));
+	char** words = arena_alloc(arena, 2 * no_tokens * sizeof(*words));
+	struct redirect* redirects = arena_alloc(arena, no_tokens * sizeof(*redirects));
+
+	struct token* token = tokens;
+
+	while (token->type != TOKEN_END) {
+		// empty commands between separators (e.g. "a ;; b") are skipped
+		if (token->type == TOKEN_SEMI) {
+			++token;
+			continue;
+		}
 
-	for (int i = 0; i < MAX_NUMBER_ARGUMENTS; i++)
-		arguments[i] = malloc(MAX_INPUT_LENGTH * sizeof(*(arguments[i])));
-	
-	for (int i = 0 ;i < MAX_NUMBER_ARGUMENTS; ++i) {
-		for (int j = 0; j < MAX_INPUT_LENGTH; ++j)
-			arguments[i][j] = '\0';
+		struct pipeline* pipeline = &line->pipelines[line->no_pipelines++];
+		pipeline->commands = commands;
+		pipeline->no_commands = 0;
+
+		while (true) {
+			struct simple_command* command = &pipeline->commands[pipeline->no_commands++];
+			command->argv = words;
+			command->argc = 0;
+			command->redirects = redirects;
+			command->no_redirects = 0;
+
+			while (token->type == TOKEN_WORD || token->type == TOKEN_REDIRECT) {
+				if (token->type == TOKEN_WORD) {
+					command->argv[command->argc++] = token->word;
+					++token;
+					continue;
+				}
+
+				struct redirect* redirect = &command->redirects[command->no_redirects++];
+				redirect->type = token->redirect;
+				redirect->file = NULL;
+				++token;
+
+				if (redirect->type == REDIRECT_ERR_TO_OUT || redirect->type == REDIRECT_OUT_TO_ERR)
+					continue;
+				if (token->type != TOKEN_WORD)
+					return NULL;
+				redirect->file = token->word;
+				++token;
+			}
+
+			if (command->argc == 0)
+				return NULL;
+			command->argv[command->argc] = NULL;
+			words += command->argc + 1;
+			redirects += command->no_redirects;
+
+			if (token->type != TOKEN_PIPE)
+				break;
+			++token;
+		}
+
+		commands += pipeline->no_commands;
+		pipeline->next_operator = token->type;
+
+		if (token->type == TOKEN_BACKGROUND)
+			++token;
+
+		if (token->type == TOKEN_AND || token->type == TOKEN_OR) {
+			++token;
+			// an operator needs a command on both sides
+			if (token->type != TOKEN_WORD && token->type != TOKEN_REDIRECT)
+				return NULL;
+		}
 	}
 
-	return arguments;
+	return line;
 }
 
-void free_arguments_matrix(char** arguments) {
-	for (int i = 0; i < MAX_NUMBER_ARGUMENTS; i++) {
-		if (arguments[i] != NULL)
-			free(arguments[i]);
-	}
-	free(arguments);
+// lex and parse; returns NULL if the line is not valid
+struct command_line* parse_input(struct arena* arena, const char* input) {
+	struct token* tokens;
+	int no_tokens = lex_line(arena, input, &tokens);
+	if (no_tokens < 0)
+		return NULL;
+	return parse_line(arena, tokens, no_tokens);
 }
 
 // ---------------------------------------------------------------------------
 
+// write the whole buffer, retrying short writes
+// returns 0 on success and -1 on error (errno is set)
+int write_all(int fd, const char* buffer, size_t length) {
+	while (length > 0) {
+		ssize_t done = write(fd, buffer, length);
+		if (done < 0 && errno == EINTR)
+			continue;
+		if (done < 0)
+			return -1;
+		buffer += done;
+		length -= done;
+	}
+	return 0;
+}
 
+// growing byte buffer
+struct text_buffer {
+	char* data;
+	size_t length, capacity;
+};
 
+void buffer_reserve(struct text_buffer* buffer, size_t length) {
+	if (buffer->length + length > buffer->capacity) {
+		buffer->capacity = 2 * (buffer->length + length) + 4096;
+		buffer->data = realloc(buffer->data, buffer->capacity);
+	}
+}
 
+void buffer_append(struct text_buffer* buffer, const char* text, size_t length) {
+	buffer_reserve(buffer, length);
+	memcpy(buffer->data + buffer->length, text, length);
+	buffer->length += length;
+}
 
-// write the current path in the commandline
-void print_curr_dir() {
-	if (getcwd(cwd, sizeof(cwd))) 
-		printf("%s", cwd);
-	else 
-		perror("getcwd() error");
+void buffer_puts(struct text_buffer* buffer, const char* text) {
+	buffer_append(buffer, text, strlen(text));
 }
 
-// implement commands
+// write the buffer to fd and empty it
+int buffer_flush(struct text_buffer* buffer, int fd) {
+	int result = write_all(fd, buffer->data, buffer->length);
+	buffer->length = 0;
+	return result;
+}
 
-void funct_ls(char** args) {
-	exit_status = 1;
+// number of '\n' bytes in [buffer, buffer + length)
+// 16 or 32 bytes are compared at once and the masks popcounted
+typedef size_t (*count_function)(const char*, size_t);
 
-	struct dirent** namelist;
-	int no_files = scandir(".", &namelist, NULL, alphasort);
+size_t count_newlines_scalar(const char* buffer, size_t length) {
+	size_t count = 0;
+	for (size_t i = 0; i < length; ++i)
+		count += (buffer[i] == '\n');
+	return count;
+}
 
-	if (no_files == -1) {
-		perror("Error ls");
-		return;
-	}
+#if defined(__x86_64__) || defined(__i386__)
 
-	if (stdout_redirect) {
-		for (int i = 0; i < no_files; ++i) {
-			if (namelist[i]->d_name[0] != '.') {
-				if (namelist[i]->d_type == DT_REG)
-					printf("%s\n", namelist[i]->d_name);
-				else if (namelist[i]->d_type == DT_DIR)
-					printf("%s\n", namelist[i]->d_name);
-				else
-					printf("%s\n", namelist[i]->d_name);
-			}
-		}
+size_t count_newlines_sse2(const char* buffer, size_t length) {
+	const __m128i newline = _mm_set1_epi8('\n');
+	size_t count = 0, i = 0;
+
+	for (; i + 16 <= length; i += 16) {
+		__m128i block = _mm_loadu_si128((const __m128i*)(buffer + i));
+		count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(block, newline)));
 	}
-	else {
-		for (int i = 0; i < no_files; ++i) {
-			if (namelist[i]->d_name[0] != '.') {
-				if (namelist[i]->d_type == DT_REG)
-					printf("%s%s\n", BLUE,namelist[i]->d_name);
-				else if (namelist[i]->d_type == DT_DIR)
-					printf("%s%s\n", GREEN,namelist[i]->d_name);
-				else
-					printf("%s%s\n", CYAN,namelist[i]->d_name);
-			}
-		}		
-		printf("%s", WHITE);
+
+	return count + count_newlines_scalar(buffer + i, length - i);
+}
+
+__attribute__((target("avx2,popcnt")))
+size_t count_newlines_avx2(const char* buffer, size_t length) {
+	const __m256i newline = _mm256_set1_epi8('\n');
+	size_t count = 0, i = 0;
+
+	for (; i + 64 <= length; i += 64) {
+		__m256i first = _mm256_loadu_si256((const __m256i*)(buffer + i));
+		__m256i second = _mm256_loadu_si256((const __m256i*)(buffer + i + 32));
+		uint64_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(first, newline))
+			| (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(second, newline)) << 32;
+		count += __builtin_popcountll(mask);
 	}
 
-	exit_status = 0;
-}	
+	return count + count_newlines_scalar(buffer + i, length - i);
+}
 
-void funct_echo(char** args) {
-	exit_status = 1;
+count_function select_count_newlines() {
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return count_newlines_avx2;
+	return count_newlines_sse2;
+}
 
-	for (int i = 0; args[i][0] != '\0'; ++i) 
-		printf("%s ", args[i]);
-	printf("\n");
+#else
 
-	exit_status = 0;
+count_function select_count_newlines() {
+	return count_newlines_scalar;
 }
 
-void funct_touch(char** args) {
-	exit_status = 1;
+#endif
 
-	for (int i = 0; args[i][0] != '\0'; ++i) { 
-		FILE* file = fopen(args[i], "w");
-		if (file == NULL) {
-			perror("Error touch");
-			return;
-		}
-		else 
-			fclose(file);
-	}
+size_t count_newlines(const char* buffer, size_t length) {
+	static count_function count = NULL;
+	if (count == NULL)
+		count = select_count_newlines();
+	return count(buffer, length);
+}
 
-	exit_status = 0;
+// lines and words of a text, counted a block at a time; in_word says
+// whether the last byte counted was part of a word, so a word cut
+// between two blocks is counted once
+// whitespace is the C locale set: ' ', '\t', '\n', '\v', '\f' and '\r'
+struct text_counts {
+	size_t lines, words;
+	bool in_word;
+};
+
+typedef void (*count_text_function)(const char*, size_t, struct text_counts*);
+
+void count_text_scalar(const char* buffer, size_t length, struct text_counts* counts) {
+	bool in_word = counts->in_word;
+	for (size_t i = 0; i < length; ++i) {
+		unsigned char c = buffer[i];
+		bool space = c == ' ' || (unsigned char)(c - '\t') <= '\r' - '\t';
+		counts->lines += (c == '\n');
+		counts->words += (!space && !in_word);
+		in_word = !space;
+	}
+	counts->in_word = in_word;
 }
 
-void funct_mkdir(char** args) {
-	exit_status = 1;
+#if defined(__x86_64__) || defined(__i386__)
 
-	for (int i = 0; args[i][0] != '\0'; ++i) { 
-		if (mkdir(args[i], 0777) == -1) {
-			perror("Error mkdir");
-			return;
+// one 64 byte block, from the masks of its whitespace and newlines:
+// a word starts at every byte that is not a space and follows one
+static inline void count_text_masks(uint64_t spaces, uint64_t newlines, struct text_counts* counts, uint64_t* carry) {
+	uint64_t letters = ~spaces;
+	counts->lines += __builtin_popcountll(newlines);
+	counts->words += __builtin_popcountll(letters & ~(letters << 1 | *carry));
+	*carry = letters >> 63;
+}
+
+void count_text_sse2(const char* buffer, size_t length, struct text_counts* counts) {
+	const __m128i blank = _mm_set1_epi8(' ');
+	const __m128i newline = _mm_set1_epi8('\n');
+	const __m128i tab = _mm_set1_epi8('\t');
+	const __m128i controls = _mm_set1_epi8('\r' - '\t');
+	uint64_t carry = counts->in_word;
+	size_t i = 0;
+
+	for (; i + 64 <= length; i += 64) {
+		uint64_t spaces = 0, newlines = 0;
+		for (int part = 0; part < 4; ++part) {
+			__m128i block = _mm_loadu_si128((const __m128i*)(buffer + i + 16 * part));
+			// \t to \r are the bytes whose distance from \t is at most 4
+			__m128i offset = _mm_sub_epi8(block, tab);
+			__m128i control = _mm_cmpeq_epi8(_mm_min_epu8(offset, controls), offset);
+			__m128i space = _mm_or_si128(_mm_cmpeq_epi8(block, blank), control);
+			spaces |= (uint64_t)(uint16_t)_mm_movemask_epi8(space) << 16 * part;
+			newlines |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(block, newline)) << 16 * part;
 		}
+		count_text_masks(spaces, newlines, counts, &carry);
 	}
 
-	exit_status = 0;
+	counts->in_word = carry;
+	count_text_scalar(buffer + i, length - i, counts);
 }
 
-void funct_grep(char** args) {
-	exit_status = 1;
+// the whitespace bytes are looked up by their low 4 bits: a byte is a
+// space when the table holds the byte itself at that place (pshufb
+// gives 0 for bytes with the high bit set, which are never spaces)
+__attribute__((target("avx2,popcnt")))
+void count_text_avx2(const char* buffer, size_t length, struct text_counts* counts) {
+	const __m256i table = _mm256_setr_epi8(' ', 0, 0, 0, 0, 0, 0, 0, 0, '\t', '\n', '\v', '\f', '\r', 0, 0,
+		' ', 0, 0, 0, 0, 0, 0, 0, 0, '\t', '\n', '\v', '\f', '\r', 0, 0);
+	const __m256i newline = _mm256_set1_epi8('\n');
+	uint64_t carry = counts->in_word;
+	size_t i = 0;
+
+	for (; i + 64 <= length; i += 64) {
+		__m256i first = _mm256_loadu_si256((const __m256i*)(buffer + i));
+		__m256i second = _mm256_loadu_si256((const __m256i*)(buffer + i + 32));
+
+		uint64_t spaces = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_shuffle_epi8(table, first), first))
+			| (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_shuffle_epi8(table, second), second)) << 32;
+		uint64_t newlines = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(first, newline))
+			| (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(second, newline)) << 32;
+
+		count_text_masks(spaces, newlines, counts, &carry);
+	}
 
-	bool single_arg = true;
-	if (args[2][0] != '\0')
-		single_arg = false;
+	counts->in_word = carry;
+	count_text_scalar(buffer + i, length - i, counts);
+}
 
-	char chunk[MAX_INPUT_LENGTH + 10];
-	int len = strlen(args[0]);
+count_text_function select_count_text() {
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return count_text_avx2;
+	return count_text_sse2;
+}
 
-	for (int i = 1; args[i][0] != '\0'; ++i) {
-		FILE* fin = fopen(args[i], "r");
+#else
 
-		if (fin == NULL) {
-			perror("Error grep");
-			continue;
-		}
+count_text_function select_count_text() {
+	return count_text_scalar;
+}
 
-		while(fgets(chunk, sizeof(chunk), fin) != NULL) {
-			if(strstr(chunk, args[0])) {
-				if(stdout_redirect) {
-					if (!single_arg)
-						printf("%s: ", args[i]);
+#endif
 
-					char* found = strstr(chunk, args[0]);
-					char* last = chunk;
+void count_text(const char* buffer, size_t length, struct text_counts* counts) {
+	static count_text_function count = NULL;
+	if (count == NULL)
+		count = select_count_text();
+	count(buffer, length, counts);
+}
 
-					while (found) {
-						for (char* p = last; p != found; ++p)
-							printf("%c", *p);
+// ------------------------- TRACING -----------------------------
+
+// with tracing on (shell -X, or trace on) every stage of a command
+// (parse, lookup, redirect, spawn, fork, run, wait) is recorded with
+// its monotonic start and duration in a ring buffer, and trace dump
+// writes the ring as chrome trace events (chrome://tracing, perfetto)
+// a writer takes a slot with one atomic add and publishes it by
+// storing its ticket + 1 in the slot's sequence, so threads never lock
+// and a full ring overwrites the oldest events
+// stages run by forked pipeline stages are recorded in their own copy
+// of the ring and are lost
+struct trace_event {
+	uint64_t sequence; // ticket + 1 once written, 0 while being written
+	const char* name;
+	char detail[32];
+	uint64_t start, duration;
+	pid_t tid;
+};
 
-						if (*(found + len) == '\0')
-							break;
+struct trace_event* trace_ring;
+uint64_t trace_head;
+bool tracing = false;
 
-						last = found + len;
-						found = strstr(found + len, args[0]);
-						printf("%s", args[0]);
-					}
+uint64_t now_ns() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
 
-					printf("%s", last);
-				}
-				else {
-					if (!single_arg)
-						printf("%s%s: ", MAGENTA, args[i]);
+// the start of a stage, 0 when it is not traced
+uint64_t trace_start() {
+	return tracing ? now_ns() : 0;
+}
 
-					char* found = strstr(chunk, args[0]);
-					char* last = chunk;
+void trace_enable(bool enable) {
+	if (enable && trace_ring == NULL)
+		trace_ring = calloc(TRACE_RING_SIZE, sizeof(*trace_ring));
+	tracing = enable;
+}
 
-					while (found) {
-						for (char* p = last; p != found; ++p)
-							printf("%s%c", WHITE, *p);
+// record a stage that began at start (from trace_start)
+void trace_event(const char* name, const char* detail, uint64_t start) {
+	if (!tracing || start == 0)
+		return;
+	uint64_t end = now_ns();
 
-						if (*(found + len) == '\0')
-							break;
+	uint64_t ticket = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED);
+	struct trace_event* event = &trace_ring[ticket & (TRACE_RING_SIZE - 1)];
+	__atomic_store_n(&event->sequence, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
 
-						last = found + len;
-						found = strstr(found + len, args[0]);
-						printf("%s%s", RED, args[0]);
-					}
+	event->name = name;
+	snprintf(event->detail, sizeof(event->detail), "%s", detail ? detail : "");
+	event->start = start;
+	event->duration = end - start;
+	event->tid = syscall(SYS_gettid);
 
-					printf("%s%s", WHITE, last);
-				}
-			}
+	__atomic_store_n(&event->sequence, ticket + 1, __ATOMIC_RELEASE);
+}
+
+// write the events in the ring as a chrome trace, oldest first
+// returns false if the file cannot be written
+bool trace_dump(const char* path) {
+	FILE* file = fopen(path, "w");
+	if (file == NULL)
+		return false;
+
+	uint64_t head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+	uint64_t first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+	bool comma = false;
+	fprintf(file, "{\"traceEvents\":[\n");
+
+	for (uint64_t ticket = first; trace_ring && ticket < head; ++ticket) {
+		struct trace_event* slot = &trace_ring[ticket & (TRACE_RING_SIZE - 1)];
+		if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != ticket + 1)
+			continue;
+		struct trace_event event = *slot;
+		// overwritten while it was copied
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) != ticket + 1)
+			continue;
+
+		// the detail is a command name or a file, only quotes and
+		// backslashes need escaping
+		char detail[2 * sizeof(event.detail)];
+		size_t length = 0;
+		for (char* c = event.detail; *c; ++c) {
+			if (*c == '"' || *c == '\\')
+				detail[length++] = '\\';
+			detail[length++] = (unsigned char)*c < ' ' ? ' ' : *c;
 		}
+		detail[length] = '\0';
 
-		fclose(fin);
+		fprintf(file, "%s{\"name\":\"%s\",\"cat\":\"shell\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{\"detail\":\"%s\"}}",
+			comma ? ",\n" : "", event.name, event.start / 1e3, event.duration / 1e3, getpid(), event.tid, detail);
+		comma = true;
 	}
 
-	exit_status = 0;
+	fprintf(file, "\n]}\n");
+	return fclose(file) == 0;
 }
 
-void funct_cd(char** args) {
-	exit_status = 1;
+// per builtin call counts and run times, kept in the shell process:
+// the time of a call goes to the bucket of its highest bit in
+// microseconds, so bucket b holds calls of [2^(b-1), 2^b) us
+struct builtin_stats {
+	uint64_t calls, total_ns, max_ns;
+	uint64_t bytes; // written on stdout
+	uint64_t buckets[STATS_BUCKETS];
+};
 
-	if (chdir(args[0]) != 0) {
-		perror("Error cd");
-		return;
+struct builtin_stats* command_stats; // one per command, by index
+int no_command_stats;
+
+void stats_record(int command_idx, uint64_t ns, uint64_t bytes) {
+	// grows with the commands loaded from plugins
+	if (command_idx >= no_command_stats) {
+		command_stats = realloc(command_stats, no_commands * sizeof(*command_stats));
+		memset(command_stats + no_command_stats, 0, (no_commands - no_command_stats) * sizeof(*command_stats));
+		no_command_stats = no_commands;
 	}
 
-	exit_status = 0;
+	struct builtin_stats* stats = &command_stats[command_idx];
+	uint64_t us = ns / 1000;
+	int bucket = us ? 64 - __builtin_clzll(us) : 0;
+	if (bucket >= STATS_BUCKETS)
+		bucket = STATS_BUCKETS - 1;
+
+	++stats->calls;
+	stats->total_ns += ns;
+	stats->bytes += bytes;
+	if (ns > stats->max_ns)
+		stats->max_ns = ns;
+	++stats->buckets[bucket];
 }
 
-void funct_mv(char** args) {
-	exit_status = 1;
+// -------------------------- OUTPUT -----------------------------
+
+// the builtins write through one sink per fd: a buffer of
+// OUTPUT_BUFFER_SIZE bytes that goes out when it fills up, when the
+// command ends and before the shell forks, spawns or moves its fds, so
+// output to a file or a pipe costs one write per buffer instead of one
+// per line; a write too big for the buffer goes out at once, behind
+// what is buffered, in one writev
+// whether the fd is a terminal is checked once per command: only a
+// terminal gets colours, and it gets every line as soon as it ends
+struct output_sink {
+	int fd;
+	char* data;
+	size_t length;
+	bool terminal, colour;
+	uint64_t bytes; // everything written through the sink, for time and stats
+};
 
-	char* src = args[0];
-	char* dst = args[1];
-    FILE *f_read, *f_write;
+struct output_sink stdout_sink = {STDOUT_FILENO};
+struct output_sink stderr_sink = {STDERR_FILENO};
 
-    f_read = fopen(src, "r"); 
-    if(f_read == NULL) {
-		perror("Source file does not exist.\n"); 
-		return;
+// write every iovec, retrying short writes
+// returns 0 on success and -1 on error (errno is set)
+int writev_all(int fd, struct iovec* iov, int no_iov) {
+	while (no_iov > 0) {
+		ssize_t done = writev(fd, iov, no_iov > IOV_MAX ? IOV_MAX : no_iov);
+		if (done < 0 && errno == EINTR)
+			continue;
+		if (done < 0)
+			return -1;
+
+		while (no_iov > 0 && (size_t)done >= iov->iov_len) {
+			done -= iov->iov_len;
+			++iov;
+			--no_iov;
+		}
+		if (no_iov > 0) {
+			iov->iov_base = (char*)iov->iov_base + done;
+			iov->iov_len -= done;
+		}
 	}
+	return 0;
+}
 
-    f_write = fopen(dst, "ab+"); 
-    fclose(f_write);
+// called at the start of every builtin
+void sink_begin(struct output_sink* sink) {
+	sink->terminal = sink->colour = isatty(sink->fd);
+}
 
-    f_write = fopen(dst, "w+");
-    if(f_write == NULL) {
-        perror("Error while creating destination file.\n");
-        fclose(f_read); 
-		return;
-    }
+int sink_flush(struct output_sink* sink) {
+	if (sink->length == 0)
+		return 0;
+	uint64_t start = trace_start();
+	int result = write_all(sink->fd, sink->data, sink->length);
+	trace_event("write", NULL, start);
+	sink->length = 0;
+	return result;
+}
 
-    if(open(dst, O_WRONLY)<0 || open(src, O_RDONLY)<0) {
-		perror("An error occured"); 
-		return;
+// the iovecs are appended to the buffer, or written with it if they
+// don't fit; returns -1 on a write error
+int sink_writev(struct output_sink* sink, struct iovec* iov, int no_iov) {
+	size_t length = 0;
+	for (int i = 0; i < no_iov; ++i)
+		length += iov[i].iov_len;
+	sink->bytes += length;
+
+	if (sink->length + length <= OUTPUT_BUFFER_SIZE) {
+		if (sink->data == NULL)
+			sink->data = malloc(OUTPUT_BUFFER_SIZE);
+		for (int i = 0; i < no_iov; ++i) {
+			memcpy(sink->data + sink->length, iov[i].iov_base, iov[i].iov_len);
+			sink->length += iov[i].iov_len;
+		}
+		bool line_end = sink->terminal && no_iov > 0 && memchr(iov[no_iov - 1].iov_base, '\n', iov[no_iov - 1].iov_len);
+		return sink->length == OUTPUT_BUFFER_SIZE || line_end ? sink_flush(sink) : 0;
 	}
 
-    char cp;
-    while((cp=getc(f_read))!=EOF)  putc(cp,f_write);
+	// the buffer goes first, in the same system call
+	struct iovec all[no_iov + 1];
+	all[0] = (struct iovec){sink->data, sink->length};
+	memcpy(all + 1, iov, no_iov * sizeof(*iov));
 
-    fclose(f_read); 
-	fclose(f_write);
+	uint64_t start = trace_start();
+	int result = writev_all(sink->fd, all, no_iov + 1);
+	trace_event("write", NULL, start);
+	sink->length = 0;
+	return result;
+}
 
-	int fd = open(args[0], O_RDONLY);
-	if (fd < 0) {
-		perror("File does not exist");
-		return;
+int sink_write(struct output_sink* sink, const char* text, size_t length) {
+	// the common case, a short piece that fits
+	if (sink->data && sink->length + length < OUTPUT_BUFFER_SIZE) {
+		memcpy(sink->data + sink->length, text, length);
+		sink->length += length;
+		sink->bytes += length;
+		return sink->terminal && memchr(text, '\n', length) ? sink_flush(sink) : 0;
 	}
-	close(fd);
+	struct iovec iov = {(void*)text, length};
+	return sink_writev(sink, &iov, 1);
+}
 
-	if (unlink(args[0])) {
-		perror("An error occured while deleting the file\n");
-		return;
-	}
-	
-	exit_status = 0;
+int sink_puts(struct output_sink* sink, const char* text) {
+	return sink_write(sink, text, strlen(text));
 }
 
-void funct_cp(char** args) {
-	exit_status = 1;
+int sink_printf(struct output_sink* sink, const char* format, ...) {
+	if (sink->data == NULL)
+		sink->data = malloc(OUTPUT_BUFFER_SIZE);
 
-	char* src = args[0];
-	char* dst = args[1];
-    FILE *f_read, *f_write;
+	va_list args;
+	va_start(args, format);
+	size_t room = OUTPUT_BUFFER_SIZE - sink->length;
+	int length = vsnprintf(sink->data + sink->length, room, format, args);
+	va_end(args);
+	if (length < 0)
+		return -1;
 
-    f_read = fopen(src, "r"); 
-    if(f_read == NULL) {
-		perror("Source file does not exist.\n"); 
-		return;
+	if ((size_t)length < room) {
+		bool line_end = sink->terminal && memchr(sink->data + sink->length, '\n', length);
+		sink->length += length;
+		sink->bytes += length;
+		return line_end ? sink_flush(sink) : 0;
 	}
 
-    f_write = fopen(dst, "ab+"); 
-    fclose(f_write);
+	// it did not fit, format it apart
+	char* text = malloc(length + 1);
+	va_start(args, format);
+	vsnprintf(text, length + 1, format, args);
+	va_end(args);
+	int result = sink_write(sink, text, length);
+	free(text);
+	return result;
+}
 
-    f_write = fopen(dst, "w+"); //deschid pt scris
-    if(f_write == NULL) {
-        perror("Error while creating destination file.\n");
-        fclose(f_read); 
-		return;
-    }
+// write a text buffer through the sink and empty it
+int sink_write_buffer(struct output_sink* sink, struct text_buffer* buffer) {
+	int result = sink_write(sink, buffer->data, buffer->length);
+	buffer->length = 0;
+	return result;
+}
 
-    if(open(dst, O_WRONLY)<0 || open(src, O_RDONLY)<0) {
-		perror("An error occured"); 
-		return;
-	}
+// everything buffered for the terminal, a file or a pipe goes out
+// before the shell forks, spawns or changes fds
+void flush_output() {
+	sink_flush(&stdout_sink);
+	sink_flush(&stderr_sink);
+	fflush(stdout);
+	fflush(stderr);
+}
 
-    char cp;
-    while((cp=getc(f_read))!=EOF)  putc(cp,f_write);
+// ------------------------- HISTORY -----------------------------
+
+// the history is one append-only file of entries, each a 4 byte length
+// followed by the command (no '\0'), shared by the history builtin,
+// the arrow keys and ctrl-r; the file is mapped at startup and only
+// read on first use, the commands typed since live in history_arena
+//
+// at most history_size entries are kept (HISTSIZE, default
+// HISTORY_SIZE); a file with twice as many is rewritten on load
+//
+// substring search goes through a trigram index built on the first
+// search: for every 3 byte sequence, the ids of the entries that
+// contain it, so only the entries in the shortest list of the pattern's
+// trigrams are compared
+struct history_entry {
+	const char* text;
+	uint32_t length;
+};
 
-    fclose(f_read); 
-	fclose(f_write);
+struct trigram_list {
+	uint32_t key; // the 3 bytes and bit 24, 0 for an empty slot
+	uint32_t no_ids, capacity;
+	bool common; // in too many entries to be worth a list
+	uint32_t* ids;
+};
 
+struct history_store {
+	int fd; // the file, opened for appending, -1 when not kept
+	char* path;
+	char* mapped;
+	size_t mapped_size;
+	bool loaded;
+	struct history_entry* entries;
+	int no_entries, capacity;
+	struct trigram_list* trigrams; // NULL until the first search
+	uint32_t trigram_capacity, no_trigrams; // a power of 2
+};
+
+struct history_store history = {-1};
+struct arena history_arena;
+int history_size = HISTORY_SIZE;
+
+// open and map the history file, nothing is read yet
+void history_open() {
+	char* size = getenv("HISTSIZE");
+	if (size && atoi(size) > 0)
+		history_size = atoi(size);
+
+	char* path = getenv("HISTFILE");
+	if (path)
+		history.path = strdup(path);
+	else if (getenv("HOME")) {
+		history.path = malloc(strlen(getenv("HOME")) + sizeof("/" HISTORY_FILE));
+		sprintf(history.path, "%s/%s", getenv("HOME"), HISTORY_FILE);
+	}
+	else
+		return;
+
+	history.fd = open(history.path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+	if (history.fd < 0) {
+		fprintf(stderr, "Error history: %s: %s\n", history.path, strerror(errno));
+		return;
+	}
+
+	struct stat st;
+	if (fstat(history.fd, &st) == 0 && st.st_size > 0) {
+		history.mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, history.fd, 0);
+		if (history.mapped == MAP_FAILED)
+			history.mapped = NULL;
+		else
+			history.mapped_size = st.st_size;
+	}
+}
+
+void history_push(const char* text, uint32_t length) {
+	if (history.no_entries == history.capacity) {
+		history.capacity = history.capacity ? 2 * history.capacity : 1024;
+		history.entries = realloc(history.entries, history.capacity * sizeof(*history.entries));
+	}
+	history.entries[history.no_entries++] = (struct history_entry){text, length};
+}
+
+void trigram_index_free() {
+	for (uint32_t i = 0; i < history.trigram_capacity; ++i)
+		free(history.trigrams[i].ids);
+	free(history.trigrams);
+	history.trigrams = NULL;
+	history.trigram_capacity = history.no_trigrams = 0;
+}
+
+// drop the oldest entries once there are twice as many as kept
+// the typed commands still kept move to a new arena and the old one is
+// freed, so a long session holds at most 2 * history_size commands
+void history_trim() {
+	if (history.no_entries < 2 * history_size)
+		return;
+
+	int dropped = history.no_entries - history_size;
+	memmove(history.entries, history.entries + dropped, history_size * sizeof(*history.entries));
+	history.no_entries = history_size;
+
+	struct arena kept = {NULL, NULL};
+	for (int i = 0; i < history.no_entries; ++i) {
+		struct history_entry* entry = &history.entries[i];
+		bool mapped = history.mapped && entry->text >= history.mapped && entry->text < history.mapped + history.mapped_size;
+		if (!mapped)
+			entry->text = arena_strndup(&kept, entry->text, entry->length);
+	}
+	arena_free(&history_arena);
+	history_arena = kept;
+
+	// the ids changed, the index is built again on the next search
+	if (history.trigrams)
+		trigram_index_free();
+}
+
+// write the last history_size entries to a new file, which replaces the old
+void history_rewrite() {
+	char* temporary = malloc(strlen(history.path) + 5);
+	sprintf(temporary, "%s.new", history.path);
+
+	int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		free(temporary);
+		return;
+	}
+
+	struct text_buffer buffer = {NULL, 0, 0};
+	int first = history.no_entries > history_size ? history.no_entries - history_size : 0;
+	for (int i = first; i < history.no_entries; ++i) {
+		buffer_append(&buffer, (char*)&history.entries[i].length, sizeof(uint32_t));
+		buffer_append(&buffer, history.entries[i].text, history.entries[i].length);
+	}
+	bool failed = buffer_flush(&buffer, fd) < 0;
+	free(buffer.data);
+	close(fd);
+
+	if (failed || rename(temporary, history.path) < 0) {
+		unlink(temporary);
+		free(temporary);
+		return;
+	}
+	free(temporary);
+
+	// the entries point into the old mapping, which stays valid
+	int new_fd = open(history.path, O_RDWR | O_APPEND | O_CLOEXEC);
+	if (new_fd >= 0) {
+		close(history.fd);
+		history.fd = new_fd;
+	}
+}
+
+// read the entries of the mapped file, on first use
+void history_load() {
+	if (history.loaded)
+		return;
+	history.loaded = true;
+
+	size_t offset = 0;
+	int no_file_entries = 0;
+	while (offset + sizeof(uint32_t) <= history.mapped_size) {
+		uint32_t length;
+		memcpy(&length, history.mapped + offset, sizeof(length));
+		// a write cut short at the end of the file
+		if (length > history.mapped_size - offset - sizeof(length))
+			break;
+
+		history_push(history.mapped + offset + sizeof(length), length);
+		offset += sizeof(length) + length;
+		++no_file_entries;
+		history_trim();
+	}
+
+	if (no_file_entries >= 2 * history_size || offset < history.mapped_size)
+		history_rewrite();
+}
+
+#define TRIGRAM(text, i) ((text)[i] | (text)[(i) + 1] << 8 | (text)[(i) + 2] << 16 | 1 << 24)
+
+struct trigram_list* trigram_slot(uint32_t key) {
+	// the top bits of a multiplicative hash, the low ones barely mix
+	// an empty index has a single free slot, so every lookup misses
+	uint32_t mask = history.trigram_capacity ? history.trigram_capacity - 1 : 0;
+	uint32_t i = (uint32_t)((uint64_t)key * 0x9e3779b97f4a7c15u >> 32) & mask;
+	while (history.trigrams[i].key != 0 && history.trigrams[i].key != key)
+		i = (i + 1) & mask;
+	return &history.trigrams[i];
+}
+
+// the list of a trigram, added if it is new
+struct trigram_list* trigram_list(uint32_t key) {
+	// keep the table at most half full
+	if (2 * (history.no_trigrams + 1) > history.trigram_capacity) {
+		struct trigram_list* old = history.trigrams;
+		uint32_t old_capacity = history.trigram_capacity;
+
+		history.trigram_capacity = old_capacity ? 2 * old_capacity : 4096;
+		history.trigrams = calloc(history.trigram_capacity, sizeof(*history.trigrams));
+		for (uint32_t i = 0; i < old_capacity; ++i)
+			if (old[i].key)
+				*trigram_slot(old[i].key) = old[i];
+		free(old);
+	}
+
+	struct trigram_list* list = trigram_slot(key);
+	if (list->key == 0) {
+		list->key = key;
+		++history.no_trigrams;
+	}
+	return list;
+}
+
+void trigram_list_add(struct trigram_list* list, uint32_t id) {
+	// ids come in increasing order, a trigram seen twice in one entry
+	// is stored once
+	if (list->common || (list->no_ids > 0 && list->ids[list->no_ids - 1] == id))
+		return;
+	if (list->no_ids == list->capacity) {
+		list->capacity = list->capacity ? 2 * list->capacity : 4;
+		list->ids = realloc(list->ids, list->capacity * sizeof(uint32_t));
+	}
+	list->ids[list->no_ids++] = id;
+}
+
+// index an entry added after the index was built
+void trigram_index_entry(uint32_t id) {
+	const unsigned char* text = (const unsigned char*)history.entries[id].text;
+	for (uint32_t i = 0; i + 3 <= history.entries[id].length; ++i)
+		trigram_list_add(trigram_list(TRIGRAM(text, i)), id);
+}
+
+// two passes, the first counts the entries of every trigram so the
+// lists are allocated once; a trigram in more than 1 / TRIGRAM_COMMON
+// of the entries filters out little and costs the most memory, it gets
+// no list and is left out of the searches
+void trigram_index_build() {
+	if (history.trigrams)
+		return;
+	// the first trigram grows the table to its full initial size
+	history.trigram_capacity = 0;
+	history.trigrams = calloc(1, sizeof(*history.trigrams));
+
+	for (int id = 0; id < history.no_entries; ++id) {
+		const unsigned char* text = (const unsigned char*)history.entries[id].text;
+		for (uint32_t i = 0; i + 3 <= history.entries[id].length; ++i) {
+			struct trigram_list* list = trigram_list(TRIGRAM(text, i));
+			// while counting, capacity holds the last id + 1
+			if (list->capacity != (uint32_t)id + 1) {
+				list->capacity = id + 1;
+				++list->no_ids;
+			}
+		}
+	}
+
+	for (uint32_t i = 0; i < history.trigram_capacity; ++i) {
+		struct trigram_list* list = &history.trigrams[i];
+		if (list->key == 0)
+			continue;
+		list->common = list->no_ids > TRIGRAM_MIN_COMMON && list->no_ids > history.no_entries / TRIGRAM_COMMON;
+		list->capacity = list->common ? 0 : list->no_ids;
+		list->ids = list->common ? NULL : malloc(list->capacity * sizeof(uint32_t));
+		list->no_ids = 0;
+	}
+
+	for (int id = 0; id < history.no_entries; ++id) {
+		const unsigned char* text = (const unsigned char*)history.entries[id].text;
+		for (uint32_t i = 0; i + 3 <= history.entries[id].length; ++i)
+			trigram_list_add(trigram_slot(TRIGRAM(text, i)), id);
+	}
+}
+
+// the ids of the entries that may contain the pattern, in increasing order
+// returns false when all entries have to be compared
+bool history_candidates(const char* pattern, size_t length, const uint32_t** ids, uint32_t* no_ids) {
+	if (length < 3)
+		return false;
+
+	trigram_index_build();
+	bool found = false;
+
+	const unsigned char* text = (const unsigned char*)pattern;
+	for (size_t i = 0; i + 3 <= length; ++i) {
+		struct trigram_list* list = trigram_slot(TRIGRAM(text, i));
+		// no entry has it
+		if (list->key == 0) {
+			*ids = NULL;
+			*no_ids = 0;
+			return true;
+		}
+		if (list->common)
+			continue;
+		if (!found || list->no_ids < *no_ids) {
+			*ids = list->ids;
+			*no_ids = list->no_ids;
+			found = true;
+		}
+	}
+	return found;
+}
+
+bool history_matches(int id, const char* pattern, size_t length) {
+	return memmem(history.entries[id].text, history.entries[id].length, pattern, length) != NULL;
+}
+
+// the newest entry before id `before` that contains the pattern, or -1
+int history_search_back(const char* pattern, int before) {
+	history_load();
+	size_t length = strlen(pattern);
+	if (before > history.no_entries)
+		before = history.no_entries;
+
+	const uint32_t* ids;
+	uint32_t no_ids;
+	if (!history_candidates(pattern, length, &ids, &no_ids)) {
+		for (int id = before - 1; id >= 0; --id)
+			if (history_matches(id, pattern, length))
+				return id;
+		return -1;
+	}
+
+	// the candidates below `before`
+	uint32_t lo = 0, hi = no_ids;
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+		if (ids[mid] < (uint32_t)before)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	while (lo-- > 0)
+		if (history_matches(ids[lo], pattern, length))
+			return ids[lo];
+	return -1;
+}
+
+void add_command_to_history(char* str) {
+	history_load();
+	uint32_t length = strlen(str);
+
+	// appended with one write, so shells sharing the file don't interleave
+	if (history.fd >= 0) {
+		char* record = malloc(sizeof(length) + length);
+		memcpy(record, &length, sizeof(length));
+		memcpy(record + sizeof(length), str, length);
+		if (write_all(history.fd, record, sizeof(length) + length) < 0)
+			perror("Error history");
+		free(record);
+	}
+
+	history_push(arena_strndup(&history_arena, str, length), length);
+	history_trim();
+	if (history.trigrams)
+		trigram_index_entry(history.no_entries - 1);
+}
+
+void print_history_entry(int id) {
+	struct iovec line[2] = {{(void*)history.entries[id].text, history.entries[id].length}, {"\n", 1}};
+	sink_writev(&stdout_sink, line, 2);
+}
+
+void print_history() {
+	history_load();
+	for (int id = 0; id < history.no_entries; ++id)
+		print_history_entry(id);
+}
+
+// entries containing the pattern, oldest first
+void print_history_matches(const char* pattern) {
+	history_load();
+	size_t length = strlen(pattern);
+
+	const uint32_t* ids;
+	uint32_t no_ids;
+	if (!history_candidates(pattern, length, &ids, &no_ids)) {
+		for (int id = 0; id < history.no_entries; ++id)
+			if (history_matches(id, pattern, length))
+				print_history_entry(id);
+		return;
+	}
+	for (uint32_t i = 0; i < no_ids; ++i)
+		if (history_matches(ids[i], pattern, length))
+			print_history_entry(ids[i]);
+}
+
+// key bindings: the arrows walk the history, ctrl-r searches back for
+// the text typed before it (again for older matches)
+int history_cursor = -1; // the entry shown, -1 for the line being typed
+char* history_draft = NULL; // the line being typed, while an entry is shown
+char* search_pattern = NULL;
+int search_position;
+
+void show_history_line(const char* text, size_t length) {
+	char* line = strndup(text, length);
+	rl_replace_line(line, 0);
+	rl_point = rl_end;
+	free(line);
+}
+
+int history_key_up(int count, int key) {
+	history_load();
+	int position = history_cursor == -1 ? history.no_entries : history_cursor;
+	if (position == 0) {
+		rl_ding();
+		return 0;
+	}
+
+	if (history_cursor == -1) {
+		free(history_draft);
+		history_draft = strdup(rl_line_buffer);
+	}
+	history_cursor = position - 1;
+	show_history_line(history.entries[history_cursor].text, history.entries[history_cursor].length);
+	return 0;
+}
+
+int history_key_down(int count, int key) {
+	if (history_cursor == -1) {
+		rl_ding();
+		return 0;
+	}
+
+	if (++history_cursor < history.no_entries) {
+		show_history_line(history.entries[history_cursor].text, history.entries[history_cursor].length);
+		return 0;
+	}
+
+	history_cursor = -1;
+	show_history_line(history_draft ? history_draft : "", history_draft ? strlen(history_draft) : 0);
+	return 0;
+}
+
+int history_key_search(int count, int key) {
+	history_load();
+	if (rl_last_func != history_key_search) {
+		free(search_pattern);
+		search_pattern = strdup(rl_line_buffer);
+		search_position = history.no_entries;
+		if (history_cursor == -1) {
+			free(history_draft);
+			history_draft = strdup(rl_line_buffer);
+		}
+	}
+
+	// a match that is the line already shown is skipped
+	int id = search_position;
+	do
+		id = history_search_back(search_pattern, id);
+	while (id >= 0 && history.entries[id].length == (uint32_t)rl_end
+		&& memcmp(history.entries[id].text, rl_line_buffer, rl_end) == 0);
+	if (id < 0) {
+		rl_ding();
+		return 0;
+	}
+
+	search_position = history_cursor = id;
+	show_history_line(history.entries[id].text, history.entries[id].length);
+	return 0;
+}
+
+void history_bind_keys() {
+	rl_bind_keyseq("\\e[A", history_key_up);
+	rl_bind_keyseq("\\eOA", history_key_up);
+	rl_bind_keyseq("\\e[B", history_key_down);
+	rl_bind_keyseq("\\eOB", history_key_down);
+	rl_bind_key('r' & 0x1f, history_key_search);
+}
+
+// ------------------------ WORK POOL ----------------------------
+
+// thread pool with one deque per worker
+// a worker takes its newest task first (depth first, keeps few
+// directories open) and steals the oldest task of another worker
+// when its own deque is empty
+struct work_item {
+	void (*run)(void* arg);
+	void* arg;
+};
+
+struct work_deque {
+	pthread_mutex_t lock;
+	struct work_item* items;
+	long head, tail, capacity; // items live in [head, tail) modulo capacity
+};
+
+struct work_pool {
+	int no_workers;
+	pthread_t* threads;
+	struct work_deque* deques;
+	pthread_mutex_t lock;
+	pthread_cond_t wake, done;
+	long queued;  // tasks waiting inside the deques
+	long pending; // tasks submitted and not finished yet
+	unsigned next_deque;
+	bool stop;
+};
+
+struct work_worker {
+	struct work_pool* pool;
+	int id;
+};
+
+static __thread struct work_pool* current_pool = NULL;
+static __thread int current_worker = -1;
+
+int no_cpus() {
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? n : 1;
+}
+
+void deque_push(struct work_deque* deque, struct work_item item) {
+	pthread_mutex_lock(&deque->lock);
+
+	if (deque->tail - deque->head == deque->capacity) {
+		long new_capacity = deque->capacity ? 2 * deque->capacity : 64;
+		struct work_item* items = malloc(new_capacity * sizeof(*items));
+		for (long i = deque->head; i < deque->tail; ++i)
+			items[i - deque->head] = deque->items[i % deque->capacity];
+		free(deque->items);
+		deque->items = items;
+		deque->tail -= deque->head;
+		deque->head = 0;
+		deque->capacity = new_capacity;
+	}
+
+	deque->items[deque->tail % deque->capacity] = item;
+	deque->tail++;
+
+	pthread_mutex_unlock(&deque->lock);
+}
+
+// the owner works on the newest task
+bool deque_pop(struct work_deque* deque, struct work_item* item) {
+	bool found = false;
+	pthread_mutex_lock(&deque->lock);
+	if (deque->tail > deque->head) {
+		deque->tail--;
+		*item = deque->items[deque->tail % deque->capacity];
+		found = true;
+	}
+	pthread_mutex_unlock(&deque->lock);
+	return found;
+}
+
+// thieves take the oldest task, which is usually the biggest subtree
+bool deque_steal(struct work_deque* deque, struct work_item* item) {
+	bool found = false;
+	pthread_mutex_lock(&deque->lock);
+	if (deque->tail > deque->head) {
+		*item = deque->items[deque->head % deque->capacity];
+		deque->head++;
+		found = true;
+	}
+	pthread_mutex_unlock(&deque->lock);
+	return found;
+}
+
+void* pool_worker(void* arg) {
+	struct work_worker* worker = arg;
+	struct work_pool* pool = worker->pool;
+	int id = worker->id;
+	free(worker);
+
+	current_pool = pool;
+	current_worker = id;
+
+	while (true) {
+		struct work_item item;
+		bool found = deque_pop(&pool->deques[id], &item);
+
+		for (int k = 1; !found && k < pool->no_workers; ++k)
+			found = deque_steal(&pool->deques[(id + k) % pool->no_workers], &item);
+
+		if (found) {
+			__atomic_sub_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+			item.run(item.arg);
+
+			pthread_mutex_lock(&pool->lock);
+			if (--pool->pending == 0)
+				pthread_cond_broadcast(&pool->done);
+			pthread_mutex_unlock(&pool->lock);
+			continue;
+		}
+
+		pthread_mutex_lock(&pool->lock);
+		while (__atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) == 0 && !pool->stop)
+			pthread_cond_wait(&pool->wake, &pool->lock);
+		bool stop = pool->stop && __atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) == 0;
+		pthread_mutex_unlock(&pool->lock);
+
+		if (stop)
+			break;
+	}
+
+	return NULL;
+}
+
+struct work_pool* pool_create(int no_workers) {
+	struct work_pool* pool = calloc(1, sizeof(*pool));
+	pool->no_workers = no_workers;
+	pool->threads = malloc(no_workers * sizeof(*pool->threads));
+	pool->deques = calloc(no_workers, sizeof(*pool->deques));
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->wake, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	for (int i = 0; i < no_workers; ++i)
+		pthread_mutex_init(&pool->deques[i].lock, NULL);
+
+	for (int i = 0; i < no_workers; ++i) {
+		struct work_worker* worker = malloc(sizeof(*worker));
+		worker->pool = pool;
+		worker->id = i;
+		pthread_create(&pool->threads[i], NULL, pool_worker, worker);
+	}
+
+	return pool;
+}
+
+// queue a task; tasks may submit more tasks while they run
+void pool_submit(struct work_pool* pool, void (*run)(void*), void* arg) {
+	struct work_item item = {run, arg};
+	int deque_idx;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->pending++;
+	if (current_pool == pool)
+		deque_idx = current_worker;
+	else
+		deque_idx = pool->next_deque++ % pool->no_workers;
+	pthread_mutex_unlock(&pool->lock);
+
+	deque_push(&pool->deques[deque_idx], item);
+
+	pthread_mutex_lock(&pool->lock);
+	__atomic_add_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+	pthread_cond_signal(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+// block until every submitted task has finished
+void pool_wait(struct work_pool* pool) {
+	pthread_mutex_lock(&pool->lock);
+	while (pool->pending > 0)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_destroy(struct work_pool* pool) {
+	pool_wait(pool);
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (int i = 0; i < pool->no_workers; ++i)
+		pthread_join(pool->threads[i], NULL);
+
+	for (int i = 0; i < pool->no_workers; ++i) {
+		pthread_mutex_destroy(&pool->deques[i].lock);
+		free(pool->deques[i].items);
+	}
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->wake);
+	pthread_cond_destroy(&pool->done);
+	free(pool->deques);
+	free(pool->threads);
+	free(pool);
+}
+
+
+
+
+
+
+// write the current path in the commandline
+void print_curr_dir() {
+	if (getcwd(cwd, sizeof(cwd))) 
+		sink_puts(&stdout_sink, cwd);
+	else 
+		perror("getcwd() error");
+}
+
+// implement commands
+
+// ls: getdents64 into a compact entry array (names live in one pool),
+// statx only for the fields shown, all output in one buffer
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+struct ls_options {
+	bool all, long_format, recursive, unsorted, colour;
+	int no_paths;
+	bool printed; // directory headers after the first get a blank line
+};
+
+struct ls_entry {
+	uint64_t key;  // first 8 bytes of the name, big endian
+	uint32_t name; // offset in the name pool
+	uint32_t info; // index of its statx data (long format)
+	uint16_t length;
+	unsigned char type;
+};
+
+struct ls_directory {
+	struct ls_entry* entries;
+	int no_entries, capacity;
+	char* names;
+	size_t names_length, names_capacity;
+	struct statx* info;
+};
+
+// the owner names are looked up once per id
+struct ls_name_cache {
+	unsigned id;
+	char name[32];
+};
+
+const char* ls_user_name(unsigned uid) {
+	static struct ls_name_cache cache[16];
+	static int used = 0;
+
+	for (int i = 0; i < used; ++i)
+		if (cache[i].id == uid)
+			return cache[i].name;
+
+	struct ls_name_cache* slot = &cache[used < 16 ? used++ : uid % 16];
+	struct passwd* pw = getpwuid(uid);
+	slot->id = uid;
+	if (pw)
+		snprintf(slot->name, sizeof(slot->name), "%s", pw->pw_name);
+	else
+		snprintf(slot->name, sizeof(slot->name), "%u", uid);
+	return slot->name;
+}
+
+const char* ls_group_name(unsigned gid) {
+	static struct ls_name_cache cache[16];
+	static int used = 0;
+
+	for (int i = 0; i < used; ++i)
+		if (cache[i].id == gid)
+			return cache[i].name;
+
+	struct ls_name_cache* slot = &cache[used < 16 ? used++ : gid % 16];
+	struct group* gr = getgrgid(gid);
+	slot->id = gid;
+	if (gr)
+		snprintf(slot->name, sizeof(slot->name), "%s", gr->gr_name);
+	else
+		snprintf(slot->name, sizeof(slot->name), "%u", gid);
+	return slot->name;
+}
+
+unsigned char ls_type_from_mode(mode_t mode) {
+	if (S_ISDIR(mode)) return DT_DIR;
+	if (S_ISREG(mode)) return DT_REG;
+	if (S_ISLNK(mode)) return DT_LNK;
+	if (S_ISFIFO(mode)) return DT_FIFO;
+	if (S_ISSOCK(mode)) return DT_SOCK;
+	if (S_ISCHR(mode)) return DT_CHR;
+	if (S_ISBLK(mode)) return DT_BLK;
+	return DT_UNKNOWN;
+}
+
+void ls_add_entry(struct ls_directory* dir, const char* name, unsigned char type) {
+	size_t length = strlen(name);
+
+	if (dir->no_entries == dir->capacity) {
+		dir->capacity = dir->capacity ? 2 * dir->capacity : 256;
+		dir->entries = realloc(dir->entries, dir->capacity * sizeof(*dir->entries));
+	}
+	if (dir->names_length + length + 1 > dir->names_capacity) {
+		dir->names_capacity = 2 * (dir->names_length + length + 1) + 4096;
+		dir->names = realloc(dir->names, dir->names_capacity);
+	}
+
+	struct ls_entry* entry = &dir->entries[dir->no_entries];
+	entry->key = 0;
+	for (size_t i = 0; i < 8; ++i)
+		entry->key = entry->key << 8 | (i < length ? (unsigned char)name[i] : 0);
+	entry->name = dir->names_length;
+	entry->info = dir->no_entries;
+	entry->length = length;
+	entry->type = type;
+
+	memcpy(dir->names + dir->names_length, name, length + 1);
+	dir->names_length += length + 1;
+	dir->no_entries++;
+}
+
+static const char* ls_sort_names;
+
+int ls_compare(const void* a, const void* b) {
+	const struct ls_entry* x = a;
+	const struct ls_entry* y = b;
+
+	if (x->key != y->key)
+		return x->key < y->key ? -1 : 1;
+	if (x->length <= 8 || y->length <= 8)
+		return (x->length > y->length) - (x->length < y->length);
+	return strcmp(ls_sort_names + x->name + 8, ls_sort_names + y->name + 8);
+}
+
+void ls_format_entry(struct ls_options* options, struct ls_directory* dir, struct ls_entry* entry, 
+	int dir_fd, struct text_buffer* out) {
+
+	char* name = dir->names + entry->name;
+
+	if (options->long_format) {
+		struct statx* info = &dir->info[entry->info];
+		char line[512];
+		char mode[11] = "?---------";
+		char* types = "?pc?d?b?-?l?s???";
+		unsigned m = info->stx_mode;
+
+		mode[0] = types[(m >> 12) & 15];
+		for (int i = 0; i < 9; ++i)
+			if (m & (0400 >> i))
+				mode[i + 1] = "rwxrwxrwx"[i];
+
+		char date[32];
+		time_t mtime = info->stx_mtime.tv_sec;
+		struct tm tm;
+		localtime_r(&mtime, &tm);
+		if (llabs((long long)(time(NULL) - mtime)) > 180L * 24 * 3600)
+			strftime(date, sizeof(date), "%b %e  %Y", &tm);
+		else
+			strftime(date, sizeof(date), "%b %e %H:%M", &tm);
+
+		int length = snprintf(line, sizeof(line), "%s %3u %-8s %-8s %10llu %s ", mode, info->stx_nlink,
+			ls_user_name(info->stx_uid), ls_group_name(info->stx_gid), (unsigned long long)info->stx_size, date);
+		buffer_append(out, line, length);
+	}
+
+	if (options->colour)
+		buffer_puts(out, entry->type == DT_REG ? BLUE : entry->type == DT_DIR ? GREEN : CYAN);
+	buffer_append(out, name, entry->length);
+	if (options->colour && options->long_format)
+		buffer_puts(out, WHITE);
+
+	if (options->long_format && entry->type == DT_LNK) {
+		char target[MAX_PATH_LENGTH];
+		ssize_t length = readlinkat(dir_fd, name, target, sizeof(target));
+		if (length >= 0) {
+			buffer_puts(out, " -> ");
+			buffer_append(out, target, length);
+		}
+	}
+	buffer_append(out, "\n", 1);
+}
+
+// list one directory, then (-R) its subdirectories
+// returns false if something could not be listed
+bool ls_list(struct ls_options* options, char* path, struct text_buffer* out, bool header) {
+	int fd = open(path, O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		fprintf(stderr, "Error ls: %s: %s\n", path, strerror(errno));
+		return false;
+	}
+
+	if (header) {
+		if (options->printed)
+			buffer_append(out, "\n", 1);
+		buffer_puts(out, path);
+		buffer_puts(out, ":\n");
+	}
+
+	options->printed = true;
+
+	struct ls_directory dir = {0};
+	char* raw = malloc(LS_DENTS_SIZE);
+	bool streaming = options->unsorted && !options->long_format && !options->recursive;
+	bool ok = true;
+
+	while (true) {
+		long no_bytes = syscall(SYS_getdents64, fd, raw, LS_DENTS_SIZE);
+		if (no_bytes < 0) {
+			fprintf(stderr, "Error ls: %s: %s\n", path, strerror(errno));
+			ok = false;
+			break;
+		}
+		if (no_bytes == 0)
+			break;
+
+		for (long offset = 0; offset < no_bytes; ) {
+			struct linux_dirent64* dirent = (struct linux_dirent64*)(raw + offset);
+			offset += dirent->d_reclen;
+
+			char* name = dirent->d_name;
+			if (name[0] == '.' && !options->all)
+				continue;
+			ls_add_entry(&dir, name, dirent->d_type);
+		}
+
+		// -U: every batch is printed as soon as it is read
+		if (streaming) {
+			for (int i = 0; i < dir.no_entries; ++i)
+				ls_format_entry(options, &dir, &dir.entries[i], fd, out);
+			dir.no_entries = 0;
+			dir.names_length = 0;
+			if (out->length >= LS_FLUSH_SIZE)
+				sink_write_buffer(&stdout_sink, out);
+		}
+	}
+	free(raw);
+
+	// only the fields that are printed are requested
+	unsigned mask = 0;
+	if (options->long_format)
+		mask = STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_UID | STATX_GID | STATX_SIZE | STATX_MTIME;
+
+	if (dir.no_entries > 0)
+		dir.info = malloc((mask ? dir.no_entries : 1) * sizeof(*dir.info));
+
+	for (int i = 0; i < dir.no_entries; ++i) {
+		struct ls_entry* entry = &dir.entries[i];
+		unsigned entry_mask = mask;
+		if (entry->type == DT_UNKNOWN)
+			entry_mask |= STATX_TYPE;
+		if (entry_mask == 0)
+			continue;
+
+		struct statx* info = &dir.info[mask ? i : 0];
+		if (statx(fd, dir.names + entry->name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, entry_mask, info) < 0) {
+			memset(info, 0, sizeof(*info));
+			continue;
+		}
+		if (entry->type == DT_UNKNOWN)
+			entry->type = ls_type_from_mode(info->stx_mode);
+	}
+
+	if (!options->unsorted) {
+		ls_sort_names = dir.names;
+		qsort(dir.entries, dir.no_entries, sizeof(*dir.entries), ls_compare);
+	}
+
+	for (int i = 0; i < dir.no_entries; ++i)
+		ls_format_entry(options, &dir, &dir.entries[i], fd, out);
+
+	if (out->length >= LS_FLUSH_SIZE)
+		sink_write_buffer(&stdout_sink, out);
+
+	if (options->recursive) {
+		for (int i = 0; i < dir.no_entries; ++i) {
+			struct ls_entry* entry = &dir.entries[i];
+			char* name = dir.names + entry->name;
+			if (entry->type != DT_DIR || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+				continue;
+
+			char* child = malloc(strlen(path) + entry->length + 2);
+			sprintf(child, "%s%s%s", path, path[strlen(path) - 1] == '/' ? "" : "/", name);
+			if (!ls_list(options, child, out, true))
+				ok = false;
+			free(child);
+		}
+	}
+
+	close(fd);
+	free(dir.entries);
+	free(dir.names);
+	free(dir.info);
+	return ok;
+}
+
+// a path that is not a directory is listed as a single entry
+bool ls_path(struct ls_options* options, char* path, struct text_buffer* out) {
+	struct statx info;
+	unsigned mask = STATX_TYPE | (options->long_format ? STATX_BASIC_STATS : 0);
+
+	if (statx(AT_FDCWD, path, AT_SYMLINK_NOFOLLOW, mask, &info) < 0) {
+		fprintf(stderr, "Error ls: %s: %s\n", path, strerror(errno));
+		return false;
+	}
+
+	if (S_ISDIR(info.stx_mode) || (S_ISLNK(info.stx_mode) && !options->long_format && 
+		statx(AT_FDCWD, path, 0, STATX_TYPE, &info) == 0 && S_ISDIR(info.stx_mode)))
+		return ls_list(options, path, out, options->no_paths > 1 || options->recursive);
+
+	struct ls_directory dir = {0};
+	ls_add_entry(&dir, path, ls_type_from_mode(info.stx_mode));
+	dir.info = &info;
+	ls_format_entry(options, &dir, &dir.entries[0], AT_FDCWD, out);
+	options->printed = true;
+	free(dir.entries);
+	free(dir.names);
+	return true;
+}
+
+void funct_ls(char** args) {
+	exit_status = 1;
+
+	struct ls_options options = {0};
+	int i = 0;
+
+	for (; args[i] && args[i][0] == '-' && args[i][1] != '\0'; ++i) {
+		for (char* flag = args[i] + 1; *flag; ++flag) {
+			if (*flag == 'a')
+				options.all = true;
+			else if (*flag == 'l')
+				options.long_format = true;
+			else if (*flag == 'R')
+				options.recursive = true;
+			else if (*flag == 'U')
+				options.unsorted = true;
+			else {
+				sink_puts(&stdout_sink, "Usage: ls [-alRU] [path...]\n");
+				return;
+			}
+		}
+	}
+
+	options.colour = stdout_sink.colour;
+	for (int j = i; args[j]; ++j)
+		options.no_paths++;
+
+	struct text_buffer out = {0};
+	bool ok = true;
+
+	if (options.no_paths == 0)
+		ok = ls_path(&options, ".", &out);
+
+	for (int j = i; args[j]; ++j) {
+		if (!ls_path(&options, args[j], &out))
+			ok = false;
+	}
+
+	if (options.colour)
+		buffer_puts(&out, WHITE);
+
+	sink_write_buffer(&stdout_sink, &out);
+	free(out.data);
+
+	if (ok)
+		exit_status = 0;
+}
+
+void funct_echo(char** args) {
+	exit_status = 1;
+
+	for (int i = 0; args[i]; ++i) {
+		sink_puts(&stdout_sink, args[i]);
+		sink_write(&stdout_sink, " ", 1);
+	}
+	sink_write(&stdout_sink, "\n", 1);
+
+	exit_status = 0;
+}
+
+void funct_touch(char** args) {
+	exit_status = 1;
+
+	for (int i = 0; args[i]; ++i) { 
+		FILE* file = fopen(args[i], "w");
+		if (file == NULL) {
+			perror("Error touch");
+			return;
+		}
+		else 
+			fclose(file);
+	}
+
+	exit_status = 0;
+}
+
+void funct_mkdir(char** args) {
+	exit_status = 1;
+
+	for (int i = 0; args[i]; ++i) { 
+		if (mkdir(args[i], 0777) == -1) {
+			perror("Error mkdir");
+			return;
+		}
+	}
+
+	exit_status = 0;
+}
+
+// ---------------------------- GREP -----------------------------
+
+// literal search: a vector compare of the first and the last byte of
+// the needle filters the candidates, which are then checked with memcmp
+typedef const char* (*find_function)(const char*, size_t, const char*, size_t);
+
+#if defined(__x86_64__) || defined(__i386__)
+
+const char* find_literal_sse2(const char* hay, size_t n, const char* needle, size_t m) {
+	const __m128i first = _mm_set1_epi8(needle[0]);
+	const __m128i last = _mm_set1_epi8(needle[m - 1]);
+	size_t i = 0;
+
+	for (; i + m - 1 + 16 <= n; i += 16) {
+		__m128i block_first = _mm_loadu_si128((const __m128i*)(hay + i));
+		__m128i block_last = _mm_loadu_si128((const __m128i*)(hay + i + m - 1));
+		unsigned mask = _mm_movemask_epi8(_mm_and_si128(
+			_mm_cmpeq_epi8(block_first, first), _mm_cmpeq_epi8(block_last, last)));
+
+		while (mask) {
+			int bit = __builtin_ctz(mask);
+			if (memcmp(hay + i + bit + 1, needle + 1, m - 2) == 0)
+				return hay + i + bit;
+			mask &= mask - 1;
+		}
+	}
+
+	return i < n ? memmem(hay + i, n - i, needle, m) : NULL;
+}
+
+__attribute__((target("avx2")))
+const char* find_literal_avx2(const char* hay, size_t n, const char* needle, size_t m) {
+	const __m256i first = _mm256_set1_epi8(needle[0]);
+	const __m256i last = _mm256_set1_epi8(needle[m - 1]);
+	size_t i = 0;
+
+	for (; i + m - 1 + 32 <= n; i += 32) {
+		__m256i block_first = _mm256_loadu_si256((const __m256i*)(hay + i));
+		__m256i block_last = _mm256_loadu_si256((const __m256i*)(hay + i + m - 1));
+		unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(
+			_mm256_cmpeq_epi8(block_first, first), _mm256_cmpeq_epi8(block_last, last)));
+
+		while (mask) {
+			int bit = __builtin_ctz(mask);
+			if (memcmp(hay + i + bit + 1, needle + 1, m - 2) == 0)
+				return hay + i + bit;
+			mask &= mask - 1;
+		}
+	}
+
+	return i < n ? memmem(hay + i, n - i, needle, m) : NULL;
+}
+
+find_function select_find_literal() {
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return find_literal_avx2;
+	return find_literal_sse2;
+}
+
+#else
+
+const char* find_literal_memmem(const char* hay, size_t n, const char* needle, size_t m) {
+	return memmem(hay, n, needle, m);
+}
+
+find_function select_find_literal() {
+	return find_literal_memmem;
+}
+
+#endif
+
+// returns the first occurrence of needle in [hay, hay + n) or NULL
+const char* find_literal(const char* hay, size_t n, const char* needle, size_t m) {
+	static find_function vector_find = NULL;
+
+	if (m == 0)
+		return hay;
+	if (m > n)
+		return NULL;
+	if (m == 1)
+		return memchr(hay, needle[0], n);
+	if (m == 2)
+		return memmem(hay, n, needle, m);
+
+	if (vector_find == NULL)
+		vector_find = select_find_literal();
+	return vector_find(hay, n, needle, m);
+}
+
+// aho-corasick automaton for many literal patterns
+// bytes that appear in no pattern share class 0, the transition table
+// is complete (no failure links are followed while scanning)
+struct ac_automaton {
+	int no_states, capacity, no_classes;
+	int max_length; // of the patterns
+	unsigned char byte_class[256];
+	int* delta;      // no_states * no_classes
+	int* out_length; // longest pattern ending in the state, -1 if none
+};
+
+int ac_new_state(struct ac_automaton* ac) {
+	if (ac->no_states == ac->capacity) {
+		ac->capacity = ac->capacity ? 2 * ac->capacity : 64;
+		ac->delta = realloc(ac->delta, (size_t)ac->capacity * ac->no_classes * sizeof(*ac->delta));
+		ac->out_length = realloc(ac->out_length, ac->capacity * sizeof(*ac->out_length));
+	}
+
+	int state = ac->no_states++;
+	for (int c = 0; c < ac->no_classes; ++c)
+		ac->delta[state * ac->no_classes + c] = -1;
+	ac->out_length[state] = -1;
+	return state;
+}
+
+struct ac_automaton* ac_build(char** patterns, int no_patterns) {
+	struct ac_automaton* ac = calloc(1, sizeof(*ac));
+
+	ac->no_classes = 1;
+	for (int i = 0; i < no_patterns; ++i)
+		for (unsigned char* p = (unsigned char*)patterns[i]; *p; ++p)
+			if (ac->byte_class[*p] == 0)
+				ac->byte_class[*p] = ac->no_classes++;
+
+	ac_new_state(ac);
+
+	for (int i = 0; i < no_patterns; ++i) {
+		int state = 0, length = 0;
+		for (unsigned char* p = (unsigned char*)patterns[i]; *p; ++p, ++length) {
+			int* next = &ac->delta[state * ac->no_classes + ac->byte_class[*p]];
+			if (*next == -1) {
+				int child = ac_new_state(ac);
+				// the table may have moved
+				next = &ac->delta[state * ac->no_classes + ac->byte_class[*p]];
+				*next = child;
+			}
+			state = *next;
+		}
+		if (ac->out_length[state] < length)
+			ac->out_length[state] = length;
+		if (ac->max_length < length)
+			ac->max_length = length;
+	}
+
+	// breadth first: failure links, then the missing transitions
+	int* fail = calloc(ac->no_states, sizeof(*fail));
+	int* queue = malloc(ac->no_states * sizeof(*queue));
+	int queue_head = 0, queue_tail = 0;
+
+	for (int c = 0; c < ac->no_classes; ++c) {
+		int* next = &ac->delta[c];
+		if (*next == -1)
+			*next = 0;
+		else {
+			fail[*next] = 0;
+			queue[queue_tail++] = *next;
+		}
+	}
+
+	while (queue_head < queue_tail) {
+		int state = queue[queue_head++];
+
+		if (ac->out_length[fail[state]] > ac->out_length[state])
+			ac->out_length[state] = ac->out_length[fail[state]];
+
+		for (int c = 0; c < ac->no_classes; ++c) {
+			int* next = &ac->delta[state * ac->no_classes + c];
+			int fallback = ac->delta[fail[state] * ac->no_classes + c];
+			if (*next == -1)
+				*next = fallback;
+			else {
+				fail[*next] = fallback;
+				queue[queue_tail++] = *next;
+			}
+		}
+	}
+
+	free(fail);
+	free(queue);
+	return ac;
+}
+
+void ac_free(struct ac_automaton* ac) {
+	free(ac->delta);
+	free(ac->out_length);
+	free(ac);
+}
+
+// returns the offset just past the first (earliest ending) match, or -1
+// *length receives the length of the longest pattern ending there
+long ac_find(struct ac_automaton* ac, const char* text, size_t n, size_t* length) {
+	const unsigned char* p = (const unsigned char*)text;
+	int state = 0;
+
+	if (ac->out_length[0] >= 0) {
+		*length = 0;
+		return 0;
+	}
+
+	for (size_t i = 0; i < n; ++i) {
+		state = ac->delta[state * ac->no_classes + ac->byte_class[p[i]]];
+		if (ac->out_length[state] >= 0) {
+			*length = ac->out_length[state];
+			return i + 1;
+		}
+	}
+
+	return -1;
+}
+
+// the leftmost match, the longest one starting there, or -1
+// the state after every byte gives the longest pattern ending there,
+// which is the one starting first; the scan goes on until no pattern
+// ending later could start at or before the best start
+long ac_leftmost(struct ac_automaton* ac, const char* text, size_t n, size_t* length) {
+	const unsigned char* p = (const unsigned char*)text;
+	long best = ac->out_length[0] >= 0 ? 0 : -1;
+	int state = 0;
+
+	*length = 0;
+	for (size_t i = 0; i < n; ++i) {
+		if (best >= 0 && (long)(i + 1) - ac->max_length > best)
+			break;
+		state = ac->delta[state * ac->no_classes + ac->byte_class[p[i]]];
+		if (ac->out_length[state] < 0)
+			continue;
+		long start = i + 1 - ac->out_length[state];
+		if (best < 0 || start < best || (start == best && (size_t)ac->out_length[state] > *length)) {
+			best = start;
+			*length = ac->out_length[state];
+		}
+	}
+
+	return best;
+}
+
+// regular expressions (posix extended syntax)
+// parsed into a tree, compiled to a thompson nfa and run as a dfa
+// whose states are built lazily, the first time they are reached
+enum { RE_SET, RE_CONCAT, RE_ALT, RE_STAR, RE_PLUS, RE_QUEST, RE_REPEAT, RE_BOL, RE_EOL, RE_EMPTY };
+
+#define RE_INFINITE -1
+#define DFA_MAX_STATES 4096
+
+struct re_node {
+	int type;
+	struct re_node *left, *right;
+	uint64_t set[4];
+	int min, max;
+};
+
+struct re_parser {
+	const char* pos;
+	char* error;
+};
+
+enum { NFA_SET, NFA_SPLIT, NFA_BOL, NFA_EOL, NFA_MATCH };
+
+struct nfa_state {
+	int type;
+	int out, out2;
+	uint64_t set[4];
+};
+
+struct regex_program {
+	struct nfa_state* states;
+	int no_states, capacity;
+	int start;
+};
+
+struct dfa_state {
+	int* nfa_set;
+	int set_size;
+	bool accepting;
+	int accept_at_end; // -1 until known
+	int next[256];     // -1 until computed
+};
+
+struct regex_dfa {
+	struct regex_program* program;
+	bool unanchored; // search: a match may start at every position
+	struct dfa_state** states;
+	int no_states;
+	int* table; // open addressing, state index + 1
+	int table_size;
+	int start[2]; // start state in the middle / at the beginning of a line
+	int* stack;
+	int* seeds;
+	int* mark;
+	int generation;
+};
+
+static inline void set_add(uint64_t* set, unsigned char c) {
+	set[c >> 6] |= 1ULL << (c & 63);
+}
+
+static inline bool set_has(const uint64_t* set, unsigned char c) {
+	return set[c >> 6] >> (c & 63) & 1;
+}
+
+struct re_node* re_new_node(int type, struct re_node* left, struct re_node* right) {
+	struct re_node* node = calloc(1, sizeof(*node));
+	node->type = type;
+	node->left = left;
+	node->right = right;
+	return node;
+}
+
+void re_free_tree(struct re_node* node) {
+	if (node == NULL)
+		return;
+	re_free_tree(node->left);
+	re_free_tree(node->right);
+	free(node);
+}
+
+struct re_node* re_parse_alt(struct re_parser* parser);
+
+void re_add_class(uint64_t* set, const char* name) {
+	for (int c = 0; c < 256; ++c) {
+		bool member = false;
+		if (strcmp(name, "digit") == 0) member = c >= '0' && c <= '9';
+		else if (strcmp(name, "alpha") == 0) member = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+		else if (strcmp(name, "alnum") == 0) member = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+		else if (strcmp(name, "upper") == 0) member = c >= 'A' && c <= 'Z';
+		else if (strcmp(name, "lower") == 0) member = c >= 'a' && c <= 'z';
+		else if (strcmp(name, "space") == 0) member = c == ' ' || (c >= '\t' && c <= '\r');
+		else if (strcmp(name, "word") == 0) member = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+		else if (strcmp(name, "xdigit") == 0) member = (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+		else if (strcmp(name, "punct") == 0) member = c > 32 && c < 127 && !((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9'));
+		if (member)
+			set_add(set, c);
+	}
+}
+
+// \d \w \s and their negations
+bool re_escape_class(uint64_t* set, char c) {
+	char* name = NULL;
+	if (c == 'd' || c == 'D') name = "digit";
+	else if (c == 'w' || c == 'W') name = "word";
+	else if (c == 's' || c == 'S') name = "space";
+	if (name == NULL)
+		return false;
+
+	re_add_class(set, name);
+	if (c >= 'A' && c <= 'Z')
+		for (int i = 0; i < 4; ++i)
+			set[i] = ~set[i];
+	return true;
+}
+
+struct re_node* re_parse_bracket(struct re_parser* parser) {
+	struct re_node* node = re_new_node(RE_SET, NULL, NULL);
+	bool negate = false;
+
+	if (*parser->pos == '^') {
+		negate = true;
+		parser->pos++;
+	}
+
+	bool first = true;
+	while (*parser->pos && (*parser->pos != ']' || first)) {
+		first = false;
+
+		if (parser->pos[0] == '[' && parser->pos[1] == ':') {
+			const char* end = strstr(parser->pos + 2, ":]");
+			if (end == NULL)
+				break;
+			char name[16] = {0};
+			int length = end - parser->pos - 2;
+			if (length < (int)sizeof(name))
+				memcpy(name, parser->pos + 2, length);
+			re_add_class(node->set, name);
+			parser->pos = end + 2;
+			continue;
+		}
+
+		unsigned char low = *parser->pos++;
+		if (low == '\\' && *parser->pos) {
+			if (re_escape_class(node->set, *parser->pos)) {
+				parser->pos++;
+				continue;
+			}
+			low = *parser->pos++;
+		}
+
+		unsigned char high = low;
+		if (parser->pos[0] == '-' && parser->pos[1] && parser->pos[1] != ']') {
+			high = parser->pos[1];
+			parser->pos += 2;
+		}
+		for (int c = low; c <= high; ++c)
+			set_add(node->set, c);
+	}
+
+	if (*parser->pos != ']') {
+		parser->error = "unterminated [";
+		re_free_tree(node);
+		return NULL;
+	}
+	parser->pos++;
+
+	if (negate)
+		for (int i = 0; i < 4; ++i)
+			node->set[i] = ~node->set[i];
+	// a match never spans lines
+	node->set['\n' >> 6] &= ~(1ULL << ('\n' & 63));
+	return node;
+}
+
+struct re_node* re_parse_atom(struct re_parser* parser) {
+	char c = *parser->pos;
+	struct re_node* node;
+
+	if (c == '(') {
+		parser->pos++;
+		node = re_parse_alt(parser);
+		if (node == NULL)
+			return NULL;
+		if (*parser->pos != ')') {
+			parser->error = "unmatched (";
+			re_free_tree(node);
+			return NULL;
+		}
+		parser->pos++;
+		return node;
+	}
+
+	if (c == '[') {
+		parser->pos++;
+		return re_parse_bracket(parser);
+	}
+
+	parser->pos++;
+
+	if (c == '^')
+		return re_new_node(RE_BOL, NULL, NULL);
+	if (c == '$')
+		return re_new_node(RE_EOL, NULL, NULL);
+
+	node = re_new_node(RE_SET, NULL, NULL);
+
+	if (c == '.') {
+		for (int i = 0; i < 4; ++i)
+			node->set[i] = ~0ULL;
+		node->set['\n' >> 6] &= ~(1ULL << ('\n' & 63));
+		return node;
+	}
+
+	if (c == '\\') {
+		if (*parser->pos == '\0') {
+			parser->error = "trailing \\";
+			re_free_tree(node);
+			return NULL;
+		}
+		c = *parser->pos++;
+		if (re_escape_class(node->set, c))
+			return node;
+		if (c == 'n')
+			c = '\n';
+		else if (c == 't')
+			c = '\t';
+	}
+
+	set_add(node->set, c);
+	return node;
+}
+
+// {m}, {m,} and {m,n}; returns false if it is not a valid bound
+bool re_parse_bound(struct re_parser* parser, int* min, int* max) {
+	const char* p = parser->pos + 1;
+	if (*p < '0' || *p > '9')
+		return false;
+
+	*min = strtol(p, (char**)&p, 10);
+	*max = *min;
+	if (*p == ',') {
+		++p;
+		if (*p >= '0' && *p <= '9')
+			*max = strtol(p, (char**)&p, 10);
+		else
+			*max = RE_INFINITE;
+	}
+	if (*p != '}' || (*max != RE_INFINITE && *max < *min) || *min > 1000 || *max > 1000)
+		return false;
+
+	parser->pos = p + 1;
+	return true;
+}
+
+struct re_node* re_parse_repeat(struct re_parser* parser) {
+	struct re_node* node = re_parse_atom(parser);
+
+	while (node) {
+		char c = *parser->pos;
+		int min, max;
+
+		if (c == '*')
+			node = re_new_node(RE_STAR, node, NULL);
+		else if (c == '+')
+			node = re_new_node(RE_PLUS, node, NULL);
+		else if (c == '?')
+			node = re_new_node(RE_QUEST, node, NULL);
+		else if (c == '{' && re_parse_bound(parser, &min, &max)) {
+			node = re_new_node(RE_REPEAT, node, NULL);
+			node->min = min;
+			node->max = max;
+			continue;
+		}
+		else
+			break;
+
+		parser->pos++;
+	}
+
+	return node;
+}
+
+struct re_node* re_parse_concat(struct re_parser* parser) {
+	struct re_node* node = NULL;
+
+	while (*parser->pos && *parser->pos != '|' && *parser->pos != ')') {
+		struct re_node* next = re_parse_repeat(parser);
+		if (next == NULL) {
+			re_free_tree(node);
+			return NULL;
+		}
+		node = node ? re_new_node(RE_CONCAT, node, next) : next;
+	}
+
+	return node ? node : re_new_node(RE_EMPTY, NULL, NULL);
+}
+
+struct re_node* re_parse_alt(struct re_parser* parser) {
+	struct re_node* node = re_parse_concat(parser);
+
+	while (node && *parser->pos == '|') {
+		parser->pos++;
+		struct re_node* next = re_parse_concat(parser);
+		if (next == NULL) {
+			re_free_tree(node);
+			return NULL;
+		}
+		node = re_new_node(RE_ALT, node, next);
+	}
+
+	return node;
+}
+
+int nfa_new_state(struct regex_program* program, int type, int out, int out2) {
+	if (program->no_states == program->capacity) {
+		program->capacity = program->capacity ? 2 * program->capacity : 64;
+		program->states = realloc(program->states, program->capacity * sizeof(*program->states));
+	}
+
+	struct nfa_state* state = &program->states[program->no_states];
+	memset(state, 0, sizeof(*state));
+	state->type = type;
+	state->out = out;
+	state->out2 = out2;
+	return program->no_states++;
+}
+
+// compile the tree in front of the already compiled state next
+// returns the entry state
+int nfa_compile(struct regex_program* program, struct re_node* node, int next) {
+	int state;
+
+	switch (node->type) {
+	case RE_SET:
+		state = nfa_new_state(program, NFA_SET, next, -1);
+		memcpy(program->states[state].set, node->set, sizeof(node->set));
+		return state;
+	case RE_CONCAT:
+		return nfa_compile(program, node->left, nfa_compile(program, node->right, next));
+	case RE_ALT:
+		state = nfa_compile(program, node->left, next);
+		return nfa_new_state(program, NFA_SPLIT, state, nfa_compile(program, node->right, next));
+	case RE_STAR:
+		state = nfa_new_state(program, NFA_SPLIT, -1, next);
+		program->states[state].out = nfa_compile(program, node->left, state);
+		return state;
+	case RE_PLUS: {
+		int loop = nfa_new_state(program, NFA_SPLIT, -1, next);
+		int entry = nfa_compile(program, node->left, loop);
+		program->states[loop].out = entry;
+		return entry;
+	}
+	case RE_QUEST:
+		return nfa_new_state(program, NFA_SPLIT, nfa_compile(program, node->left, next), next);
+	case RE_REPEAT: {
+		int current = next;
+		if (node->max == RE_INFINITE) {
+			current = nfa_new_state(program, NFA_SPLIT, -1, next);
+			program->states[current].out = nfa_compile(program, node->left, current);
+		}
+		else {
+			for (int i = node->min; i < node->max; ++i)
+				current = nfa_new_state(program, NFA_SPLIT, nfa_compile(program, node->left, current), next);
+		}
+		for (int i = 0; i < node->min; ++i)
+			current = nfa_compile(program, node->left, current);
+		return current;
+	}
+	case RE_BOL:
+		return nfa_new_state(program, NFA_BOL, next, -1);
+	case RE_EOL:
+		return nfa_new_state(program, NFA_EOL, next, -1);
+	default:
+		return next;
+	}
+}
+
+// the tree of the reversed language: concatenations swapped, ^ and $
+// exchanged, so a program built from it matches the text backwards
+void re_reverse(struct re_node* node) {
+	if (node == NULL)
+		return;
+	if (node->type == RE_CONCAT) {
+		struct re_node* left = node->left;
+		node->left = node->right;
+		node->right = left;
+	}
+	else if (node->type == RE_BOL)
+		node->type = RE_EOL;
+	else if (node->type == RE_EOL)
+		node->type = RE_BOL;
+	re_reverse(node->left);
+	re_reverse(node->right);
+}
+
+// returns NULL and sets *error when the pattern is invalid
+// a reversed program matches the pattern read from right to left
+struct regex_program* regex_compile(const char* pattern, bool reversed, char** error) {
+	struct re_parser parser = {pattern, NULL};
+	struct re_node* tree = re_parse_alt(&parser);
+
+	if (tree && *parser.pos != '\0') {
+		parser.error = "unmatched )";
+		re_free_tree(tree);
+		tree = NULL;
+	}
+	if (tree == NULL) {
+		*error = parser.error;
+		return NULL;
+	}
+
+	if (reversed)
+		re_reverse(tree);
+
+	struct regex_program* program = calloc(1, sizeof(*program));
+	int match = nfa_new_state(program, NFA_MATCH, -1, -1);
+	program->start = nfa_compile(program, tree, match);
+	re_free_tree(tree);
+	return program;
+}
+
+void regex_free(struct regex_program* program) {
+	free(program->states);
+	free(program);
+}
+
+int compare_ints(const void* a, const void* b) {
+	int x = *(const int*)a, y = *(const int*)b;
+	return (x > y) - (x < y);
+}
+
+// epsilon closure of the seeds into dfa->stack[0..return)
+// kept states: sets, the match state and (unless at_eol) pending $
+int dfa_closure(struct regex_dfa* dfa, int no_seeds, bool at_bol, bool at_eol) {
+	struct nfa_state* states = dfa->program->states;
+	int* todo = dfa->seeds;
+	int no_todo = no_seeds, size = 0;
+
+	dfa->generation++;
+
+	while (no_todo > 0) {
+		int s = todo[--no_todo];
+		if (s < 0 || dfa->mark[s] == dfa->generation)
+			continue;
+		dfa->mark[s] = dfa->generation;
+
+		switch (states[s].type) {
+		case NFA_SPLIT:
+			todo[no_todo++] = states[s].out;
+			todo[no_todo++] = states[s].out2;
+			break;
+		case NFA_BOL:
+			if (at_bol)
+				todo[no_todo++] = states[s].out;
+			break;
+		case NFA_EOL:
+			if (at_eol)
+				todo[no_todo++] = states[s].out;
+			else
+				dfa->stack[size++] = s;
+			break;
+		default:
+			dfa->stack[size++] = s;
+		}
+	}
+
+	qsort(dfa->stack, size, sizeof(int), compare_ints);
+	return size;
+}
+
+unsigned hash_ints(const int* values, int n) {
+	unsigned hash = 2166136261u;
+	for (int i = 0; i < n; ++i)
+		hash = (hash ^ values[i]) * 16777619u;
+	return hash;
+}
+
+void dfa_flush(struct regex_dfa* dfa) {
+	for (int i = 0; i < dfa->no_states; ++i) {
+		free(dfa->states[i]->nfa_set);
+		free(dfa->states[i]);
+	}
+	dfa->no_states = 0;
+	memset(dfa->table, 0, dfa->table_size * sizeof(*dfa->table));
+	dfa->start[0] = dfa->start[1] = -1;
+}
+
+// the dfa state for the set in dfa->stack[0..size)
+int dfa_find_state(struct regex_dfa* dfa, int size) {
+	unsigned slot = hash_ints(dfa->stack, size) & (dfa->table_size - 1);
+
+	for (; dfa->table[slot]; slot = (slot + 1) & (dfa->table_size - 1)) {
+		struct dfa_state* state = dfa->states[dfa->table[slot] - 1];
+		if (state->set_size == size && memcmp(state->nfa_set, dfa->stack, size * sizeof(int)) == 0)
+			return dfa->table[slot] - 1;
+	}
+
+	struct dfa_state* state = malloc(sizeof(*state));
+	state->nfa_set = malloc((size + 1) * sizeof(int));
+	memcpy(state->nfa_set, dfa->stack, size * sizeof(int));
+	state->set_size = size;
+	state->accepting = false;
+	state->accept_at_end = -1;
+	for (int i = 0; i < size; ++i)
+		if (dfa->program->states[dfa->stack[i]].type == NFA_MATCH)
+			state->accepting = true;
+	memset(state->next, -1, sizeof(state->next));
+
+	dfa->states[dfa->no_states] = state;
+	dfa->table[slot] = dfa->no_states + 1;
+	return dfa->no_states++;
+}
+
+struct regex_dfa* dfa_create(struct regex_program* program, bool unanchored) {
+	struct regex_dfa* dfa = calloc(1, sizeof(*dfa));
+	dfa->program = program;
+	dfa->unanchored = unanchored;
+	dfa->states = malloc(DFA_MAX_STATES * sizeof(*dfa->states));
+	dfa->table_size = 4 * DFA_MAX_STATES;
+	dfa->table = calloc(dfa->table_size, sizeof(*dfa->table));
+	dfa->stack = malloc((program->no_states + 1) * sizeof(int));
+	dfa->seeds = malloc(4 * (program->no_states + 1) * sizeof(int));
+	dfa->mark = calloc(program->no_states, sizeof(int));
+	dfa->start[0] = dfa->start[1] = -1;
+	return dfa;
+}
+
+void dfa_free(struct regex_dfa* dfa) {
+	dfa_flush(dfa);
+	free(dfa->states);
+	free(dfa->table);
+	free(dfa->stack);
+	free(dfa->seeds);
+	free(dfa->mark);
+	free(dfa);
+}
+
+int dfa_start(struct regex_dfa* dfa, bool at_bol) {
+	if (dfa->start[at_bol] < 0) {
+		if (dfa->no_states >= DFA_MAX_STATES)
+			dfa_flush(dfa);
+		dfa->seeds[0] = dfa->program->start;
+		dfa->start[at_bol] = dfa_find_state(dfa, dfa_closure(dfa, 1, at_bol, false));
+	}
+	return dfa->start[at_bol];
+}
+
+// the transition of state on byte c, built on first use
+// may flush the cache, so state indices held by the caller change
+int dfa_step(struct regex_dfa* dfa, int state_idx, unsigned char c) {
+	struct dfa_state* state = dfa->states[state_idx];
+	if (state->next[c] >= 0)
+		return state->next[c];
+
+	struct nfa_state* states = dfa->program->states;
+	int no_seeds = 0;
+
+	for (int i = 0; i < state->set_size; ++i) {
+		struct nfa_state* s = &states[state->nfa_set[i]];
+		if (s->type == NFA_SET && set_has(s->set, c))
+			dfa->seeds[no_seeds++] = s->out;
+	}
+	if (dfa->unanchored)
+		dfa->seeds[no_seeds++] = dfa->program->start;
+
+	int size = dfa_closure(dfa, no_seeds, false, false);
+
+	if (dfa->no_states >= DFA_MAX_STATES) {
+		// the cache is full: start over, the new set is still in dfa->stack
+		dfa_flush(dfa);
+		return dfa_find_state(dfa, size);
+	}
+
+	int next = dfa_find_state(dfa, size);
+	dfa->states[state_idx]->next[c] = next;
+	return next;
+}
+
+// does the state accept when the line ends right after it
+bool dfa_accepts_at_end(struct regex_dfa* dfa, int state_idx) {
+	struct dfa_state* state = dfa->states[state_idx];
+
+	if (state->accept_at_end < 0) {
+		int no_seeds = 0;
+		for (int i = 0; i < state->set_size; ++i)
+			if (dfa->program->states[state->nfa_set[i]].type == NFA_EOL)
+				dfa->seeds[no_seeds++] = state->nfa_set[i];
+
+		int size = dfa_closure(dfa, no_seeds, false, true);
+		state->accept_at_end = state->accepting;
+		for (int i = 0; i < size; ++i)
+			if (dfa->program->states[dfa->stack[i]].type == NFA_MATCH)
+				state->accept_at_end = 1;
+	}
+
+	return state->accept_at_end;
+}
+
+// returns the offset of a byte of the first matching line, or -1
+long dfa_search(struct regex_dfa* dfa, const char* text, size_t n) {
+	int state = dfa_start(dfa, true);
+
+	for (size_t i = 0; i < n; ++i) {
+		unsigned char c = text[i];
+
+		if (c == '\n') {
+			if (dfa_accepts_at_end(dfa, state))
+				return i;
+			state = dfa_start(dfa, true);
+			continue;
+		}
+
+		state = dfa_step(dfa, state, c);
+		if (dfa->states[state]->accepting)
+			return i;
+	}
+
+	if (n > 0 && text[n - 1] != '\n' && dfa_accepts_at_end(dfa, state))
+		return n - 1;
+	return -1;
+}
+
+// length of the longest match starting at line[from], or -1
+long dfa_longest(struct regex_dfa* dfa, const char* line, size_t n, size_t from) {
+	int state = dfa_start(dfa, from == 0);
+	long longest = dfa->states[state]->accepting ? 0 : -1;
+
+	for (size_t i = from; i < n; ++i) {
+		state = dfa_step(dfa, state, line[i]);
+		if (dfa->states[state]->set_size == 0)
+			return longest;
+		if (dfa->states[state]->accepting)
+			longest = i + 1 - from;
+	}
+
+	if (dfa_accepts_at_end(dfa, state))
+		longest = n - from;
+	return longest;
+}
+
+// where the leftmost match in line[from, n) starts, or -1
+// the reversed dfa reads the line backwards from its end, a match
+// starts wherever it accepts; the ^ of the pattern (its $ here) only
+// holds at the start of the line
+long dfa_leftmost(struct regex_dfa* reverse, const char* line, size_t n, size_t from) {
+	int state = dfa_start(reverse, true);
+	long leftmost = reverse->states[state]->accepting ? (long)n : -1;
+
+	for (size_t i = n; i-- > from;) {
+		state = dfa_step(reverse, state, line[i]);
+		if (reverse->states[state]->accepting)
+			leftmost = i;
+	}
+
+	if (from == 0 && dfa_accepts_at_end(reverse, state))
+		leftmost = 0;
+	return leftmost;
+}
+
+// what grep looks for: one literal, many literals or a regex
+enum { MATCH_LITERAL, MATCH_MULTI, MATCH_REGEX };
+
+struct grep_matcher {
+	int kind;
+	char* needle;
+	size_t length;
+	struct ac_automaton* ac;
+	struct regex_program* program;
+	struct regex_program* reversed; // finds where matches start
+};
+
+// the lazily built dfas are private to each scanning thread
+struct matcher_cache {
+	struct regex_dfa* search;
+	struct regex_dfa* longest;
+	struct regex_dfa* leftmost;
+};
+
+void matcher_cache_free(struct matcher_cache* cache) {
+	if (cache->search)
+		dfa_free(cache->search);
+	if (cache->longest)
+		dfa_free(cache->longest);
+	if (cache->leftmost)
+		dfa_free(cache->leftmost);
+	cache->search = cache->longest = cache->leftmost = NULL;
+}
+
+// returns a pointer inside the first line with a match, or NULL
+const char* matcher_scan(struct grep_matcher* matcher, struct matcher_cache* cache, const char* text, size_t n) {
+	size_t length;
+	long offset;
+
+	switch (matcher->kind) {
+	case MATCH_LITERAL:
+		return find_literal(text, n, matcher->needle, matcher->length);
+	case MATCH_MULTI:
+		offset = ac_find(matcher->ac, text, n, &length);
+		if (offset < 0 || n == 0)
+			return NULL;
+		return text + (offset > 0 ? offset - 1 : 0);
+	default:
+		if (cache->search == NULL)
+			cache->search = dfa_create(matcher->program, true);
+		offset = dfa_search(cache->search, text, n);
+		return offset < 0 ? NULL : text + offset;
+	}
+}
+
+// leftmost match inside a single line at or after from, the longest
+// one starting there
+bool matcher_span(struct grep_matcher* matcher, struct matcher_cache* cache, const char* line, size_t n, 
+	size_t from, size_t* start, size_t* length) {
+
+	const char* hit;
+	long offset;
+
+	switch (matcher->kind) {
+	case MATCH_LITERAL:
+		hit = find_literal(line + from, n - from, matcher->needle, matcher->length);
+		if (hit == NULL)
+			return false;
+		*start = hit - line;
+		*length = matcher->length;
+		return true;
+	case MATCH_MULTI:
+		offset = ac_leftmost(matcher->ac, line + from, n - from, length);
+		if (offset < 0)
+			return false;
+		*start = from + offset;
+		return true;
+	default:
+		if (cache->leftmost == NULL)
+			cache->leftmost = dfa_create(matcher->reversed, true);
+		if (cache->longest == NULL)
+			cache->longest = dfa_create(matcher->program, false);
+		offset = dfa_leftmost(cache->leftmost, line, n, from);
+		if (offset < 0)
+			return false;
+		*start = offset;
+		*length = dfa_longest(cache->longest, line, n, offset);
+		return true;
+	}
+}
+
+struct grep_search {
+	struct grep_matcher* matcher;
+	struct matcher_cache cache;
+	char* file_name;
+	bool show_name; // several files: prefix the lines with the file name
+	bool colour;
+	struct text_buffer* output; // NULL to write to stdout directly
+};
+
+void grep_writev(struct grep_search* search, struct iovec* iov, int no_iov) {
+	struct text_buffer* output = search->output;
+
+	if (output == NULL) {
+		sink_writev(&stdout_sink, iov, no_iov);
+		return;
+	}
+	for (int i = 0; i < no_iov; ++i)
+		buffer_append(output, iov[i].iov_base, iov[i].iov_len);
+}
+
+// the pieces of a line (file name, colours, the text around the
+// matches) are gathered and written together
+struct grep_spans {
+	struct iovec iov[GREP_MAX_SPANS];
+	int count;
+};
+
+void grep_span(struct grep_search* search, struct grep_spans* spans, const char* text, size_t length) {
+	if (spans->count == GREP_MAX_SPANS) {
+		grep_writev(search, spans->iov, spans->count);
+		spans->count = 0;
+	}
+	spans->iov[spans->count++] = (struct iovec){(void*)text, length};
+}
+
+void grep_print_line(struct grep_search* search, const char* line, const char* line_end) {
+	struct grep_spans spans;
+	spans.count = 0;
+
+	if (!search->colour) {
+		if (search->show_name) {
+			grep_span(search, &spans, search->file_name, strlen(search->file_name));
+			grep_span(search, &spans, ": ", 2);
+		}
+		grep_span(search, &spans, line, line_end - line);
+		grep_span(search, &spans, "\n", 1);
+		grep_writev(search, spans.iov, spans.count);
+		return;
+	}
+
+	if (search->show_name) {
+		grep_span(search, &spans, MAGENTA, strlen(MAGENTA));
+		grep_span(search, &spans, search->file_name, strlen(search->file_name));
+		grep_span(search, &spans, ": ", 2);
+	}
+
+	size_t line_length = line_end - line, from = 0, start, length;
+	const char* last = line;
+
+	while (from <= line_length 
+	&& matcher_span(search->matcher, &search->cache, line, line_length, from, &start, &length)) {
+		// empty matches are not highlighted
+		if (length == 0) {
+			from = start + 1;
+			continue;
+		}
+
+		grep_span(search, &spans, WHITE, strlen(WHITE));
+		grep_span(search, &spans, last, line + start - last);
+		grep_span(search, &spans, RED, strlen(RED));
+		grep_span(search, &spans, line + start, length);
+
+		last = line + start + length;
+		from = start + length;
+	}
+
+	grep_span(search, &spans, WHITE, strlen(WHITE));
+	grep_span(search, &spans, last, line_end - last);
+	grep_span(search, &spans, "\n", 1);
+	grep_writev(search, spans.iov, spans.count);
+}
+
+// print the matching lines of [buffer, buffer + length)
+// the buffer has to start at the beginning of a line; only the lines
+// around the hits are ever delimited
+void grep_buffer(struct grep_search* search, const char* buffer, size_t length) {
+	const char* pos = buffer;
+	const char* end = buffer + length;
+
+	while (pos < end) {
+		const char* hit = matcher_scan(search->matcher, &search->cache, pos, end - pos);
+		if (hit == NULL)
+			break;
+
+		const char* line = memrchr(pos, '\n', hit - pos);
+		line = line ? line + 1 : pos;
+		const char* line_end = memchr(hit, '\n', end - hit);
+		if (line_end == NULL)
+			line_end = end;
+
+		grep_print_line(search, line, line_end);
+		pos = line_end + 1;
+	}
+}
+
+// pipes and special files: big reads, only complete lines are searched
+// and the buffer grows when a single line does not fit
+void grep_stream(struct grep_search* search, int fd) {
+	size_t capacity = GREP_READ_SIZE, used = 0;
+	char* buffer = malloc(capacity);
+
+	while (true) {
+		if (used == capacity) {
+			capacity *= 2;
+			buffer = realloc(buffer, capacity);
+		}
+
+		ssize_t no_read = read(fd, buffer + used, capacity - used);
+		if (no_read < 0 && errno == EINTR)
+			continue;
+		if (no_read < 0)
+			perror("Error grep");
+		if (no_read <= 0)
+			break;
+
+		size_t scanned = used;
+		used += no_read;
+
+		char* last_newline = memrchr(buffer + scanned, '\n', used - scanned);
+		if (last_newline == NULL)
+			continue;
+
+		size_t complete = last_newline - buffer + 1;
+		grep_buffer(search, buffer, complete);
+		memmove(buffer, buffer + complete, used - complete);
+		used -= complete;
+	}
+
+	if (used > 0)
+		grep_buffer(search, buffer, used);
+	free(buffer);
+}
+
+void grep_fd(struct grep_search* search, int fd) {
+	struct stat st;
+
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		char* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data != MAP_FAILED) {
+			madvise(data, st.st_size, MADV_SEQUENTIAL);
+			grep_buffer(search, data, st.st_size);
+			munmap(data, st.st_size);
+			return;
+		}
+	}
+
+	grep_stream(search, fd);
+}
+
+// parallel grep: every file, and every chunk of a big file, is a task
+// the workers print into their own buffer and the buffers are written
+// out strictly in task order, so the output is the same as sequentially
+// a mapped file, unmapped by the last of its chunk tasks to finish
+// (the submitter holds one reference until every chunk is submitted)
+struct grep_mapping {
+	char* data;
+	size_t length;
+	int references;
+};
+
+struct grep_task {
+	struct grep_run* run;
+	struct grep_search search;
+	struct text_buffer output;
+	const char* data; // line aligned chunk of a mapped file
+	size_t length;
+	struct grep_mapping* mapping;
+	int fd;           // a file that can not be mapped is streamed, and closed by its task
+	bool done;
+};
+
+struct grep_run {
+	struct grep_task** tasks;
+	int no_tasks, capacity;
+	int next_output; // first task whose output is not written yet
+	int max_in_flight;
+	pthread_mutex_t lock;
+	pthread_cond_t progress;
+};
+
+void grep_flush_ready(struct grep_run* run) {
+	// called with run->lock held
+	while (run->next_output < run->no_tasks && run->tasks[run->next_output]->done) {
+		struct grep_task* task = run->tasks[run->next_output];
+		sink_write(&stdout_sink, task->output.data, task->output.length);
+		free(task->output.data);
+		task->output.data = NULL;
+		run->next_output++;
+	}
+	pthread_cond_broadcast(&run->progress);
+}
+
+void grep_mapping_release(struct grep_mapping* mapping) {
+	if (__atomic_sub_fetch(&mapping->references, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+	munmap(mapping->data, mapping->length);
+	free(mapping);
+}
+
+void grep_run_task(void* arg) {
+	struct grep_task* task = arg;
+
+	if (task->data) {
+		grep_buffer(&task->search, task->data, task->length);
+		grep_mapping_release(task->mapping);
+	}
+	else {
+		grep_stream(&task->search, task->fd);
+		close(task->fd);
+	}
+	matcher_cache_free(&task->search.cache);
+
+	pthread_mutex_lock(&task->run->lock);
+	task->done = true;
+	grep_flush_ready(task->run);
+	pthread_mutex_unlock(&task->run->lock);
+}
+
+void grep_submit(struct grep_run* run, struct work_pool* pool, struct grep_search* search, 
+	struct grep_mapping* mapping, const char* data, size_t length, int fd) {
+
+	struct grep_task* task = calloc(1, sizeof(*task));
+	task->run = run;
+	task->search = *search;
+	task->search.output = &task->output;
+	task->search.cache.search = task->search.cache.longest = task->search.cache.leftmost = NULL;
+	task->data = data;
+	task->length = length;
+	task->mapping = mapping;
+	task->fd = fd;
+	if (mapping)
+		__atomic_add_fetch(&mapping->references, 1, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&run->lock);
+	// bound the memory held by finished but unwritten buffers
+	while (run->no_tasks - run->next_output >= run->max_in_flight)
+		pthread_cond_wait(&run->progress, &run->lock);
+
+	if (run->no_tasks == run->capacity) {
+		run->capacity = run->capacity ? 2 * run->capacity : 64;
+		run->tasks = realloc(run->tasks, run->capacity * sizeof(*run->tasks));
+	}
+	run->tasks[run->no_tasks++] = task;
+	pthread_mutex_unlock(&run->lock);
+
+	pool_submit(pool, grep_run_task, task);
+}
+
+// the fds and mappings live only as long as their tasks, so the number
+// open at once is bounded by the tasks in flight, not by the files
+void grep_parallel(struct grep_search* search, char** files, int no_workers) {
+	struct grep_run run = {0};
+	run.max_in_flight = 4 * no_workers;
+	pthread_mutex_init(&run.lock, NULL);
+	pthread_cond_init(&run.progress, NULL);
+
+	struct work_pool* pool = pool_create(no_workers);
+
+	for (int i = 0; files[i]; ++i) {
+		int fd = open(files[i], O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			perror("Error grep");
+			continue;
+		}
+
+		struct grep_search file_search = *search;
+		file_search.file_name = files[i];
+
+		struct stat st;
+		if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+			grep_submit(&run, pool, &file_search, NULL, NULL, 0, fd);
+			continue;
+		}
+
+		char* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			grep_submit(&run, pool, &file_search, NULL, NULL, 0, fd);
+			continue;
+		}
+		// the mapping does not need its fd
+		close(fd);
+		madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+		struct grep_mapping* mapping = malloc(sizeof(*mapping));
+		*mapping = (struct grep_mapping){data, st.st_size, 1};
+
+		// cut the file after the first newline past every chunk size
+		const char* pos = data;
+		const char* end = data + st.st_size;
+		while (pos < end) {
+			const char* chunk_end = end;
+			if (end - pos > GREP_CHUNK_SIZE) {
+				chunk_end = memchr(pos + GREP_CHUNK_SIZE, '\n', end - pos - GREP_CHUNK_SIZE);
+				chunk_end = chunk_end ? chunk_end + 1 : end;
+			}
+			grep_submit(&run, pool, &file_search, mapping, pos, chunk_end - pos, -1);
+			pos = chunk_end;
+		}
+		grep_mapping_release(mapping);
+	}
+
+	pool_destroy(pool);
+
+	for (int i = 0; i < run.no_tasks; ++i)
+		free(run.tasks[i]);
+
+	free(run.tasks);
+	pthread_mutex_destroy(&run.lock);
+	pthread_cond_destroy(&run.progress);
+}
+
+void add_pattern(char*** patterns, int* no_patterns, char* pattern) {
+	*patterns = realloc(*patterns, (*no_patterns + 1) * sizeof(**patterns));
+	(*patterns)[(*no_patterns)++] = strdup(pattern);
+}
+
+// one pattern per line; returns false if the file can not be read
+bool read_patterns(char* file_name, char*** patterns, int* no_patterns) {
+	FILE* fin = fopen(file_name, "r");
+	if (fin == NULL)
+		return false;
+
+	char* line = NULL;
+	size_t capacity = 0;
+	ssize_t length;
+
+	while ((length = getline(&line, &capacity, fin)) >= 0) {
+		if (length > 0 && line[length - 1] == '\n')
+			line[--length] = '\0';
+		add_pattern(patterns, no_patterns, line);
+	}
+
+	free(line);
+	fclose(fin);
+	return true;
+}
+
+// a single literal uses the vector search, several literals share one
+// aho-corasick automaton and regexes are joined into one alternation,
+// so every file is read once whatever the number of patterns
+bool build_matcher(struct grep_matcher* matcher, char** patterns, int no_patterns, bool regex) {
+	memset(matcher, 0, sizeof(*matcher));
+
+	if (!regex && no_patterns == 1) {
+		matcher->kind = MATCH_LITERAL;
+		matcher->needle = patterns[0];
+		matcher->length = strlen(patterns[0]);
+		return true;
+	}
+
+	if (!regex) {
+		matcher->kind = MATCH_MULTI;
+		matcher->ac = ac_build(patterns, no_patterns);
+		return true;
+	}
+
+	size_t length = 1;
+	for (int i = 0; i < no_patterns; ++i)
+		length += strlen(patterns[i]) + 3;
+
+	char* joined = malloc(length);
+	char* p = joined;
+	for (int i = 0; i < no_patterns; ++i)
+		p += sprintf(p, i ? "|(%s)" : "(%s)", patterns[i]);
+
+	char* error = NULL;
+	matcher->kind = MATCH_REGEX;
+	matcher->program = regex_compile(joined, false, &error);
+	if (matcher->program)
+		matcher->reversed = regex_compile(joined, true, &error);
+	free(joined);
+
+	if (matcher->program == NULL) {
+		fprintf(stderr, "Error grep: invalid regex: %s\n", error);
+		return false;
+	}
+	return true;
+}
+
+void free_matcher(struct grep_matcher* matcher) {
+	if (matcher->ac)
+		ac_free(matcher->ac);
+	if (matcher->program)
+		regex_free(matcher->program);
+	if (matcher->reversed)
+		regex_free(matcher->reversed);
+}
+
+// the pool only pays for itself with several files, or with one file
+// big enough to be searched in chunks
+bool grep_worth_splitting(char** files) {
+	if (files[0] && files[1])
+		return true;
+
+	struct stat st;
+	return stat(files[0], &st) == 0 && S_ISREG(st.st_mode) && st.st_size > GREP_CHUNK_SIZE;
+}
+
+void funct_grep(char** args) {
+	exit_status = 1;
+
+	int no_workers = no_cpus();
+	bool regex = false;
+	char** patterns = NULL;
+	int no_patterns = 0;
+	int i = 0;
+
+	// options come first: -j threads, -E, -F, -e pattern, -f file
+	for (; args[i] && args[i][0] == '-' && args[i][1] != '\0'; ++i) {
+		if (strcmp(args[i], "--") == 0) {
+			++i;
+			break;
+		}
+		else if (strcmp(args[i], "-E") == 0)
+			regex = true;
+		else if (strcmp(args[i], "-F") == 0)
+			regex = false;
+		else if (strcmp(args[i], "-j") == 0 && args[i + 1] && atoi(args[i + 1]) >= 1)
+			no_workers = atoi(args[++i]);
+		else if (strcmp(args[i], "-e") == 0 && args[i + 1])
+			add_pattern(&patterns, &no_patterns, args[++i]);
+		else if (strcmp(args[i], "-f") == 0 && args[i + 1]) {
+			if (!read_patterns(args[++i], &patterns, &no_patterns)) {
+				perror("Error grep");
+				goto out;
+			}
+		}
+		else {
+			sink_puts(&stdout_sink, "Usage: grep [-j threads] [-E] [-e pattern]... [-f file]... [pattern] [file...]\n");
+			goto out;
+		}
+	}
+
+	// without -e or -f the first operand is the pattern
+	if (no_patterns == 0 && args[i])
+		add_pattern(&patterns, &no_patterns, args[i++]);
+
+	if (no_patterns == 0) {
+		sink_puts(&stdout_sink, "Usage: grep [-j threads] [-E] [-e pattern]... [-f file]... [pattern] [file...]\n");
+		goto out;
+	}
+
+	struct grep_matcher matcher;
+	if (!build_matcher(&matcher, patterns, no_patterns, regex))
+		goto out;
+
+	args += i;
+
+	struct grep_search search;
+	memset(&search, 0, sizeof(search));
+	search.matcher = &matcher;
+	search.show_name = (args[0] && args[1]);
+	search.colour = stdout_sink.colour;
+	search.output = NULL;
+
+	// no file given, search the standard input (e.g. inside a pipeline)
+	if (args[0] == NULL) {
+		search.file_name = "(standard input)";
+		grep_fd(&search, STDIN_FILENO);
+	}
+	else if (no_workers > 1 && grep_worth_splitting(args))
+		grep_parallel(&search, args, no_workers);
+	else {
+		for (int j = 0; args[j]; ++j) {
+			int fd = open(args[j], O_RDONLY);
+
+			if (fd < 0) {
+				perror("Error grep");
+				continue;
+			}
+
+			search.file_name = args[j];
+			grep_fd(&search, fd);
+			close(fd);
+		}
+	}
+
+	matcher_cache_free(&search.cache);
+	free_matcher(&matcher);
+	exit_status = 0;
+
+out:
+	for (int j = 0; j < no_patterns; ++j)
+		free(patterns[j]);
+	free(patterns);
+}
+
+void funct_cd(char** args) {
+	exit_status = 1;
+
+	if (chdir(args[0]) != 0) {
+		perror("Error cd");
+		return;
+	}
+
+	exit_status = 0;
+}
+
+// move the data of fd_in into fd_out inside the kernel when possible
+// tries a reflink first, then copy_file_range, then sendfile and
+// falls back to a big read/write loop
+// returns 0 on success and -1 on error (errno is set)
+int copy_fd(int fd_in, int fd_out, off_t size) {
+	// same filesystem with reflink support: no data is moved at all
+	if (ioctl(fd_out, FICLONE, fd_in) == 0)
+		return 0;
+
+	off_t copied = 0;
+
+	while (copied < size) {
+		ssize_t done = copy_file_range(fd_in, NULL, fd_out, NULL, size - copied, 0);
+		if (done <= 0)
+			break;
+		copied += done;
+	}
+	if (copied >= size)
+		return 0;
+
+	while (copied < size) {
+		ssize_t done = sendfile(fd_out, fd_in, NULL, size - copied);
+		if (done <= 0)
+			break;
+		copied += done;
+	}
+	if (copied >= size)
+		return 0;
+
+	// the file may also have grown since it was measured, so copy until eof
+	char* buffer = malloc(COPY_BUFFER_SIZE);
+	if (buffer == NULL)
+		return -1;
+
+	while (true) {
+		ssize_t no_read = read(fd_in, buffer, COPY_BUFFER_SIZE);
+		if (no_read < 0 && errno == EINTR)
+			continue;
+		if (no_read <= 0) {
+			free(buffer);
+			return no_read < 0 ? -1 : 0;
+		}
+
+		if (write_all(fd_out, buffer, no_read) < 0) {
+			free(buffer);
+			return -1;
+		}
+	}
+}
+
+// copy the regular file src over dst, keeping its permissions
+// returns 0 on success, -1 on error after printing the reason
+int copy_file(char* src, char* dst, char* error_prefix) {
+	int fd_in = open(src, O_RDONLY);
+	if (fd_in < 0) {
+		perror(error_prefix);
+		return -1;
+	}
+
+	struct stat src_stat, dst_stat;
+	if (fstat(fd_in, &src_stat) < 0) {
+		perror(error_prefix);
+		close(fd_in);
+		return -1;
+	}
+
+	if (S_ISDIR(src_stat.st_mode)) {
+		errno = EISDIR;
+		perror(error_prefix);
+		close(fd_in);
+		return -1;
+	}
+
+	// copying a file over itself would truncate it
+	if (stat(dst, &dst_stat) == 0 && dst_stat.st_dev == src_stat.st_dev 
+	&& dst_stat.st_ino == src_stat.st_ino) {
+		fprintf(stderr, "%s: '%s' and '%s' are the same file\n", error_prefix, src, dst);
+		close(fd_in);
+		return -1;
+	}
+
+	int fd_out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, src_stat.st_mode & 07777);
+	if (fd_out < 0) {
+		perror(error_prefix);
+		close(fd_in);
+		return -1;
+	}
+
+	posix_fadvise(fd_in, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	int result = copy_fd(fd_in, fd_out, src_stat.st_size);
+	if (result < 0)
+		perror(error_prefix);
+
+	close(fd_in);
+	if (close(fd_out) < 0 && result == 0) {
+		perror(error_prefix);
+		result = -1;
+	}
+
+	return result;
+}
+
+// ------------------------ TREE WALK ----------------------------
+
+// recursive copy and removal of directory trees
+// every directory is a task of the work pool; all file operations are
+// relative to directory fds (openat/fstatat/unlinkat), and a directory
+// is finished (removed, or its mode restored) only after all its
+// children are done
+struct walk_job {
+	bool copy;  // copy the tree, or remove it
+	bool force; // rm -f: a missing root is not an error
+	struct work_pool* pool;
+	long files, dirs, bytes, errors;
+	char* error_prefix;
+};
+
+struct walk_node {
+	struct walk_job* job;
+	struct walk_node* parent; // NULL for the root, which is relative to cwd
+	int src_fd, dst_fd;
+	long pending; // children not finished yet, +1 while the directory is read
+	mode_t mode;
+	char* dst_name; // differs from name only for the root of a copy
+	char name[];
+};
+
+void walk_error(struct walk_job* job, char* name) {
+	fprintf(stderr, "%s: %s: %s\n", job->error_prefix, name, strerror(errno));
+	__atomic_add_fetch(&job->errors, 1, __ATOMIC_RELAXED);
+}
+
+struct walk_node* walk_new_node(struct walk_job* job, struct walk_node* parent, char* name, char* dst_name) {
+	int length = strlen(name);
+	struct walk_node* node = malloc(sizeof(*node) + length + 1);
+	node->job = job;
+	node->parent = parent;
+	node->src_fd = node->dst_fd = -1;
+	node->pending = 1;
+	node->mode = 0700;
+	memcpy(node->name, name, length + 1);
+	node->dst_name = dst_name ? dst_name : node->name;
+	return node;
+}
+
+// called once per finished child and once when the scan ends
+void walk_release(struct walk_node* node) {
+	while (node && __atomic_sub_fetch(&node->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+		struct walk_job* job = node->job;
+		struct walk_node* parent = node->parent;
+
+		if (job->copy) {
+			if (node->dst_fd >= 0) {
+				fchmod(node->dst_fd, node->mode);
+				close(node->dst_fd);
+			}
+			if (node->src_fd >= 0)
+				close(node->src_fd);
+		}
+		else if (node->src_fd >= 0) {
+			close(node->src_fd);
+			// the children are gone, so the directory is empty now
+			if (unlinkat(parent ? parent->src_fd : AT_FDCWD, node->name, AT_REMOVEDIR) < 0)
+				walk_error(job, node->name);
+			else
+				__atomic_add_fetch(&job->dirs, 1, __ATOMIC_RELAXED);
+		}
+
+		free(node);
+		node = parent;
+	}
+}
+
+void walk_directory(void* arg);
+
+void walk_copy_entry(struct walk_node* node, char* name, unsigned char type) {
+	struct walk_job* job = node->job;
+
+	if (type == DT_LNK) {
+		char target[MAX_PATH_LENGTH];
+		ssize_t length = readlinkat(node->src_fd, name, target, sizeof(target) - 1);
+		if (length < 0) {
+			walk_error(job, name);
+			return;
+		}
+		target[length] = '\0';
+		if (symlinkat(target, node->dst_fd, name) < 0)
+			walk_error(job, name);
+		else
+			__atomic_add_fetch(&job->files, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	if (type != DT_REG) {
+		errno = ENOTSUP;
+		walk_error(job, name);
+		return;
+	}
+
+	int fd_in = openat(node->src_fd, name, O_RDONLY | O_NOFOLLOW);
+	struct stat st;
+	if (fd_in < 0 || fstat(fd_in, &st) < 0) {
+		walk_error(job, name);
+		if (fd_in >= 0)
+			close(fd_in);
+		return;
+	}
+
+	int fd_out = openat(node->dst_fd, name, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 07777);
+	if (fd_out < 0) {
+		walk_error(job, name);
+		close(fd_in);
+		return;
+	}
+
+	if (copy_fd(fd_in, fd_out, st.st_size) < 0)
+		walk_error(job, name);
+	else {
+		__atomic_add_fetch(&job->files, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&job->bytes, st.st_size, __ATOMIC_RELAXED);
+	}
+
+	close(fd_in);
+	close(fd_out);
+}
+
+// read one directory: handle its files, queue its subdirectories
+void walk_directory(void* arg) {
+	struct walk_node* node = arg;
+	struct walk_job* job = node->job;
+	int parent_src = node->parent ? node->parent->src_fd : AT_FDCWD;
+	int parent_dst = node->parent ? node->parent->dst_fd : AT_FDCWD;
+
+	node->src_fd = openat(parent_src, node->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (node->src_fd < 0) {
+		walk_error(job, node->name);
+		walk_release(node);
+		return;
+	}
+
+	if (job->copy) {
+		struct stat st;
+		if (fstat(node->src_fd, &st) == 0)
+			node->mode = st.st_mode & 07777;
+
+		// keep the directory writable until its children are copied
+		if (mkdirat(parent_dst, node->dst_name, 0700) < 0 && errno != EEXIST) {
+			walk_error(job, node->dst_name);
+			walk_release(node);
+			return;
+		}
+		node->dst_fd = openat(parent_dst, node->dst_name, O_RDONLY | O_DIRECTORY);
+		if (node->dst_fd < 0) {
+			walk_error(job, node->dst_name);
+			walk_release(node);
+			return;
+		}
+	}
+
+	DIR* dir = fdopendir(dup(node->src_fd));
+	if (dir == NULL) {
+		walk_error(job, node->name);
+		walk_release(node);
+		return;
+	}
+
+	for (struct dirent* entry = readdir(dir); entry; entry = readdir(dir)) {
+		char* name = entry->d_name;
+		if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+			continue;
+
+		unsigned char type = entry->d_type;
+		if (type == DT_UNKNOWN) {
+			struct stat st;
+			if (fstatat(node->src_fd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+				walk_error(job, name);
+				continue;
+			}
+			type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISLNK(st.st_mode) ? DT_LNK 
+				: S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+		}
+
+		if (type == DT_DIR) {
+			__atomic_add_fetch(&node->pending, 1, __ATOMIC_RELAXED);
+			pool_submit(job->pool, walk_directory, walk_new_node(job, node, name, NULL));
+		}
+		else if (job->copy)
+			walk_copy_entry(node, name, type);
+		else if (unlinkat(node->src_fd, name, 0) < 0)
+			walk_error(job, name);
+		else
+			__atomic_add_fetch(&job->files, 1, __ATOMIC_RELAXED);
+	}
+
+	closedir(dir);
+	walk_release(node);
+}
+
+double elapsed_seconds(struct timespec* start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// true if the directory path is the directory dir or lies below it,
+// found by following ".." from path up to the root
+bool inside_directory(char* path, struct stat* dir) {
+	int fd = open(path, O_RDONLY | O_DIRECTORY);
+	bool inside = false;
+	struct stat st;
+
+	while (fd >= 0 && fstat(fd, &st) == 0) {
+		if (st.st_dev == dir->st_dev && st.st_ino == dir->st_ino) {
+			inside = true;
+			break;
+		}
+
+		int parent = openat(fd, "..", O_RDONLY | O_DIRECTORY);
+		close(fd);
+		fd = parent;
+
+		// the root is its own parent
+		struct stat parent_stat;
+		if (fd >= 0 && fstat(fd, &parent_stat) == 0
+				&& parent_stat.st_dev == st.st_dev && parent_stat.st_ino == st.st_ino)
+			break;
+	}
+
+	if (fd >= 0)
+		close(fd);
+	return inside;
+}
+
+// copy (dst != NULL) or remove the tree rooted at src
+// returns the number of errors
+long walk_tree(char* src, char* dst, bool force, char* error_prefix) {
+	struct walk_job job = {0};
+	job.copy = (dst != NULL);
+	job.force = force;
+	job.error_prefix = error_prefix;
+
+	struct stat st;
+	if (lstat(src, &st) < 0) {
+		if (force && errno == ENOENT)
+			return 0;
+		walk_error(&job, src);
+		return job.errors;
+	}
+
+	// a single file needs no walk
+	if (!S_ISDIR(st.st_mode)) {
+		if (job.copy)
+			return copy_file(src, dst, error_prefix) < 0;
+		if (unlink(src) < 0)
+			walk_error(&job, src);
+		return job.errors;
+	}
+
+	// copying into an existing directory creates dst/basename(src)
+	char* dst_name = dst;
+	char* target = NULL;
+	struct stat dst_stat;
+	if (job.copy && stat(dst, &dst_stat) == 0 && S_ISDIR(dst_stat.st_mode)) {
+		char* base = strrchr(src, '/');
+		while (base && base[1] == '\0' && base != src) {
+			// ignore trailing slashes
+			*base = '\0';
+			base = strrchr(src, '/');
+		}
+		base = base ? base + 1 : src;
+		target = malloc(strlen(dst) + strlen(base) + 2);
+		sprintf(target, "%s/%s", dst, base);
+		dst_name = target;
+	}
+
+	// the copy would walk into itself, with no end
+	if (job.copy) {
+		char* parent = strdup(dst);
+		if (!target) {
+			char* slash = strrchr(parent, '/');
+			if (slash == parent)
+				slash[1] = '\0';
+			else if (slash)
+				*slash = '\0';
+			else
+				strcpy(parent, ".");
+		}
+		bool inside = inside_directory(parent, &st);
+		free(parent);
+		if (inside) {
+			fprintf(stderr, "%s: cannot copy %s into itself\n", error_prefix, src);
+			free(target);
+			return 1;
+		}
+	}
+
+	// every directory being walked holds descriptors; the old limit
+	// comes back once the walk is over, so programs started later keep it
+	struct rlimit limit;
+	rlim_t saved_limit = RLIM_INFINITY;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+		saved_limit = limit.rlim_cur;
+		limit.rlim_cur = limit.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &limit) < 0)
+			saved_limit = RLIM_INFINITY;
+	}
+
+	int no_workers = 2 * no_cpus();
+	if (no_workers < 4)
+		no_workers = 4;
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	job.pool = pool_create(no_workers);
+	pool_submit(job.pool, walk_directory, walk_new_node(&job, NULL, src, dst_name));
+	pool_destroy(job.pool);
+
+	if (saved_limit != RLIM_INFINITY) {
+		limit.rlim_cur = saved_limit;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+
+	double seconds = elapsed_seconds(&start);
+	if (seconds <= 0)
+		seconds = 1e-9;
+
+	if (job.copy)
+		fprintf(stderr, "cp: %ld files, %ld bytes in %.3f s (%.0f files/s, %.1f MB/s)\n",
+			job.files, job.bytes, seconds, job.files / seconds, job.bytes / seconds / 1e6);
+	else
+		fprintf(stderr, "rm: %ld files, %ld directories in %.3f s (%.0f files/s)\n",
+			job.files, job.dirs, seconds, (job.files + job.dirs) / seconds);
+
+	free(target);
+	return job.errors;
+}
+
+void funct_mv(char** args) {
+	exit_status = 1;
+
+	char* src = args[0];
+	char* dst = args[1];
+
+	// same filesystem: only the directory entry moves
+	if (rename(src, dst) == 0) {
+		exit_status = 0;
+		return;
+	}
+
+	if (errno != EXDEV) {
+		perror("Error mv");
+		return;
+	}
+
+	// different filesystems: copy the data, then remove the source
+	if (copy_file(src, dst, "Error mv") < 0)
+		return;
+
+	if (unlink(src)) {
+		perror("An error occured while deleting the file\n");
+		return;
+	}
+	
+	exit_status = 0;
+}
+
+void funct_cp(char** args) {
+	exit_status = 1;
+
+	bool recursive = false;
+	int first = 0;
+	if (args[0] && (strcmp(args[0], "-r") == 0 || strcmp(args[0], "-R") == 0)) {
+		recursive = true;
+		first = 1;
+	}
+
+	if (args[first] == NULL || args[first + 1] == NULL || args[first + 2] != NULL) {
+		sink_puts(&stdout_sink, "Usage: cp [-r] source destination\n");
+		return;
+	}
+
+	if (recursive) {
+		if (walk_tree(args[first], args[first + 1], false, "Error cp") > 0)
+			return;
+	}
+	else if (copy_file(args[first], args[first + 1], "Error cp") < 0)
+		return;
+
+	exit_status = 0;
+}
+
+void funct_rm(char** args) {
+	exit_status = 1;
+
+	bool recursive = false, force = false;
+	int i = 0;
+
+	for (; args[i] && args[i][0] == '-' && args[i][1] != '\0'; ++i) {
+		for (char* flag = args[i] + 1; *flag; ++flag) {
+			if (*flag == 'r' || *flag == 'R')
+				recursive = true;
+			else if (*flag == 'f')
+				force = true;
+			else {
+				sink_puts(&stdout_sink, "Usage: rm [-rf] file...\n");
+				return;
+			}
+		}
+	}
+
+	bool failed = false;
+
+	for (; args[i]; ++i) {
+		if (recursive) {
+			if (walk_tree(args[i], NULL, force, "Error rm") > 0)
+				failed = true;
+			continue;
+		}
+
+		if (unlink(args[i])) {
+			if (force && errno == ENOENT)
+				continue;
+			perror("Error rm");
+			failed = true;
+		}
+	}
+
+	if (!failed)
+		exit_status = 0;
+}
+
+void funct_rmdir(char** args) {
+	exit_status = 1;
+
+	bool failed = false;
+
+	for (int i = 0; args[i]; ++i) {
+		// only empty directories, rm -r removes whole trees
+		if (rmdir(args[i]) < 0) {
+			perror("Error rmdir");
+			failed = true;
+		}
+	}
+
+	if (!failed)
+		exit_status = 0;
+}
+
+void funct_clear(char** args) {
+	exit_status = 1;
+	system("clear");
+	exit_status = 0;
+}
+
+// history: every command, oldest first
+// history -s pattern: the commands that contain the pattern
+void funct_history(char** args) {
+	exit_status = 1;
+
+	if (args[0] == NULL) {
+		print_history();
+		exit_status = 0;
+		return;
+	}
+
+	if (strcmp(args[0], "-s") != 0 || args[1] == NULL) {
+		fprintf(stderr, "Error history: usage: history [-s pattern]\n");
+		return;
+	}
+	print_history_matches(args[1]);
+	exit_status = 0;
+}
+
+void funct_pwd(char** args) {
+	exit_status = 1;
+	print_curr_dir();
+	sink_write(&stdout_sink, "\n", 1);
+	exit_status = 0;
+}
+
+void funct_true(char** args) {
+	exit_status = 0;
+}
+
+void funct_false(char** args) {
+	exit_status = 1;
+}
+
+void funct_exit(char** args) {
+	kill_signal = 1;
+	exit_status = 0;
+}
+
+// load the builtins of a plugin (see shell_plugin.h)
+void funct_load(char** args) {
+	exit_status = 1;
+
+	// a bare name would be searched in the library path
+	char* path = args[0];
+	if (strchr(path, '/') == NULL) {
+		path = arena_alloc(&line_arena, strlen(path) + 3);
+		sprintf(path, "./%s", args[0]);
+	}
+
+	void* handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (handle == NULL) {
+		fprintf(stderr, "Error load: %s\n", dlerror());
+		return;
+	}
+
+	const struct shell_plugin* (*plugin_init)(void) = (const struct shell_plugin* (*)(void))dlsym(handle, "shell_plugin_init");
+	const struct shell_plugin* plugin = plugin_init ? plugin_init() : NULL;
+
+	if (plugin == NULL || plugin->version != SHELL_PLUGIN_VERSION) {
+		fprintf(stderr, "Error load: %s is not a plugin of this shell\n", args[0]);
+		dlclose(handle);
+		return;
+	}
+
+	// the handle stays open, the builtins live in it
+	register_builtins(plugin->builtins, plugin->no_builtins);
+	exit_status = 0;
+}
+
+// numbered output (cat -n); numbering goes on across files
+struct cat_numbering {
+	long line;
+	bool at_line_start;
+};
+
+// copy a block, putting the line number in front of every line
+int cat_numbered_block(struct cat_numbering* numbering, const char* block, size_t length) {
+	// the exact output size is known from the number of lines
+	size_t no_lines = count_newlines(block, length) + 1;
+	char* output = malloc(length + no_lines * 24);
+	char* out = output;
+	const char* pos = block;
+	const char* end = block + length;
+
+	while (pos < end) {
+		if (numbering->at_line_start)
+			out += sprintf(out, "%6ld\t", ++numbering->line);
+
+		const char* newline = memchr(pos, '\n', end - pos);
+		const char* line_end = newline ? newline + 1 : end;
+		memcpy(out, pos, line_end - pos);
+		out += line_end - pos;
+		numbering->at_line_start = (newline != NULL);
+		pos = line_end;
+	}
+
+	int result = sink_write(&stdout_sink, output, out - output);
+	free(output);
+	return result;
+}
+
+// copy fd_in to stdout; returns 0 on success and -1 on error
+int cat_fd(int fd_in, struct cat_numbering* numbering, char* buffer) {
+	struct stat in_stat, out_stat;
+	bool in_regular = fstat(fd_in, &in_stat) == 0 && S_ISREG(in_stat.st_mode);
+	bool out_pipe = fstat(STDOUT_FILENO, &out_stat) == 0 && S_ISFIFO(out_stat.st_mode);
+	bool out_regular = S_ISREG(out_stat.st_mode);
+	bool started = false;
+
+	if (in_regular)
+		posix_fadvise(fd_in, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	if (numbering == NULL) {
+		// into a pipe the pages are moved without being copied
+		if (out_pipe) {
+			while (true) {
+				ssize_t done = splice(fd_in, NULL, STDOUT_FILENO, NULL, CAT_BUFFER_SIZE, SPLICE_F_MOVE | SPLICE_F_MORE);
+				if (done < 0 && errno == EINTR)
+					continue;
+				if (done == 0)
+					return 0;
+				if (done < 0) {
+					if (started || (errno != EINVAL && errno != ENOSYS))
+						return -1;
+					break;
+				}
+				started = true;
+				stdout_sink.bytes += done;
+			}
+		}
+		// file to file stays inside the kernel
+		else if (in_regular && out_regular) {
+			while (true) {
+				ssize_t done = sendfile(STDOUT_FILENO, fd_in, NULL, CAT_BUFFER_SIZE);
+				if (done < 0 && errno == EINTR)
+					continue;
+				if (done == 0)
+					return 0;
+				if (done < 0) {
+					if (started || (errno != EINVAL && errno != ENOSYS))
+						return -1;
+					break;
+				}
+				started = true;
+				stdout_sink.bytes += done;
+			}
+		}
+	}
+
+	while (true) {
+		ssize_t no_read = read(fd_in, buffer, CAT_BUFFER_SIZE);
+		if (no_read < 0 && errno == EINTR)
+			continue;
+		if (no_read <= 0)
+			return no_read;
+
+		int result = numbering ? cat_numbered_block(numbering, buffer, no_read)
+			: sink_write(&stdout_sink, buffer, no_read);
+		// a pipe or a terminal is copied as it comes
+		if (result == 0 && !in_regular)
+			result = sink_flush(&stdout_sink);
+		if (result < 0)
+			return -1;
+	}
+}
+
+void funct_cat(char** args) {
+	exit_status = 1;
+
+	struct cat_numbering numbering = {0, true};
+	bool number = false;
+	int first = 0;
+
+	if (args[0] && strcmp(args[0], "-n") == 0) {
+		number = true;
+		first = 1;
+	}
+
+	char* buffer;
+	if (posix_memalign((void**)&buffer, 4096, CAT_BUFFER_SIZE) != 0) {
+		perror("Error cat");
+		return;
+	}
+
+	// splice and sendfile write behind the sink, what it holds goes first
+	sink_flush(&stdout_sink);
+
+	// no file given, copy the standard input (e.g. inside a pipeline)
+	bool from_stdin = (args[first] == NULL);
+	bool failed = false;
+
+	for (int i = first; from_stdin || args[i]; ++i) {
+		bool is_stdin = from_stdin || strcmp(args[i], "-") == 0;
+		int fd = is_stdin ? STDIN_FILENO : open(args[i], O_RDONLY);
+
+		if (fd < 0) {
+			perror("Error cat");
+			failed = true;
+			continue;
+		}
+
+		if (cat_fd(fd, number ? &numbering : NULL, buffer) < 0) {
+			perror("Error cat");
+			failed = true;
+		}
+
+		if (is_stdin) {
+			if (from_stdin)
+				break;
+			continue;
+		}
+		close(fd);
+	} 
+
+	free(buffer);
+
+	if (!failed)
+		exit_status = 0;
+}
+
+// ---------------------------- SORT -----------------------------
+
+// sort reads its input in blocks into one buffer and makes a record for
+// every line: where it is, where its key is, and the first 8 bytes of
+// the key packed big endian (or its value with -n), so most comparisons
+// are decided by the record alone, without touching the line
+// the records are sorted in slices by the work pool and the slices are
+// merged in pairs; once the lines and their records pass the memory
+// cap (-S), they are sorted and spilled to an unlinked temporary file,
+// and the files are merged k ways at the end
+struct sort_options {
+	bool numeric, reverse, unique;
+	char separator; // '\0' when fields are separated by blanks
+	int key_first, key_last; // 1 based fields, 0 for the whole line / to its end
+	size_t memory;
+	int no_workers;
+};
+
+struct sort_record {
+	uint64_t offset; // from sort_data, the address itself when that is NULL
+	uint32_t length;
+	uint32_t key_start, key_length;
+	union {
+		uint64_t prefix;
+		double number;
+	};
+};
+
+// what the comparisons look at (qsort has no context argument)
+struct sort_options* sort_active;
+const char* sort_data;
+
+bool sort_blank(char c) {
+	return c == ' ' || c == '\t';
+}
+
+// [start, start + length) of the key of a line
+void sort_find_key(struct sort_options* options, const char* line, size_t length, size_t* start, size_t* key_length) {
+	if (options->key_first == 0) {
+		*start = 0;
+		*key_length = length;
+		return;
+	}
+
+	// the fields before the key; without -t a field is the blanks
+	// before it and its text, blanks included in the key as well
+	size_t pos = 0;
+	for (int field = 1; field < options->key_first && pos < length; ++field) {
+		if (options->separator) {
+			const char* next = memchr(line + pos, options->separator, length - pos);
+			pos = next ? next - line + 1 : length;
+			continue;
+		}
+		while (pos < length && sort_blank(line[pos]))
+			++pos;
+		while (pos < length && !sort_blank(line[pos]))
+			++pos;
+	}
+	*start = pos;
+
+	if (options->key_last == 0) {
+		*key_length = length - pos;
+		return;
+	}
+
+	size_t end = pos;
+	for (int field = options->key_first; field <= options->key_last && end < length; ++field) {
+		if (options->separator) {
+			if (field > options->key_first)
+				++end; // the separator ending the field before
+			const char* next = memchr(line + end, options->separator, length - end);
+			end = next ? (size_t)(next - line) : length;
+			continue;
+		}
+		while (end < length && sort_blank(line[end]))
+			++end;
+		while (end < length && !sort_blank(line[end]))
+			++end;
+	}
+	*key_length = (end > length ? length : end) - pos;
+}
+
+// the number at the start of a key: blanks, a sign, digits and a
+// decimal point; no number counts as 0
+double sort_number(const char* key, size_t length) {
+	size_t i = 0;
+	while (i < length && sort_blank(key[i]))
+		++i;
+	bool negative = i < length && key[i] == '-';
+	if (negative)
+		++i;
+
+	double value = 0, scale = 1;
+	bool fraction = false;
+	for (; i < length; ++i) {
+		if (key[i] == '.' && !fraction)
+			fraction = true;
+		else if (key[i] >= '0' && key[i] <= '9') {
+			if (fraction)
+				value += (key[i] - '0') * (scale /= 10);
+			else
+				value = value * 10 + (key[i] - '0');
+		}
+		else
+			break;
+	}
+	return negative ? -value : value;
+}
+
+void sort_make_record(struct sort_options* options, struct sort_record* record, const char* line, uint64_t offset, size_t length) {
+	size_t start, key_length;
+	sort_find_key(options, line, length, &start, &key_length);
+
+	record->offset = offset;
+	record->length = length;
+	record->key_start = start;
+	record->key_length = key_length;
+
+	if (options->numeric) {
+		record->number = sort_number(line + start, key_length);
+		return;
+	}
+	record->prefix = 0;
+	for (size_t i = 0; i < 8; ++i)
+		record->prefix = record->prefix << 8 | (i < key_length ? (unsigned char)line[start + i] : 0);
+}
+
+const char* sort_line(const struct sort_record* record) {
+	return sort_data ? sort_data + record->offset : (const char*)(uintptr_t)record->offset;
+}
+
+int sort_compare_bytes(const char* a, size_t a_length, const char* b, size_t b_length) {
+	int result = memcmp(a, b, a_length < b_length ? a_length : b_length);
+	if (result)
+		return result;
+	return (a_length > b_length) - (a_length < b_length);
+}
+
+// compares the keys only, before -r
+int sort_compare_keys(const struct sort_record* a, const struct sort_record* b) {
+	if (sort_active->numeric)
+		return (a->number > b->number) - (a->number < b->number);
+	if (a->prefix != b->prefix)
+		return a->prefix < b->prefix ? -1 : 1;
+	if (a->key_length <= 8 && b->key_length <= 8)
+		return (a->key_length > b->key_length) - (a->key_length < b->key_length);
+	return sort_compare_bytes(sort_line(a) + a->key_start, a->key_length, sort_line(b) + b->key_start, b->key_length);
+}
+
+// equal keys are ordered by the whole line, except with -u, where
+// they are equal (and the caller keeps the first line of every key)
+int sort_compare_lines(const struct sort_record* a, const struct sort_record* b) {
+	int result = sort_compare_keys(a, b);
+
+	if (result == 0 && !sort_active->unique && (sort_active->numeric || sort_active->key_first))
+		result = sort_compare_bytes(sort_line(a), a->length, sort_line(b), b->length);
+	return sort_active->reverse ? -result : result;
+}
+
+// in a chunk, lines with equal keys keep their input order under -u
+int sort_compare(const void* x, const void* y) {
+	const struct sort_record* a = x;
+	const struct sort_record* b = y;
+	int result = sort_compare_lines(a, b);
+
+	if (result == 0 && sort_active->unique)
+		return (a->offset > b->offset) - (a->offset < b->offset);
+	return result;
+}
+
+struct sort_task {
+	struct sort_record* records;
+	struct sort_record* output;
+	size_t middle, length; // merge [0, middle) and [middle, length)
+};
+
+void sort_slice_task(void* arg) {
+	struct sort_task* task = arg;
+	qsort(task->records, task->length, sizeof(*task->records), sort_compare);
+}
+
+void sort_merge_task(void* arg) {
+	struct sort_task* task = arg;
+	struct sort_record* a = task->records;
+	struct sort_record* b = task->records + task->middle;
+	struct sort_record* a_end = b;
+	struct sort_record* b_end = task->records + task->length;
+	struct sort_record* out = task->output;
+
+	while (a < a_end && b < b_end)
+		*out++ = sort_compare(b, a) < 0 ? *b++ : *a++;
+	memcpy(out, a, (a_end - a) * sizeof(*a));
+	out += a_end - a;
+	memcpy(out, b, (b_end - b) * sizeof(*b));
+}
+
+// runs the tasks on the pool, or here without one
+void sort_run_tasks(struct work_pool* pool, void (*run)(void*), struct sort_task* tasks, int no_tasks) {
+	for (int i = 0; i < no_tasks; ++i) {
+		if (pool)
+			pool_submit(pool, run, &tasks[i]);
+		else
+			run(&tasks[i]);
+	}
+	if (pool)
+		pool_wait(pool);
+}
+
+// returns the sorted records, which are either records or spare
+// the records are cut in slices small enough to sort in the cache,
+// at least one per worker, and the slices are merged in pairs
+struct sort_record* sort_records(struct sort_options* options, struct sort_record* records, struct sort_record* spare, size_t no_records) {
+	size_t no_slices = (no_records + SORT_SLICE_RECORDS - 1) / SORT_SLICE_RECORDS;
+	if (no_records >= SORT_PARALLEL_MIN && no_slices < (size_t)options->no_workers)
+		no_slices = options->no_workers;
+	if (no_slices <= 1) {
+		qsort(records, no_records, sizeof(*records), sort_compare);
+		return records;
+	}
+
+	int no_workers = options->no_workers < (int)no_slices ? options->no_workers : (int)no_slices;
+	struct work_pool* pool = no_workers > 1 ? pool_create(no_workers) : NULL;
+	struct sort_task* tasks = malloc(no_slices * sizeof(*tasks));
+	size_t* bounds = malloc((no_slices + 1) * sizeof(*bounds));
+	for (size_t i = 0; i <= no_slices; ++i)
+		bounds[i] = no_records * i / no_slices;
+
+	for (size_t i = 0; i < no_slices; ++i)
+		tasks[i] = (struct sort_task){records + bounds[i], NULL, 0, bounds[i + 1] - bounds[i]};
+	sort_run_tasks(pool, sort_slice_task, tasks, no_slices);
+
+	// neighbouring slices are merged in pairs, from one array into the other
+	for (size_t width = 1; width < no_slices; width *= 2) {
+		int no_tasks = 0;
+		for (size_t i = 0; i < no_slices; i += 2 * width) {
+			size_t middle = i + width < no_slices ? i + width : no_slices;
+			size_t end = i + 2 * width < no_slices ? i + 2 * width : no_slices;
+			tasks[no_tasks++] = (struct sort_task){records + bounds[i], spare + bounds[i], bounds[middle] - bounds[i], bounds[end] - bounds[i]};
+		}
+		sort_run_tasks(pool, sort_merge_task, tasks, no_tasks);
+
+		struct sort_record* swap = records;
+		records = spare;
+		spare = swap;
+	}
+
+	if (pool)
+		pool_destroy(pool);
+	free(tasks);
+	free(bounds);
+	return records;
+}
+
+// the sorted lines of a chunk, to the output or to a run file
+struct sort_writer {
+	struct output_sink* sink; // NULL to write to fd
+	int fd;
+	struct text_buffer buffer;
+	bool has_last; // -u: the last line written, to drop lines with its key
+	struct sort_record last;
+	struct text_buffer last_line;
+};
+
+int sort_write_line(struct sort_writer* writer, const struct sort_record* record) {
+	const char* line = sort_line(record);
+
+	if (sort_active->unique) {
+		// the record is compared through a copy of the line, which may
+		// be gone from its buffer by now
+		if (writer->has_last && sort_compare_keys(&writer->last, record) == 0)
+			return 0;
+		writer->last_line.length = 0;
+		buffer_append(&writer->last_line, line, record->length);
+		writer->last = *record;
+		writer->last.offset = (uintptr_t)writer->last_line.data - (uintptr_t)sort_data;
+		writer->has_last = true;
+	}
+
+	if (writer->sink) {
+		struct iovec iov[2] = {{(void*)line, record->length}, {"\n", 1}};
+		return sink_writev(writer->sink, iov, 2);
+	}
+
+	buffer_append(&writer->buffer, line, record->length);
+	buffer_append(&writer->buffer, "\n", 1);
+	if (writer->buffer.length >= SORT_READ_SIZE)
+		return buffer_flush(&writer->buffer, writer->fd);
+	return 0;
+}
+
+// a spilled run, read back a block at a time during the merge
+struct sort_run {
+	int fd;
+	struct text_buffer buffer;
+	size_t start; // of the next line
+	bool end_of_file;
+	struct sort_record head;
+};
+
+// the next line of a run into run->head; false when the run is done
+bool sort_run_next(struct sort_options* options, struct sort_run* run) {
+	while (true) {
+		char* data = run->buffer.data;
+		char* newline = run->start < run->buffer.length ? memchr(data + run->start, '\n', run->buffer.length - run->start) : NULL;
+		if (newline) {
+			size_t length = newline - (data + run->start);
+			sort_make_record(options, &run->head, data + run->start, (uintptr_t)(data + run->start), length);
+			run->start += length + 1;
+			return true;
+		}
+		if (run->end_of_file)
+			return false; // runs are written with a newline after every line
+
+		memmove(run->buffer.data, run->buffer.data + run->start, run->buffer.length - run->start);
+		run->buffer.length -= run->start;
+		run->start = 0;
+		buffer_reserve(&run->buffer, SORT_RUN_BLOCK);
+		ssize_t done = read(run->fd, run->buffer.data + run->buffer.length, SORT_RUN_BLOCK);
+		if (done < 0 && errno == EINTR)
+			continue;
+		if (done <= 0) {
+			if (done < 0)
+				perror("Error sort");
+			run->end_of_file = true;
+			continue;
+		}
+		run->buffer.length += done;
+	}
+}
+
+// heap order: the smaller line first, the earlier run on a tie (the
+// records point into the run buffers, their offsets mean nothing here)
+bool sort_run_before(struct sort_run* runs, int a, int b) {
+	int result = sort_compare_lines(&runs[a].head, &runs[b].head);
+	return result < 0 || (result == 0 && a < b);
+}
+
+void sort_sift_down(struct sort_run* runs, int* heap, int size, int i) {
+	while (true) {
+		int smallest = i;
+		for (int child = 2 * i + 1; child <= 2 * i + 2 && child < size; ++child)
+			if (sort_run_before(runs, heap[child], heap[smallest]))
+				smallest = child;
+		if (smallest == i)
+			return;
+		int swap = heap[i];
+		heap[i] = heap[smallest];
+		heap[smallest] = swap;
+		i = smallest;
+	}
+}
+
+// k way merge of the runs into the output
+bool sort_merge_runs(struct sort_options* options, int* run_fds, int no_runs, struct sort_writer* writer) {
+	struct sort_run* runs = calloc(no_runs, sizeof(*runs));
+	int* heap = malloc(no_runs * sizeof(*heap));
+	int size = 0;
+	bool ok = true;
+
+	// the records point straight into the run buffers
+	sort_data = NULL;
+	for (int i = 0; i < no_runs; ++i) {
+		runs[i].fd = run_fds[i];
+		lseek(run_fds[i], 0, SEEK_SET);
+		if (sort_run_next(options, &runs[i]))
+			heap[size++] = i;
+	}
+	for (int i = size / 2 - 1; i >= 0; --i)
+		sort_sift_down(runs, heap, size, i);
+
+	while (size > 0) {
+		struct sort_run* run = &runs[heap[0]];
+		if (sort_write_line(writer, &run->head) < 0) {
+			perror("Error sort");
+			ok = false;
+			break;
+		}
+		if (!sort_run_next(options, run))
+			heap[0] = heap[--size];
+		sort_sift_down(runs, heap, size, 0);
+	}
+
+	for (int i = 0; i < no_runs; ++i)
+		free(runs[i].buffer.data);
+	free(runs);
+	free(heap);
+	return ok;
+}
+
+// everything read so far that is not sorted yet
+struct sort_chunk {
+	struct text_buffer data;
+	size_t scanned; // the lines before this have records
+	struct sort_record* records;
+	size_t no_records, capacity;
+};
+
+void sort_scan_lines(struct sort_options* options, struct sort_chunk* chunk) {
+	while (chunk->scanned < chunk->data.length) {
+		char* line = chunk->data.data + chunk->scanned;
+		char* newline = memchr(line, '\n', chunk->data.length - chunk->scanned);
+		if (newline == NULL)
+			return;
+
+		if (chunk->no_records == chunk->capacity) {
+			chunk->capacity = chunk->capacity ? 2 * chunk->capacity : 4096;
+			chunk->records = realloc(chunk->records, chunk->capacity * sizeof(*chunk->records));
+		}
+		sort_make_record(options, &chunk->records[chunk->no_records++], line, chunk->scanned, newline - line);
+		chunk->scanned = newline + 1 - chunk->data.data;
+	}
+}
+
+// sort the complete lines of the chunk into the writer, keeping the
+// partial last line for the next block
+bool sort_flush_chunk(struct sort_options* options, struct sort_chunk* chunk, struct sort_writer* writer) {
+	struct sort_record* spare = malloc((chunk->no_records + 1) * sizeof(*spare));
+	sort_data = chunk->data.data;
+	struct sort_record* sorted = sort_records(options, chunk->records, spare, chunk->no_records);
+
+	bool ok = true;
+	for (size_t i = 0; i < chunk->no_records && ok; ++i)
+		ok = sort_write_line(writer, &sorted[i]) == 0;
+	if (ok && !writer->sink)
+		ok = buffer_flush(&writer->buffer, writer->fd) == 0;
+	if (!ok)
+		perror("Error sort");
+	free(spare);
+
+	memmove(chunk->data.data, chunk->data.data + chunk->scanned, chunk->data.length - chunk->scanned);
+	chunk->data.length -= chunk->scanned;
+	chunk->scanned = 0;
+	chunk->no_records = 0;
+	return ok;
+}
+
+// a new unlinked file for a run, or -1
+int sort_temporary_file() {
+	const char* directory = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+	char* path = malloc(strlen(directory) + sizeof("/shell_sort_XXXXXX"));
+	sprintf(path, "%s/shell_sort_XXXXXX", directory);
+	int fd = mkostemp(path, O_CLOEXEC);
+	if (fd >= 0)
+		unlink(path);
+	else
+		fprintf(stderr, "Error sort: %s: %s\n", path, strerror(errno));
+	free(path);
+	return fd;
+}
+
+// a size with an optional K, M or G suffix, 0 if it is not one
+size_t parse_size(const char* text) {
+	char* end;
+	errno = 0;
+	unsigned long long size = strtoull(text, &end, 10);
+	if (errno || end == text)
+		return 0;
+	switch (*end) {
+	case 'G': case 'g': size <<= 10; // fall through
+	case 'M': case 'm': size <<= 10; // fall through
+	case 'K': case 'k': size <<= 10; ++end;
+	}
+	return *end == '\0' ? size : 0;
+}
+
+// sort [-nru] [-t char] [-k first[,last]] [-S size] [-j threads] [file...]
+void funct_sort(char** args) {
+	exit_status = 1;
+
+	struct sort_options options = {0};
+	options.memory = SORT_MEMORY;
+	options.no_workers = no_cpus();
+	int i = 0;
+
+	for (; args[i] && args[i][0] == '-' && args[i][1] != '\0'; ++i) {
+		char* option = args[i];
+		bool valid = true;
+
+		if (strcmp(option, "--") == 0) {
+			++i;
+			break;
+		}
+		else if (strcmp(option, "-t") == 0 && args[i + 1] && strlen(args[i + 1]) == 1)
+			options.separator = args[++i][0];
+		else if (strcmp(option, "-k") == 0 && args[i + 1]) {
+			char* end;
+			options.key_first = strtol(args[++i], &end, 10);
+			options.key_last = *end == ',' ? strtol(end + 1, &end, 10) : 0;
+			valid = options.key_first > 0 && *end == '\0' && (options.key_last == 0 || options.key_last >= options.key_first);
+		}
+		else if (strcmp(option, "-S") == 0 && args[i + 1])
+			valid = (options.memory = parse_size(args[++i])) > 0;
+		else if (strcmp(option, "-j") == 0 && args[i + 1])
+			valid = (options.no_workers = atoi(args[++i])) > 0;
+		else {
+			for (char* flag = option + 1; *flag && valid; ++flag) {
+				if (*flag == 'n')
+					options.numeric = true;
+				else if (*flag == 'r')
+					options.reverse = true;
+				else if (*flag == 'u')
+					options.unique = true;
+				else
+					valid = false;
+			}
+		}
+
+		if (!valid) {
+			sink_puts(&stdout_sink, "Usage: sort [-nru] [-t char] [-k first[,last]] [-S size] [-j threads] [file...]\n");
+			return;
+		}
+	}
+	if (options.memory < SORT_MIN_MEMORY)
+		options.memory = SORT_MIN_MEMORY;
+	sort_active = &options;
+
+	struct sort_chunk chunk = {0};
+	struct sort_writer output = {0};
+	output.sink = &stdout_sink;
+	int* runs = NULL;
+	int no_runs = 0;
+	bool failed = false;
+
+	bool from_stdin = args[i] == NULL;
+	for (; !failed && (from_stdin || args[i]); ++i) {
+		bool is_stdin = from_stdin || strcmp(args[i], "-") == 0;
+		int fd = is_stdin ? STDIN_FILENO : open(args[i], O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			fprintf(stderr, "Error sort: %s: %s\n", args[i], strerror(errno));
+			failed = true;
+			break;
+		}
+
+		while (true) {
+			buffer_reserve(&chunk.data, SORT_READ_SIZE + 1);
+			ssize_t done = read(fd, chunk.data.data + chunk.data.length, SORT_READ_SIZE);
+			if (done < 0 && errno == EINTR)
+				continue;
+			if (done < 0) {
+				perror("Error sort");
+				failed = true;
+				break;
+			}
+			// a last line without a newline ends with its file
+			if (done == 0) {
+				if (chunk.data.length > chunk.scanned)
+					buffer_append(&chunk.data, "\n", 1);
+				sort_scan_lines(&options, &chunk);
+				break;
+			}
+			chunk.data.length += done;
+			sort_scan_lines(&options, &chunk);
+
+			// over the cap, the lines so far become a run
+			if (chunk.data.capacity + chunk.capacity * 2 * sizeof(struct sort_record) > options.memory && chunk.no_records > 0) {
+				struct sort_writer writer = {0};
+				writer.fd = sort_temporary_file();
+				if (writer.fd < 0 || !sort_flush_chunk(&options, &chunk, &writer))
+					failed = true;
+				free(writer.buffer.data);
+				free(writer.last_line.data);
+				runs = realloc(runs, (no_runs + 1) * sizeof(*runs));
+				runs[no_runs++] = writer.fd;
+				if (failed)
+					break;
+			}
+		}
+
+		if (!is_stdin)
+			close(fd);
+		if (from_stdin)
+			break;
+	}
+
+	if (!failed && no_runs == 0)
+		failed = !sort_flush_chunk(&options, &chunk, &output);
+	else if (!failed) {
+		// the rest is one more run, and all of them are merged
+		struct sort_writer writer = {0};
+		writer.fd = sort_temporary_file();
+		failed = writer.fd < 0 || !sort_flush_chunk(&options, &chunk, &writer);
+		free(writer.buffer.data);
+		free(writer.last_line.data);
+		runs = realloc(runs, (no_runs + 1) * sizeof(*runs));
+		runs[no_runs++] = writer.fd;
+
+		if (!failed)
+			failed = !sort_merge_runs(&options, runs, no_runs, &output);
+	}
+
+	for (int r = 0; r < no_runs; ++r)
+		if (runs[r] >= 0)
+			close(runs[r]);
+	free(runs);
+	free(chunk.data.data);
+	free(chunk.records);
+	free(output.last_line.data);
+
+	if (!failed)
+		exit_status = 0;
+}
+
+// uniq [-c] [file]: adjacent equal lines once (-c: with their count)
+void funct_uniq(char** args) {
+	exit_status = 1;
+
+	bool count = false;
+	int i = 0;
+	if (args[i] && strcmp(args[i], "-c") == 0) {
+		count = true;
+		++i;
+	}
+	if (args[i] && args[i + 1]) {
+		sink_puts(&stdout_sink, "Usage: uniq [-c] [file]\n");
+		return;
+	}
+
+	int fd = args[i] ? open(args[i], O_RDONLY | O_CLOEXEC) : STDIN_FILENO;
+	if (fd < 0) {
+		fprintf(stderr, "Error uniq: %s: %s\n", args[i], strerror(errno));
+		return;
+	}
+
+	struct text_buffer data = {NULL, 0, 0};
+	struct text_buffer last = {NULL, 0, 0};
+	unsigned long repeats = 0;
+	size_t start = 0;
+	bool end_of_file = false, failed = false;
+
+	while (true) {
+		char* newline = start < data.length ? memchr(data.data + start, '\n', data.length - start) : NULL;
+
+		if (newline == NULL && !end_of_file) {
+			memmove(data.data, data.data + start, data.length - start);
+			data.length -= start;
+			start = 0;
+			buffer_reserve(&data, SORT_READ_SIZE + 1);
+			ssize_t done = read(fd, data.data + data.length, SORT_READ_SIZE);
+			if (done < 0 && errno == EINTR)
+				continue;
+			if (done < 0) {
+				perror("Error uniq");
+				failed = true;
+				break;
+			}
+			if (done == 0) {
+				end_of_file = true;
+				// a last line without a newline
+				if (data.length > 0)
+					buffer_append(&data, "\n", 1);
+			}
+			data.length += done;
+			continue;
+		}
+		if (newline == NULL)
+			break;
+
+		char* line = data.data + start;
+		size_t length = newline - line;
+		start += length + 1;
+
+		if (repeats > 0 && length == last.length && memcmp(line, last.data, length) == 0) {
+			++repeats;
+			continue;
+		}
+
+		// a new line ends the group before it
+		if (repeats > 0) {
+			if (count)
+				sink_printf(&stdout_sink, "%7lu ", repeats);
+			struct iovec iov[2] = {{last.data, last.length}, {"\n", 1}};
+			sink_writev(&stdout_sink, iov, 2);
+		}
+		last.length = 0;
+		buffer_append(&last, line, length);
+		repeats = 1;
+	}
+
+	if (repeats > 0 && !failed) {
+		if (count)
+			sink_printf(&stdout_sink, "%7lu ", repeats);
+		struct iovec iov[2] = {{last.data, last.length}, {"\n", 1}};
+		sink_writev(&stdout_sink, iov, 2);
+	}
+
+	if (fd != STDIN_FILENO)
+		close(fd);
+	free(data.data);
+	free(last.data);
+
+	if (!failed)
+		exit_status = 0;
+}
+
+// ----------------------------- WC ------------------------------
+
+// wc counts mapped files in place, and streams anything else (standard
+// input, pipes); a big file is cut in chunks counted by the work pool,
+// each chunk starting in a word if the byte before it is not a space
+struct wc_counts {
+	size_t lines, words, bytes;
+};
+
+struct wc_task {
+	const char* data;
+	size_t length;
+	struct text_counts counts;
+};
+
+void wc_run_task(void* arg) {
+	struct wc_task* task = arg;
+	count_text(task->data, task->length, &task->counts);
+}
+
+void wc_mapped(const char* data, size_t length, int no_workers, struct wc_counts* counts) {
+	struct text_counts total = {0, 0, false};
+	int no_tasks = (length + WC_CHUNK_SIZE - 1) / WC_CHUNK_SIZE;
+
+	if (no_workers <= 1 || length < WC_PARALLEL_MIN)
+		count_text(data, length, &total);
+	else {
+		struct wc_task* tasks = calloc(no_tasks, sizeof(*tasks));
+		struct work_pool* pool = pool_create(no_workers < no_tasks ? no_workers : no_tasks);
+
+		for (int i = 0; i < no_tasks; ++i) {
+			size_t start = (size_t)i * WC_CHUNK_SIZE;
+			tasks[i].data = data + start;
+			tasks[i].length = length - start < WC_CHUNK_SIZE ? length - start : WC_CHUNK_SIZE;
+			if (start > 0) {
+				char c = data[start - 1];
+				tasks[i].counts.in_word = !(c == ' ' || (unsigned char)(c - '\t') <= '\r' - '\t');
+			}
+			pool_submit(pool, wc_run_task, &tasks[i]);
+		}
+		pool_wait(pool);
+		pool_destroy(pool);
+
+		for (int i = 0; i < no_tasks; ++i) {
+			total.lines += tasks[i].counts.lines;
+			total.words += tasks[i].counts.words;
+		}
+		free(tasks);
+	}
+
+	counts->lines = total.lines;
+	counts->words = total.words;
+	counts->bytes = length;
+}
+
+// the counts of one file; only_bytes skips reading a regular file
+int wc_fd(int fd, bool only_bytes, int no_workers, struct wc_counts* counts) {
+	struct stat st;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		if (only_bytes) {
+			counts->lines = counts->words = 0;
+			counts->bytes = st.st_size;
+			return 0;
+		}
+		// the pages are mapped in one go, faulting them in one at a
+		// time costs more than counting them
+		char* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+		if (data != MAP_FAILED) {
+			wc_mapped(data, st.st_size, no_workers, counts);
+			munmap(data, st.st_size);
+			return 0;
+		}
+	}
+
+	char* buffer = malloc(WC_BUFFER_SIZE);
+	struct text_counts total = {0, 0, false};
+	size_t bytes = 0;
+	int result = 0;
+
+	while (true) {
+		ssize_t done = read(fd, buffer, WC_BUFFER_SIZE);
+		if (done < 0 && errno == EINTR)
+			continue;
+		if (done <= 0) {
+			result = done;
+			break;
+		}
+		if (!only_bytes)
+			count_text(buffer, done, &total);
+		bytes += done;
+	}
+
+	free(buffer);
+	counts->lines = total.lines;
+	counts->words = total.words;
+	counts->bytes = bytes;
+	return result;
+}
+
+void wc_print(struct wc_counts* counts, bool lines, bool words, bool bytes, const char* name) {
+	const char* separator = "";
+	if (lines) {
+		sink_printf(&stdout_sink, "%7zu", counts->lines);
+		separator = " ";
+	}
+	if (words) {
+		sink_printf(&stdout_sink, "%s%7zu", separator, counts->words);
+		separator = " ";
+	}
+	if (bytes)
+		sink_printf(&stdout_sink, "%s%7zu", separator, counts->bytes);
+	if (name)
+		sink_printf(&stdout_sink, " %s", name);
+	sink_puts(&stdout_sink, "\n");
+}
+
+// wc [-lwc] [file...]: lines, words and bytes, all three by default
+void funct_wc(char** args) {
+	exit_status = 1;
+
+	bool lines = false, words = false, bytes = false;
+	int i = 0;
+	for (; args[i] && args[i][0] == '-' && args[i][1] != '\0'; ++i) {
+		for (char* flag = args[i] + 1; *flag; ++flag) {
+			if (*flag == 'l')
+				lines = true;
+			else if (*flag == 'w')
+				words = true;
+			else if (*flag == 'c')
+				bytes = true;
+			else {
+				sink_puts(&stdout_sink, "Usage: wc [-lwc] [file...]\n");
+				return;
+			}
+		}
+	}
+	if (!lines && !words && !bytes)
+		lines = words = bytes = true;
+
+	int no_workers = no_cpus();
+	struct wc_counts counts, total = {0, 0, 0};
+	int no_files = 0;
+	bool failed = false;
+
+	bool from_stdin = args[i] == NULL;
+	for (; from_stdin || args[i]; ++i) {
+		bool is_stdin = from_stdin || strcmp(args[i], "-") == 0;
+		int fd = is_stdin ? STDIN_FILENO : open(args[i], O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			fprintf(stderr, "Error wc: %s: %s\n", args[i], strerror(errno));
+			failed = true;
+			continue;
+		}
+
+		if (wc_fd(fd, bytes && !lines && !words, no_workers, &counts) < 0) {
+			fprintf(stderr, "Error wc: %s: %s\n", is_stdin ? "-" : args[i], strerror(errno));
+			failed = true;
+		}
+		else {
+			wc_print(&counts, lines, words, bytes, from_stdin ? NULL : args[i]);
+			total.lines += counts.lines;
+			total.words += counts.words;
+			total.bytes += counts.bytes;
+			++no_files;
+		}
+
+		if (!is_stdin)
+			close(fd);
+		if (from_stdin)
+			break;
+	}
+
+	if (no_files > 1)
+		wc_print(&total, lines, words, bytes, "total");
+
+	if (!failed)
+		exit_status = 0;
+}
+
+// -------------------------- HEAD / TAIL ---------------------------
+
+// head copies blocks until it has the lines or bytes it wants, and
+// gives back what it read past them when its input can seek
+// tail reads a regular file backwards from its end in blocks, so it
+// only reads about what it prints; other input is kept in a buffer
+// trimmed to the tail as it comes
+// tail -f then waits on inotify for the files to change, and every
+// TAIL_RECHECK_MS checks whether a path now names another file (a
+// rotated log), which it then reopens and prints from the start
+extern volatile sig_atomic_t prompt_interrupted;
+
+struct count_options {
+	bool bytes; // -c, otherwise lines (-n)
+	long long count;
+	bool follow;
+};
+
+// [-n count] [-c count] (and -f for tail) before the files
+// returns the index of the first file, or -1 if the options are wrong
+int parse_count_options(char** args, struct count_options* options, bool tail) {
+	*options = (struct count_options){false, 10, false};
+	int i = 0;
+
+	for (; args[i] && args[i][0] == '-' && args[i][1] != '\0'; ++i) {
+		if (strcmp(args[i], "--") == 0)
+			return i + 1;
+		if (tail && strcmp(args[i], "-f") == 0) {
+			options->follow = true;
+			continue;
+		}
+		if ((strcmp(args[i], "-n") != 0 && strcmp(args[i], "-c") != 0) || args[i + 1] == NULL)
+			return -1;
+
+		char* end;
+		errno = 0;
+		options->bytes = args[i][1] == 'c';
+		options->count = strtoll(args[++i], &end, 10);
+		if (errno || end == args[i] || *end != '\0' || options->count < 0)
+			return -1;
+	}
+	return i;
+}
+
+// ==> name <== before every file when there are several
+void print_file_header(const char* name, bool* first) {
+	sink_printf(&stdout_sink, "%s==> %s <==\n", *first ? "" : "\n", name);
+	*first = false;
+}
+
+int head_fd(int fd, struct count_options* options, char* buffer) {
+	long long left = options->count;
+
+	while (left > 0) {
+		size_t wanted = CAT_BUFFER_SIZE;
+		if (options->bytes && (unsigned long long)left < wanted)
+			wanted = left;
+		ssize_t done = read(fd, buffer, wanted);
+		if (done < 0 && errno == EINTR)
+			continue;
+		if (done <= 0)
+			return done;
+
+		size_t used = done;
+		long long lines = options->bytes ? 0 : (long long)count_newlines(buffer, done);
+		if (options->bytes)
+			left -= done;
+		else if (lines < left)
+			left -= lines;
+		else {
+			// the block holds the last line wanted, it ends at that newline
+			const char* end = buffer;
+			for (; left > 0; --left)
+				end = (const char*)memchr(end, '\n', buffer + done - end) + 1;
+			used = end - buffer;
+			// the rest is left to whoever reads the input next
+			if ((size_t)done > used)
+				lseek(fd, (off_t)used - done, SEEK_CUR);
+		}
+
+		if (sink_write(&stdout_sink, buffer, used) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+// head [-n lines | -c bytes] [file...]: the first 10 lines by default
+void funct_head(char** args) {
+	exit_status = 1;
+
+	struct count_options options;
+	int i = parse_count_options(args, &options, false);
+	if (i < 0) {
+		sink_puts(&stdout_sink, "Usage: head [-n lines | -c bytes] [file...]\n");
+		return;
+	}
+
+	char* buffer = malloc(CAT_BUFFER_SIZE);
+	bool from_stdin = args[i] == NULL, headers = args[i] && args[i + 1], first = true;
+	bool failed = false;
+
+	for (; from_stdin || args[i]; ++i) {
+		bool is_stdin = from_stdin || strcmp(args[i], "-") == 0;
+		int fd = is_stdin ? STDIN_FILENO : open(args[i], O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			fprintf(stderr, "Error head: %s: %s\n", args[i], strerror(errno));
+			failed = true;
+			continue;
+		}
+
+		if (headers)
+			print_file_header(args[i], &first);
+		if (head_fd(fd, &options, buffer) < 0) {
+			perror("Error head");
+			failed = true;
+		}
+
+		if (!is_stdin)
+			close(fd);
+		if (from_stdin)
+			break;
+	}
+
+	free(buffer);
+	if (!failed)
+		exit_status = 0;
+}
+
+// where the last *lines lines of [block, block + length) start
+// false, with *lines lowered by the newlines in the block, when they
+// start before it
+bool tail_scan_back(const char* block, size_t length, long long* lines, size_t* start) {
+	long long count = count_newlines(block, length);
+	if (count < *lines) {
+		*lines -= count;
+		return false;
+	}
+
+	const char* end = block + length;
+	for (long long n = *lines; n > 0; --n)
+		end = memrchr(block, '\n', end - block);
+	*start = end + 1 - block;
+	return true;
+}
+
+// the offset the tail of a regular file of size bytes starts at
+off_t tail_start(int fd, struct count_options* options, off_t size, char* buffer) {
+	if (options->bytes)
+		return options->count < size ? size - options->count : 0;
+	if (options->count == 0)
+		return size;
+
+	long long lines = options->count;
+	off_t end = size;
+	bool last_block = true;
+
+	while (end > 0) {
+		off_t block_start = end > CAT_BUFFER_SIZE ? end - CAT_BUFFER_SIZE : 0;
+		ssize_t done = pread(fd, buffer, end - block_start, block_start);
+		if (done < 0 && errno == EINTR)
+			continue;
+		if (done <= 0)
+			return done < 0 ? -1 : block_start;
+
+		// the newline ending the file does not start a line
+		size_t length = done;
+		if (last_block && buffer[length - 1] == '\n')
+			--length;
+		last_block = false;
+
+		size_t start;
+		if (tail_scan_back(buffer, length, &lines, &start))
+			return block_start + start;
+		end = block_start;
+	}
+	return 0;
+}
+
+// the tail of a pipe or a terminal, kept in memory as it comes
+int tail_stream(int fd, struct count_options* options) {
+	struct text_buffer data = {NULL, 0, 0};
+	int result = 0;
+
+	while (true) {
+		buffer_reserve(&data, CAT_BUFFER_SIZE);
+		ssize_t done = read(fd, data.data + data.length, CAT_BUFFER_SIZE);
+		if (done < 0 && errno == EINTR)
+			continue;
+		if (done <= 0) {
+			result = done;
+			break;
+		}
+		data.length += done;
+
+		// once there is plenty more than needed, drop what is before the tail
+		if (data.length < 4 * CAT_BUFFER_SIZE)
+			continue;
+		size_t start = 0;
+		long long lines = options->count;
+		if (options->bytes)
+			start = (unsigned long long)options->count < data.length ? data.length - options->count : 0;
+		else if (lines == 0)
+			start = data.length;
+		else if (!tail_scan_back(data.data, data.length - (data.data[data.length - 1] == '\n'), &lines, &start))
+			start = 0;
+		if (start < data.length / 2)
+			continue; // mostly tail already, let it grow
+		memmove(data.data, data.data + start, data.length - start);
+		data.length -= start;
+	}
+
+	if (result == 0) {
+		size_t start = 0;
+		long long lines = options->count;
+		if (options->bytes)
+			start = (unsigned long long)options->count < data.length ? data.length - options->count : 0;
+		else if (lines == 0)
+			start = data.length;
+		else if (data.length > 0 && !tail_scan_back(data.data, data.length - (data.data[data.length - 1] == '\n'), &lines, &start))
+			start = 0;
+		result = sink_write(&stdout_sink, data.data + start, data.length - start);
+	}
+	free(data.data);
+	return result;
+}
+
+// a file followed by tail -f
+struct tail_file {
+	char* name;
+	int fd, watch;
+	dev_t device;
+	ino_t inode;
+	off_t offset; // what is printed so far
+};
+
+// prints what was added to the file since the last time
+int tail_copy_new(struct tail_file* file, bool headers, struct tail_file** last_printed, char* buffer) {
+	struct stat st;
+	if (fstat(file->fd, &st) < 0)
+		return -1;
+
+	// truncated in place, start over
+	if (st.st_size < file->offset) {
+		fprintf(stderr, "tail: %s: file truncated\n", file->name);
+		file->offset = 0;
+	}
+	if (st.st_size == file->offset)
+		return 0;
+
+	if (headers && *last_printed != file) {
+		bool first = false;
+		print_file_header(file->name, &first);
+	}
+	*last_printed = file;
+
+	sink_flush(&stdout_sink);
+	lseek(file->fd, file->offset, SEEK_SET);
+	int result = cat_fd(file->fd, NULL, buffer);
+	off_t offset = lseek(file->fd, 0, SEEK_CUR);
+	if (offset >= 0)
+		file->offset = offset;
+	if (result == 0)
+		result = sink_flush(&stdout_sink);
+	return result;
+}
+
+// a path that names another file than the one open is reopened
+void tail_check_rotation(struct tail_file* file, int notify) {
+	struct stat st;
+	if (stat(file->name, &st) < 0 || (st.st_dev == file->device && st.st_ino == file->inode))
+		return;
+
+	int fd = open(file->name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	fprintf(stderr, "tail: %s: file replaced, following the new file\n", file->name);
+
+	if (file->watch >= 0)
+		inotify_rm_watch(notify, file->watch);
+	close(file->fd);
+	file->fd = fd;
+	file->device = st.st_dev;
+	file->inode = st.st_ino;
+	file->offset = 0;
+	file->watch = notify >= 0 ? inotify_add_watch(notify, file->name, TAIL_WATCH_EVENTS) : -1;
+}
+
+// waits for the files to change until interrupted
+void tail_follow(struct tail_file* files, int no_files, bool headers, struct tail_file* last_printed, char* buffer) {
+	int notify = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+	for (int i = 0; i < no_files; ++i)
+		files[i].watch = notify >= 0 ? inotify_add_watch(notify, files[i].name, TAIL_WATCH_EVENTS) : -1;
+
+	char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	prompt_interrupted = 0;
+
+	while (!prompt_interrupted) {
+		// without inotify this is just the recheck interval
+		struct pollfd wait = {notify, POLLIN, 0};
+		int ready = poll(&wait, notify >= 0, TAIL_RECHECK_MS);
+		if (ready < 0 && errno != EINTR) {
+			perror("Error tail");
+			break;
+		}
+		// the events only say when to look, every file is checked
+		if (ready > 0)
+			while (read(notify, events, sizeof(events)) > 0)
+				;
+
+		for (int i = 0; i < no_files; ++i) {
+			tail_check_rotation(&files[i], notify);
+			if (tail_copy_new(&files[i], headers, &last_printed, buffer) < 0) {
+				perror("Error tail");
+				prompt_interrupted = 1;
+			}
+		}
+	}
+
+	prompt_interrupted = 0;
+	if (notify >= 0)
+		close(notify);
+}
+
+// tail [-f] [-n lines | -c bytes] [file...]: the last 10 lines by default
+void funct_tail(char** args) {
+	exit_status = 1;
+
+	struct count_options options;
+	int i = parse_count_options(args, &options, true);
+	if (i < 0) {
+		sink_puts(&stdout_sink, "Usage: tail [-f] [-n lines | -c bytes] [file...]\n");
+		return;
+	}
+
+	char* buffer;
+	if (posix_memalign((void**)&buffer, 4096, CAT_BUFFER_SIZE) != 0) {
+		perror("Error tail");
+		return;
+	}
+
+	bool from_stdin = args[i] == NULL, headers = args[i] && args[i + 1], first = true;
+	bool failed = false;
+	struct tail_file* followed = NULL;
+	int no_followed = 0;
+
+	for (; from_stdin || args[i]; ++i) {
+		bool is_stdin = from_stdin || strcmp(args[i], "-") == 0;
+		int fd = is_stdin ? STDIN_FILENO : open(args[i], O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			fprintf(stderr, "Error tail: %s: %s\n", args[i], strerror(errno));
+			failed = true;
+			continue;
+		}
+		if (headers)
+			print_file_header(args[i], &first);
+
+		struct stat st;
+		int result;
+		if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+			off_t start = tail_start(fd, &options, st.st_size, buffer);
+			sink_flush(&stdout_sink);
+			result = start < 0 || lseek(fd, start, SEEK_SET) < 0 ? -1 : cat_fd(fd, NULL, buffer);
+		}
+		else
+			result = tail_stream(fd, &options);
+		if (result < 0) {
+			perror("Error tail");
+			failed = true;
+		}
+
+		// only files can be followed, a pipe ends
+		if (options.follow && !is_stdin && S_ISREG(st.st_mode) && result == 0) {
+			followed = realloc(followed, (no_followed + 1) * sizeof(*followed));
+			followed[no_followed++] = (struct tail_file){args[i], fd, -1, st.st_dev, st.st_ino, lseek(fd, 0, SEEK_CUR)};
+		}
+		else if (!is_stdin)
+			close(fd);
+		if (from_stdin)
+			break;
+	}
+
+	if (no_followed > 0) {
+		sink_flush(&stdout_sink);
+		tail_follow(followed, no_followed, headers, &followed[no_followed - 1], buffer);
+		for (int f = 0; f < no_followed; ++f)
+			close(followed[f].fd);
+	}
+
+	free(followed);
+	free(buffer);
+	if (!failed)
+		exit_status = 0;
+}
+
+// ------------------------ PATH CACHE ---------------------------
+
+// command name -> absolute path of the program found in $PATH
+// entries are added on the first lookup of a name and trusted while
+// $PATH and the mtimes of its directories stay the same (a program
+// added, removed or renamed changes the mtime of its directory); the
+// directories are checked at most once every PATH_CHECK_INTERVAL s,
+// so a program that fails to start is dropped and searched again;
+// programs found through relative directories are never cached, they
+// depend on the current directory
+struct path_entry {
+	struct path_entry* next;
+	unsigned hash;
+	int hits;
+	char* path;
+	char name[];
+};
+
+struct path_cache {
+	struct path_entry** buckets;
+	int no_buckets, no_entries;
+	char* path_value; // $PATH the directories were split from
+	char** dirs;
+	struct timespec* mtimes;
+	int no_dirs;
+	time_t checked;
+	char* uncached; // the last path found in a relative directory
+};
+
+struct path_cache path_cache;
+
+unsigned hash_string(const char* str) {
+	unsigned hash = 2166136261u;
+	for (; *str; ++str)
+		hash = (hash ^ (unsigned char)*str) * 16777619u;
+	return hash;
+}
+
+void path_cache_clear(struct path_cache* cache) {
+	for (int i = 0; i < cache->no_buckets; ++i) {
+		while (cache->buckets[i]) {
+			struct path_entry* entry = cache->buckets[i];
+			cache->buckets[i] = entry->next;
+			free(entry->path);
+			free(entry);
+		}
+	}
+	cache->no_entries = 0;
+}
+
+// split $PATH and remember the mtimes of its directories
+void path_cache_load_dirs(struct path_cache* cache, const char* path_value) {
+	free(cache->path_value);
+	for (int i = 0; i < cache->no_dirs; ++i)
+		free(cache->dirs[i]);
+	free(cache->dirs);
+	free(cache->mtimes);
+
+	cache->path_value = strdup(path_value);
+	cache->no_dirs = 1;
+	for (const char* c = path_value; *c; ++c)
+		cache->no_dirs += (*c == ':');
+	cache->dirs = malloc(cache->no_dirs * sizeof(*cache->dirs));
+	cache->mtimes = calloc(cache->no_dirs, sizeof(*cache->mtimes));
+
+	const char* start = path_value;
+	for (int i = 0; i < cache->no_dirs; ++i) {
+		const char* end = strchrnul(start, ':');
+		// an empty entry means the current directory
+		cache->dirs[i] = end == start ? strdup(".") : strndup(start, end - start);
+		start = *end ? end + 1 : end;
+
+		struct stat info;
+		if (stat(cache->dirs[i], &info) == 0)
+			cache->mtimes[i] = info.st_mtim;
+	}
+}
+
+// drop the entries if $PATH or one of its directories changed
+void path_cache_validate(struct path_cache* cache) {
+	const char* path_value = getenv("PATH");
+	if (path_value == NULL)
+		path_value = "/usr/local/bin:/usr/bin:/bin";
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+
+	if (cache->path_value == NULL || strcmp(cache->path_value, path_value) != 0) {
+		path_cache_clear(cache);
+		path_cache_load_dirs(cache, path_value);
+		cache->checked = now.tv_sec;
+		return;
+	}
+
+	if (now.tv_sec - cache->checked < PATH_CHECK_INTERVAL)
+		return;
+	cache->checked = now.tv_sec;
+
+	for (int i = 0; i < cache->no_dirs; ++i) {
+		struct stat info;
+		struct timespec mtime = {0, 0};
+		if (stat(cache->dirs[i], &info) == 0)
+			mtime = info.st_mtim;
+
+		if (mtime.tv_sec != cache->mtimes[i].tv_sec || mtime.tv_nsec != cache->mtimes[i].tv_nsec) {
+			path_cache_clear(cache);
+			path_cache_load_dirs(cache, path_value);
+			return;
+		}
+	}
+}
+
+void path_cache_insert(struct path_cache* cache, const char* name, unsigned hash, char* path) {
+	if (cache->no_entries >= cache->no_buckets) {
+		// grow to keep the chains short
+		int no_buckets = cache->no_buckets ? 2 * cache->no_buckets : 64;
+		struct path_entry** buckets = calloc(no_buckets, sizeof(*buckets));
+		for (int i = 0; i < cache->no_buckets; ++i) {
+			while (cache->buckets[i]) {
+				struct path_entry* entry = cache->buckets[i];
+				cache->buckets[i] = entry->next;
+				entry->next = buckets[entry->hash & (no_buckets - 1)];
+				buckets[entry->hash & (no_buckets - 1)] = entry;
+			}
+		}
+		free(cache->buckets);
+		cache->buckets = buckets;
+		cache->no_buckets = no_buckets;
+	}
+
+	struct path_entry* entry = malloc(sizeof(*entry) + strlen(name) + 1);
+	strcpy(entry->name, name);
+	entry->hash = hash;
+	entry->hits = 0;
+	entry->path = path;
+	entry->next = cache->buckets[hash & (cache->no_buckets - 1)];
+	cache->buckets[hash & (cache->no_buckets - 1)] = entry;
+	++cache->no_entries;
+}
+
+// returns the absolute path of the program name in $PATH, or NULL
+// the string belongs to the cache
+char* path_lookup(char* name) {
+	struct path_cache* cache = &path_cache;
+	path_cache_validate(cache);
+
+	unsigned hash = hash_string(name);
+	if (cache->no_buckets > 0) {
+		for (struct path_entry* entry = cache->buckets[hash & (cache->no_buckets - 1)]; entry; entry = entry->next) {
+			if (entry->hash == hash && strcmp(entry->name, name) == 0) {
+				++entry->hits;
+				return entry->path;
+			}
+		}
+	}
+
+	char* path = malloc(MAX_PATH_LENGTH);
+	for (int i = 0; i < cache->no_dirs; ++i) {
+		struct stat info;
+		snprintf(path, MAX_PATH_LENGTH, "%s/%s", cache->dirs[i], name);
+
+		if (stat(path, &info) == 0 && S_ISREG(info.st_mode) && access(path, X_OK) == 0) {
+			if (cache->dirs[i][0] == '/')
+				path_cache_insert(cache, name, hash, path);
+			else {
+				free(cache->uncached);
+				cache->uncached = path;
+			}
+			return path;
+		}
+	}
+
+	free(path);
+	return NULL;
+}
+
+// drops the cached path of name, if there is one
+void path_forget(const char* name) {
+	struct path_cache* cache = &path_cache;
+	if (cache->no_buckets == 0)
+		return;
+
+	unsigned hash = hash_string(name);
+	for (struct path_entry** entry = &cache->buckets[hash & (cache->no_buckets - 1)]; *entry; entry = &(*entry)->next) {
+		if ((*entry)->hash == hash && strcmp((*entry)->name, name) == 0) {
+			struct path_entry* found = *entry;
+			*entry = found->next;
+			free(found->path);
+			free(found);
+			--cache->no_entries;
+			return;
+		}
+	}
+}
+
+// hash: list the cached programs
+// hash -r: forget them
+// hash name...: look the names up and cache them
+void funct_hash(char** args) {
+	exit_status = 1;
+
+	if (args[0] == NULL) {
+		if (path_cache.no_entries == 0) {
+			sink_printf(&stdout_sink, "hash: hash table empty\n");
+			exit_status = 0;
+			return;
+		}
+
+		sink_printf(&stdout_sink, "hits\tcommand\n");
+		for (int i = 0; i < path_cache.no_buckets; ++i)
+			for (struct path_entry* entry = path_cache.buckets[i]; entry; entry = entry->next)
+				sink_printf(&stdout_sink, "%4d\t%s\n", entry->hits, entry->path);
+		exit_status = 0;
+		return;
+	}
+
+	if (strcmp(args[0], "-r") == 0) {
+		if (args[1] != NULL) {
+			sink_printf(&stdout_sink, "Invalid command\n");
+			return;
+		}
+		path_cache_clear(&path_cache);
+		exit_status = 0;
+		return;
+	}
+
+	bool failed = false;
+	for (int i = 0; args[i] != NULL; ++i) {
+		if (strchr(args[i], '/') != NULL || path_lookup(args[i]) == NULL) {
+			fprintf(stderr, "Error hash: %s: not found\n", args[i]);
+			failed = true;
+		}
+	}
+
+	if (!failed)
+		exit_status = 0;
+}
+
+// set when ctrl-c is pressed at the prompt
+volatile sig_atomic_t prompt_interrupted = 0;
+
+struct job;
+extern struct job* volatile foreground_job;
+void interrupt_job(struct job* job);
+
+void sig_handler(int sig_num)
+{
+    // Reset handler to catch SIGINT next time
+    signal(SIGINT, sig_handler);
+
+	// without a terminal the interrupt reaches only the shell, pass it on
+	if (foreground_job != NULL)
+		interrupt_job(foreground_job);
+    else if (pid != -1)
+		kill(pid, SIGINT);
+	else
+		prompt_interrupted = 1;
+}
+
+
+
+// open what a redirection reads or writes
+// returns the fd to dup2 onto *target, or -1 after printing an error;
+// the fd is the caller's to close unless it is 0, 1 or 2
+int redirect_source(struct redirect* redirect, int* target) {
+	int fd = -1;
+
+	switch (redirect->type) {
+	case REDIRECT_ERR_TO_OUT:
+		*target = STDERR_FILENO;
+		return STDOUT_FILENO;
+	case REDIRECT_OUT_TO_ERR:
+		*target = STDOUT_FILENO;
+		return STDERR_FILENO;
+	case REDIRECT_HERE_STRING:
+		// the string and a newline, in a file that lives only in memory
+		*target = STDIN_FILENO;
+		fd = memfd_create("here-string", MFD_CLOEXEC);
+		if (fd < 0 || write_all(fd, redirect->file, strlen(redirect->file)) < 0 || write_all(fd, "\n", 1) < 0) {
+			perror("Error here-string");
+			if (fd >= 0)
+				close(fd);
+			return -1;
+		}
+		lseek(fd, 0, SEEK_SET);
+		return fd;
+	case REDIRECT_IN:
+		*target = STDIN_FILENO;
+		fd = open(redirect->file, O_RDONLY | O_CLOEXEC);
+		break;
+	default: {
+		bool append = redirect->type == REDIRECT_APPEND || redirect->type == REDIRECT_ERR_APPEND || redirect->type == REDIRECT_ALL_APPEND;
+		bool err = redirect->type == REDIRECT_ERR || redirect->type == REDIRECT_ERR_APPEND;
+		*target = err ? STDERR_FILENO : STDOUT_FILENO;
+		fd = open(redirect->file, O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC), 0644);
+	}
+	}
+
+	if (fd < 0)
+		fprintf(stderr, "Error redirect: %s: %s\n", redirect->file, strerror(errno));
+	return fd;
+}
+
+// &> and &>> write both stdout and stderr to the file
+bool redirect_both(struct redirect* redirect) {
+	return redirect->type == REDIRECT_ALL || redirect->type == REDIRECT_ALL_APPEND;
+}
+
+void restore_fds(int saved[3]) {
+	flush_output();
+
+	for (int fd = 0; fd < 3; ++fd) {
+		if (saved[fd] == -2)
+			close(fd);
+		else if (saved[fd] >= 0) {
+			dup2(saved[fd], fd);
+			close(saved[fd]);
+		}
+		saved[fd] = -1;
+	}
+}
+
+// apply the redirections of a command to the fds of this process, left
+// to right; the original 0, 1 and 2 are kept in saved for restore_fds
+// returns false (with everything restored) if a file cannot be opened
+bool redirect_fds(struct redirect* redirects, int no_redirects, int saved[3]) {
+	saved[0] = saved[1] = saved[2] = -1;
+	if (no_redirects == 0)
+		return true;
+
+	// what is buffered so far belongs to the old fds
+	flush_output();
+
+	uint64_t start = trace_start();
+	for (int i = 0; i < no_redirects; ++i) {
+		int target;
+		int source = redirect_source(&redirects[i], &target);
+		if (source < 0) {
+			restore_fds(saved);
+			return false;
+		}
+
+		for (int fd = target; fd <= (redirect_both(&redirects[i]) ? STDERR_FILENO : target); ++fd) {
+			// a closed fd is saved as -2, restore closes it again
+			if (saved[fd] == -1) {
+				saved[fd] = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+				if (saved[fd] < 0)
+					saved[fd] = -2;
+			}
+			dup2(source, fd);
+		}
+
+		if (source > STDERR_FILENO)
+			close(source);
+	}
+
+	trace_event("redirect", redirects[0].file, start);
+	return true;
+}
+
+// returns the file to run for a program name, or NULL if there is none
+// a path with a '/' is used as it is, relative to the current directory
+char* resolve_program(char* name) {
+	if (strchr(name, '/'))
+		return name;
+	return path_lookup(name);
+}
+
+// start a program without copying the shell (posix_spawn uses vfork)
+// fd_in and fd_out, when not -1, become its stdin and stdout, and then
+// the redirections are applied in the child as spawn file actions
+// pgid is the process group to join: 0 for a new one, -1 to stay in
+// the group of the shell
+// terminal, when not -1, is handed to that group in the child before
+// the program runs, so it can read the terminal from its first
+// instruction (the shell does it too, where that is not supported)
+// argv[0] stays the name the program was called by
+// returns the pid, or -1 if it could not be started
+pid_t spawn_program(char** argv, int fd_in, int fd_out, struct redirect* redirects, int no_redirects, pid_t pgid, int terminal) {
+	char* program_path = resolve_program(argv[0]);
+	if (program_path == NULL) {
+		sink_puts(&stdout_sink, "Invalid command\n");
+		return -1;
+	}
+
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	if (fd_in != -1)
+		posix_spawn_file_actions_adddup2(&actions, fd_in, STDIN_FILENO);
+	if (fd_out != -1)
+		posix_spawn_file_actions_adddup2(&actions, fd_out, STDOUT_FILENO);
+
+	// the files are opened here, so errors are reported before the
+	// child exists, and only dup2ed in the child
+	int* opened = malloc((no_redirects + 1) * sizeof(*opened));
+	int no_opened = 0;
+	for (int i = 0; i < no_redirects; ++i) {
+		int target;
+		int source = redirect_source(&redirects[i], &target);
+		if (source < 0) {
+			for (int j = 0; j < no_opened; ++j)
+				close(opened[j]);
+			free(opened);
+			posix_spawn_file_actions_destroy(&actions);
+			return -1;
+		}
+
+		posix_spawn_file_actions_adddup2(&actions, source, target);
+		if (redirect_both(&redirects[i]))
+			posix_spawn_file_actions_adddup2(&actions, source, STDERR_FILENO);
+		if (source > STDERR_FILENO)
+			opened[no_opened++] = source;
+	}
+
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 35)
+	// the child runs its file actions with every signal blocked, so
+	// tcsetpgrp from the new (background) group does not stop it
+	if (terminal != -1 && pgid != -1)
+		posix_spawn_file_actions_addtcsetpgrp_np(&actions, terminal);
+#endif
+
+	// the signals the shell catches or ignores are reset
+	posix_spawnattr_t attributes;
+	posix_spawnattr_init(&attributes);
+	sigset_t signals;
+	sigemptyset(&signals);
+	posix_spawnattr_setsigmask(&attributes, &signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTSTP);
+	sigaddset(&signals, SIGTTIN);
+	sigaddset(&signals, SIGTTOU);
+	sigaddset(&signals, SIGCHLD);
+	posix_spawnattr_setsigdefault(&attributes, &signals);
+	short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+	if (pgid != -1) {
+		posix_spawnattr_setpgroup(&attributes, pgid);
+		flags |= POSIX_SPAWN_SETPGROUP;
+	}
+	posix_spawnattr_setflags(&attributes, flags);
+
+	// output printed so far must not be overtaken by the child
+	flush_output();
+
+	// posix_spawn returns once the child has exec'd
+	pid_t child;
+	uint64_t start = trace_start();
+	int error = posix_spawn(&child, program_path, &actions, &attributes, argv, environ);
+	// a cached path may be stale (removed or no longer executable, and
+	// the directory checked too recently to notice): search $PATH again
+	if ((error == ENOENT || error == EACCES) && program_path != argv[0]) {
+		path_forget(argv[0]);
+		program_path = path_lookup(argv[0]);
+		if (program_path != NULL)
+			error = posix_spawn(&child, program_path, &actions, &attributes, argv, environ);
+	}
+	trace_event("spawn", argv[0], start);
+	if (error == 0 && terminal != -1 && pgid != -1)
+		tcsetpgrp(terminal, pgid ? pgid : child);
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attributes);
+
+	for (int i = 0; i < no_opened; ++i)
+		close(opened[i]);
+	free(opened);
+
+	if (error != 0) {
+		fprintf(stderr, "Error %s: %s\n", argv[0], strerror(error));
+		return -1;
+	}
+	return child;
+}
+
+// wait for a child and return its status the way a shell reports it:
+// the exit code, or 128 + the signal that killed it
+// the resources the child used are left in child_usage
+struct rusage child_usage;
+
+int wait_status(pid_t child) {
+	int status;
+	uint64_t start = trace_start();
+	while (wait4(child, &status, 0, &child_usage) < 0) {
+		if (errno != EINTR)
+			return 1;
+	}
+	trace_event("wait", NULL, start);
+
+	if (WIFEXITED(status))
+		return WEXITSTATUS(status);
+	if (WIFSIGNALED(status))
+		return 128 + WTERMSIG(status);
+	return 1;
+}
+
+// run a program and wait for it
+void exec_command(char** argv) {
+	pid = spawn_program(argv, -1, -1, NULL, 0, -1, -1);
+	if (pid == -1) {
+		exit_status = 127;
+		return;
+	}
+
+	exit_status = wait_status(pid);
+	//the process is dead 
+	pid = -1;
+}
+
+// ------------------------- PROFILING ---------------------------
+
+double timeval_seconds(struct timeval* end, struct timeval* start) {
+	return (end->tv_sec - start->tv_sec) + (end->tv_usec - start->tv_usec) / 1e6;
+}
+
+void find_command(char** argv, int argc);
+
+// time command [args]: run a builtin or a program and report on stderr
+// its wall, user and system time and its peak resident memory
+void funct_time(char** args) {
+	exit_status = 1;
+	int argc = 0;
+	while (args[argc])
+		++argc;
+
+	struct rusage self_before, self_after, children_before, children_after;
+	getrusage(RUSAGE_SELF, &self_before);
+	getrusage(RUSAGE_CHILDREN, &children_before);
+	uint64_t bytes_before = stdout_sink.bytes;
+	uint64_t start = now_ns();
+
+	// a builtin is measured in the shell, a program by wait4
+	long max_rss;
+	bool builtin = da_search(&command_table, args[0]) != -1;
+	if (builtin)
+		find_command(args, argc);
+	else {
+		memset(&child_usage, 0, sizeof(child_usage));
+		exec_command(args);
+	}
+
+	double wall = (now_ns() - start) / 1e9;
+	getrusage(RUSAGE_SELF, &self_after);
+	getrusage(RUSAGE_CHILDREN, &children_after);
+	max_rss = builtin ? self_after.ru_maxrss : child_usage.ru_maxrss;
+
+	double user = timeval_seconds(&self_after.ru_utime, &self_before.ru_utime)
+		+ timeval_seconds(&children_after.ru_utime, &children_before.ru_utime);
+	double sys = timeval_seconds(&self_after.ru_stime, &self_before.ru_stime)
+		+ timeval_seconds(&children_after.ru_stime, &children_before.ru_stime);
+
+	flush_output();
+	fprintf(stderr, "\nreal\t%.3fs\nuser\t%.3fs\nsys\t%.3fs\nmaxrss\t%ld KB\n", wall, user, sys, max_rss);
+	// what the builtin wrote on stdout, programs write it themselves
+	if (builtin)
+		fprintf(stderr, "output\t%llu bytes\n", (unsigned long long)(stdout_sink.bytes - bytes_before));
+}
+
+// stats: calls and run times of the builtins run by the shell
+// stats -r: start over
+void funct_stats(char** args) {
+	exit_status = 1;
+
+	if (args[0] != NULL) {
+		if (strcmp(args[0], "-r") != 0) {
+			fprintf(stderr, "Error stats: usage: stats [-r]\n");
+			return;
+		}
+		memset(command_stats, 0, no_command_stats * sizeof(*command_stats));
+		exit_status = 0;
+		return;
+	}
+
+	sink_printf(&stdout_sink, "%-12s %8s %12s %10s %10s %12s\n", "builtin", "calls", "total ms", "avg us", "max us", "bytes out");
+	for (int i = 0; i < no_command_stats; ++i) {
+		struct builtin_stats* stats = &command_stats[i];
+		if (stats->calls == 0)
+			continue;
+
+		sink_printf(&stdout_sink, "%-12s %8llu %12.3f %10.1f %10.1f %12llu\n", commands[i]->name, (unsigned long long)stats->calls,
+			stats->total_ns / 1e6, stats->total_ns / 1e3 / stats->calls, stats->max_ns / 1e3, (unsigned long long)stats->bytes);
+
+		uint64_t most = 0;
+		for (int b = 0; b < STATS_BUCKETS; ++b)
+			if (stats->buckets[b] > most)
+				most = stats->buckets[b];
+
+		for (int b = 0; b < STATS_BUCKETS; ++b) {
+			if (stats->buckets[b] == 0)
+				continue;
+			char range[32];
+			if (b == 0)
+				snprintf(range, sizeof(range), "< 1 us");
+			else if (b == STATS_BUCKETS - 1)
+				snprintf(range, sizeof(range), ">= %llu us", 1ull << (b - 1));
+			else
+				snprintf(range, sizeof(range), "%llu - %llu us", 1ull << (b - 1), 1ull << b);
+
+			char bar[41];
+			int width = (stats->buckets[b] * 40 + most - 1) / most;
+			memset(bar, '#', width);
+			bar[width] = '\0';
+			sink_printf(&stdout_sink, "  %18s %8llu %s\n", range, (unsigned long long)stats->buckets[b], bar);
+		}
+	}
 	exit_status = 0;
 }
 
-void funct_rm(char** args) {
+// trace: whether the stages are traced
+// trace on | off: start or stop tracing
+// trace dump file: write the traced stages as a chrome trace
+void funct_trace(char** args) {
 	exit_status = 1;
 
-	int fd;
-	fd = open(args[0], O_RDONLY);
-	if (fd < 0) {
-		perror("File does not exist");
+	if (args[0] == NULL) {
+		uint64_t head = __atomic_load_n(&trace_head, __ATOMIC_RELAXED);
+		sink_printf(&stdout_sink, "trace: %s, %llu events (%llu kept)\n", tracing ? "on" : "off",
+			(unsigned long long)head, (unsigned long long)(head < TRACE_RING_SIZE ? head : TRACE_RING_SIZE));
+	}
+	else if (strcmp(args[0], "on") == 0 && args[1] == NULL)
+		trace_enable(true);
+	else if (strcmp(args[0], "off") == 0 && args[1] == NULL)
+		trace_enable(false);
+	else if (strcmp(args[0], "dump") == 0 && args[1] != NULL) {
+		if (!trace_dump(args[1])) {
+			fprintf(stderr, "Error trace: %s: %s\n", args[1], strerror(errno));
+			return;
+		}
+	}
+	else {
+		fprintf(stderr, "Error trace: usage: trace [on | off | dump file]\n");
 		return;
 	}
-	close(fd);
+	exit_status = 0;
+}
+
+// shell -X traces from the start and dumps the trace when it exits
+void trace_dump_at_exit() {
+	const char* path = getenv("SHELL_TRACE_FILE");
+	if (path == NULL)
+		path = TRACE_FILE;
+	if (!trace_dump(path))
+		fprintf(stderr, "Error trace: %s: %s\n", path, strerror(errno));
+}
+
+// ---------------------------- JOBS -----------------------------
+
+// a job is a pipeline (or an && / || list run in the background) with
+// its processes in one process group, so it can be stopped, continued
+// and interrupted as a whole
+// children are reaped in the main loop: the SIGCHLD handler only
+// writes to a pipe that the prompt waits on next to stdin
+enum { JOB_RUNNING, JOB_STOPPED, JOB_DONE };
+
+struct job_process {
+	pid_t pid;
+	int state;
+	int status; // shell exit status once done
+};
+
+struct job {
+	int id;
+	pid_t pgid; // 0 until the first process starts, -1 without job control
+	struct job_process* processes;
+	int no_processes;
+	char* command; // text shown by jobs
+};
+
+struct job** jobs = NULL;
+int no_jobs = 0;
+
+// false in forked children: they stay in the group of their job
+bool job_control = true;
+// the terminal the shell controls, -1 if it does not run on one
+int shell_terminal = -1;
+pid_t shell_pgid;
+
+int child_pipe[2] = {-1, -1};
+struct job* volatile foreground_job = NULL;
+
+void child_handler(int sig_num) {
+	int saved_errno = errno;
+	char byte = 0;
+	write(child_pipe[1], &byte, 1);
+	errno = saved_errno;
+}
+
+struct job* job_new(char* command) {
+	struct job* job = calloc(1, sizeof(*job));
+	job->command = command;
+	job->pgid = job_control ? 0 : -1;
+	return job;
+}
+
+void job_free(struct job* job) {
+	free(job->processes);
+	free(job->command);
+	free(job);
+}
+
+void job_add_process(struct job* job, pid_t child, int status) {
+	job->processes = realloc(job->processes, (job->no_processes + 1) * sizeof(*job->processes));
+	struct job_process* process = &job->processes[job->no_processes++];
+	process->pid = child;
+	// a process that could not start is already done
+	process->state = child == -1 ? JOB_DONE : JOB_RUNNING;
+	process->status = status;
+
+	if (child != -1 && job->pgid == 0)
+		job->pgid = child;
+}
+
+int job_state(struct job* job) {
+	bool stopped = false;
+	for (int i = 0; i < job->no_processes; ++i) {
+		if (job->processes[i].state == JOB_RUNNING)
+			return JOB_RUNNING;
+		if (job->processes[i].state == JOB_STOPPED)
+			stopped = true;
+	}
+	return stopped ? JOB_STOPPED : JOB_DONE;
+}
+
+// the status of a job is the status of its last process
+int job_status(struct job* job) {
+	if (job->no_processes == 0)
+		return 0;
+	return job->processes[job->no_processes - 1].status;
+}
+
+void job_update(struct job_process* process, int status) {
+	if (WIFSTOPPED(status)) {
+		process->state = JOB_STOPPED;
+		process->status = 128 + WSTOPSIG(status);
+	}
+	else if (WIFCONTINUED(status))
+		process->state = JOB_RUNNING;
+	else {
+		process->state = JOB_DONE;
+		process->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+	}
+}
+
+// put a job in the table, it gets the next free number
+void job_insert(struct job* job) {
+	job->id = no_jobs ? jobs[no_jobs - 1]->id + 1 : 1;
+	jobs = realloc(jobs, (no_jobs + 1) * sizeof(*jobs));
+	jobs[no_jobs++] = job;
+}
+
+void job_remove(struct job* job) {
+	for (int i = 0; i < no_jobs; ++i) {
+		if (jobs[i] == job) {
+			memmove(jobs + i, jobs + i + 1, (no_jobs - i - 1) * sizeof(*jobs));
+			--no_jobs;
+			break;
+		}
+	}
+	job_free(job);
+}
+
+// collect the state changes of the jobs in the table without blocking
+void reap_jobs() {
+	char drain[64];
+	while (read(child_pipe[0], drain, sizeof(drain)) > 0) {}
+
+	for (int i = 0; i < no_jobs; ++i) {
+		for (int j = 0; j < jobs[i]->no_processes; ++j) {
+			struct job_process* process = &jobs[i]->processes[j];
+			int status;
+			if (process->state != JOB_DONE && waitpid(process->pid, &status, WNOHANG | WUNTRACED | WCONTINUED) > 0)
+				job_update(process, status);
+		}
+	}
+}
+
+void print_job(struct job* job, struct output_sink* out) {
+	static const char* state_names[] = {"Running", "Stopped", "Done"};
+	int state = job_state(job);
+	char current = job == jobs[no_jobs - 1] ? '+' : (no_jobs > 1 && job == jobs[no_jobs - 2] ? '-' : ' ');
+
+	char state_name[32];
+	if (state == JOB_DONE && job_status(job) != 0)
+		sprintf(state_name, "Exit %d", job_status(job));
+	else
+		strcpy(state_name, state_names[state]);
+
+	sink_printf(out, "[%d]%c  %-24s%s%s\n", job->id, current, state_name, job->command, state == JOB_RUNNING ? " &" : "");
+}
+
+// report the background jobs that finished and drop them
+// returns true if something was printed
+bool notify_jobs() {
+	bool printed = false;
+
+	for (int i = 0; i < no_jobs; ) {
+		if (job_state(jobs[i]) != JOB_DONE) {
+			++i;
+			continue;
+		}
+		print_job(jobs[i], &stderr_sink);
+		printed = true;
+		job_remove(jobs[i]);
+	}
+	sink_flush(&stderr_sink);
+
+	return printed;
+}
+
+bool any_job_done() {
+	for (int i = 0; i < no_jobs; ++i)
+		if (job_state(jobs[i]) == JOB_DONE)
+			return true;
+	return false;
+}
+
+// put a job started with & in the table
+void start_background_job(struct job* job) {
+	job_insert(job);
+
+	pid_t leader = job->pgid;
+	for (int i = 0; leader <= 0 && i < job->no_processes; ++i)
+		leader = job->processes[i].pid;
+	// scripts start jobs quietly
+	if (job_control)
+		fprintf(stderr, "[%d] %d\n", job->id, leader);
 
-	if (unlink(args[0])) {
-		perror("An error occured while deleting the file\n");
-		return;
-	}
-	
 	exit_status = 0;
-	return;
 }
 
-void funct_rmdir(char** args) {
-	exit_status = 1;
+// wait until the job is done, or stopped when it runs in the foreground
+// under job control (the terminal is given to it meanwhile)
+void wait_job(struct job* job, bool foreground) {
+	bool terminal = foreground && shell_terminal != -1 && job->pgid > 0;
+	if (terminal)
+		tcsetpgrp(shell_terminal, job->pgid);
+
+	if (foreground)
+		foreground_job = job;
+
+	uint64_t start = trace_start();
+	bool stopping = false;
+	for (int i = 0; i < job->no_processes; ++i) {
+		struct job_process* process = &job->processes[i];
+		int status;
+
+		while (process->state == JOB_RUNNING) {
+			if (waitpid(process->pid, &status, job->pgid > 0 ? WUNTRACED : 0) < 0) {
+				if (errno == EINTR)
+					continue;
+				process->state = JOB_DONE;
+				process->status = 1;
+				break;
+			}
+			job_update(process, status);
+		}
 
-	DIR* dir = opendir(args[0]);
-	if (dir) {
-		//it exists
-		closedir(dir);
-		rmdir(args[0]);
+		// one stopped process stops the whole job; in the foreground the
+		// others are waited for until they stop too, so the job is not
+		// taken for done while some of them still count as running
+		if (process->state == JOB_STOPPED && !stopping) {
+			if (!foreground)
+				break;
+			kill(-job->pgid, SIGTSTP);
+			stopping = true;
+		}
 	}
-	else if (ENONET == errno) {
-		perror("Directory does not exits\n");
+
+	foreground_job = NULL;
+	trace_event("wait", job->command, start);
+
+	if (terminal)
+		tcsetpgrp(shell_terminal, shell_pgid);
+}
+
+// wait for a job started in the foreground; a stopped job moves to the table
+void finish_foreground_job(struct job* job, bool in_table) {
+	wait_job(job, true);
+
+	if (job_state(job) == JOB_STOPPED) {
+		exit_status = 128 + SIGTSTP;
+		if (!in_table)
+			job_insert(job);
+		fprintf(stderr, "\n");
+		print_job(job, &stderr_sink);
+		sink_flush(&stderr_sink);
 		return;
 	}
-	else {
-		perror("An error occured\n");
-		return;
+
+	exit_status = job_status(job);
+	// the ^C echoed by the terminal is left on the line
+	if (exit_status == 128 + SIGINT)
+		sink_write(&stdout_sink, "\n", 1);
+	if (in_table)
+		job_remove(job);
+	else
+		job_free(job);
+}
+
+// %n, n or nothing (the current job)
+struct job* find_job(char* spec, char* name) {
+	if (spec == NULL) {
+		if (no_jobs == 0) {
+			fprintf(stderr, "Error %s: no current job\n", name);
+			return NULL;
+		}
+		return jobs[no_jobs - 1];
 	}
 
-	exit_status = 0;
+	int id = atoi(spec[0] == '%' ? spec + 1 : spec);
+	for (int i = 0; i < no_jobs; ++i)
+		if (jobs[i]->id == id)
+			return jobs[i];
+
+	fprintf(stderr, "Error %s: %s: no such job\n", name, spec);
+	return NULL;
 }
 
-void funct_clear(char** args) {
-	exit_status = 1;
-	system("clear");
-	exit_status = 0;
+void continue_job(struct job* job) {
+	for (int i = 0; i < job->no_processes; ++i)
+		if (job->processes[i].state == JOB_STOPPED)
+			job->processes[i].state = JOB_RUNNING;
+
+	if (job->pgid > 0)
+		kill(-job->pgid, SIGCONT);
 }
 
-void funct_history(char** args) {
+void funct_jobs(char** args) {
 	exit_status = 1;
-	print_history();
+
+	// a forked pipeline stage cannot wait for the shell's children
+	if (!in_pipeline)
+		reap_jobs();
+
+	for (int i = 0; i < no_jobs; ++i)
+		print_job(jobs[i], &stdout_sink);
+
+	if (!in_pipeline) {
+		for (int i = 0; i < no_jobs; ) {
+			if (job_state(jobs[i]) == JOB_DONE)
+				job_remove(jobs[i]);
+			else
+				++i;
+		}
+	}
+
 	exit_status = 0;
 }
 
-void funct_pwd(char** args) {
+void funct_fg(char** args) {
 	exit_status = 1;
-	print_curr_dir();
-	printf("\n");
-	exit_status = 0;
+
+	struct job* job = find_job(args[0], "fg");
+	if (job == NULL)
+		return;
+
+	sink_printf(&stdout_sink, "%s\n", job->command);
+	flush_output();
+
+	if (shell_terminal != -1 && job->pgid > 0)
+		tcsetpgrp(shell_terminal, job->pgid);
+	continue_job(job);
+	finish_foreground_job(job, true);
 }
 
-void funct_cat(char** args) {
+void funct_bg(char** args) {
 	exit_status = 1;
 
-	char chunk[MAX_INPUT_LENGTH + 10];
+	struct job* job = find_job(args[0], "bg");
+	if (job == NULL)
+		return;
+
+	continue_job(job);
+	print_job(job, &stdout_sink);
+	exit_status = 0;
+}
 
-	for (int i = 0; args[i][0] != '\0'; ++i) {
-		FILE* fin = fopen(args[i], "r");
+// wait for a job of the table, it leaves the table once done
+int wait_table_job(struct job* job) {
+	wait_job(job, false);
+	int status = job_status(job);
+	if (job_state(job) == JOB_DONE)
+		job_remove(job);
+	return status;
+}
 
-		if (fin == NULL) {
-			perror("Error cat");
-			continue;
+// wait for every background job that is not stopped (the status is 0),
+// or for the given ones, %n or a pid (the status of the last one)
+void funct_wait(char** args) {
+	exit_status = 1;
+	int status = 0;
+
+	if (args[0] == NULL) {
+		for (int i = 0; i < no_jobs; ) {
+			struct job* job = jobs[i];
+			if (job_state(job) != JOB_STOPPED)
+				wait_table_job(job);
+			// a job that stopped meanwhile stays
+			if (i < no_jobs && jobs[i] == job)
+				++i;
 		}
+		exit_status = 0;
+		return;
+	}
 
-		while(fgets(chunk, sizeof(chunk), fin) != NULL) {
-			printf("%s", chunk);
+	for (int i = 0; args[i] != NULL; ++i) {
+		struct job* job = NULL;
+
+		if (args[i][0] == '%')
+			job = find_job(args[i], "wait");
+		else {
+			pid_t wanted = atoi(args[i]);
+			for (int j = 0; j < no_jobs && job == NULL; ++j)
+				for (int k = 0; k < jobs[j]->no_processes; ++k)
+					if (jobs[j]->processes[k].pid == wanted)
+						job = jobs[j];
+			if (job == NULL)
+				fprintf(stderr, "Error wait: %s is not a child of this shell\n", args[i]);
 		}
 
-		fclose(fin);
-	} 
+		status = job ? wait_table_job(job) : 127;
+	}
 
-	exit_status = 0;
+	exit_status = status;
 }
 
-char* get_absolute_path(char* command_path) {
+// the text of pipelines [first, last] of a line, as shown by jobs
+char* job_text(struct command_line* line, int first, int last) {
+	struct text_buffer text = {NULL, 0, 0};
+
+	for (int i = first; i <= last; ++i) {
+		struct pipeline* pipeline = &line->pipelines[i];
 
-	char* new_path = malloc(MAX_INPUT_LENGTH*sizeof(*new_path));
-	new_path[0] = '\0';
+		for (int j = 0; j < pipeline->no_commands; ++j) {
+			struct simple_command* command = &pipeline->commands[j];
+			if (j > 0)
+				buffer_puts(&text, " | ");
+
+			for (int k = 0; k < command->argc; ++k) {
+				if (k > 0)
+					buffer_puts(&text, " ");
+				buffer_puts(&text, command->argv[k]);
+			}
+			for (int k = 0; k < command->no_redirects; ++k) {
+				buffer_puts(&text, " ");
+				buffer_puts(&text, redirect_operators[command->redirects[k].type]);
+				if (command->redirects[k].file) {
+					buffer_puts(&text, " ");
+					buffer_puts(&text, command->redirects[k].file);
+				}
+			}
+		}
 
-	if (command_path[0] == '.') {
-		strcpy(new_path, cwd);
-		strcat(new_path, (command_path + 1));
-		free(command_path);
-		return new_path;
+		if (i < last)
+			buffer_puts(&text, pipeline->next_operator == TOKEN_AND ? " && " : " || ");
 	}
-	else {
-		free(new_path);
-		return command_path;
+
+	buffer_append(&text, "", 1);
+	return text.data;
+}
+
+// pass an interrupt to the processes of a job
+void interrupt_job(struct job* job) {
+	if (job->pgid > 0) {
+		kill(-job->pgid, SIGINT);
+		return;
 	}
+	for (int i = 0; i < job->no_processes; ++i)
+		if (job->processes[i].state != JOB_DONE)
+			kill(job->processes[i].pid, SIGINT);
 }
 
-void sig_handler(int sig_num)
-{
-    // Reset handler to catch SIGTSTP next time
-    signal(SIGINT, sig_handler);
+// forked children get back the signals the shell catches or ignores
+void default_signals() {
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTSTP, SIG_DFL);
+	signal(SIGTTIN, SIG_DFL);
+	signal(SIGTTOU, SIG_DFL);
+	signal(SIGCHLD, SIG_DFL);
+}
 
-    if (pid != -1) {
-        printf("\nProcess with pid %d suspended\n", pid);
-		kill(pid,SIGKILL);
-    	pid = -1;
-    }
-	else {
-		printf("\n");
-		printf("%s$ ", cwd);
+// ------------------------- PARALLEL ----------------------------
+
+// parallel [-j N] command... [::: inputs...]
+// runs the command once per input (the lines of stdin without :::),
+// with {} in its words replaced by the input, or the input appended
+// when there is no {}; N children are kept running, the output of
+// each is collected in its own buffer and printed in input order
+struct parallel_job {
+	pid_t pid;
+	int fd; // read end of its stdout, -1 once closed
+	struct text_buffer output;
+	bool done;
+	int status;
+};
+
+char** parallel_argv(char** command, int no_words, char* input) {
+	char** argv = arena_alloc(&line_arena, (no_words + 2) * sizeof(*argv));
+	bool substituted = false;
+
+	for (int i = 0; i < no_words; ++i) {
+		char* brace = strstr(command[i], "{}");
+		if (brace == NULL) {
+			argv[i] = command[i];
+			continue;
+		}
+
+		// every {} of the word is replaced
+		substituted = true;
+		struct text_buffer word = {NULL, 0, 0};
+		char* start = command[i];
+		for (; brace != NULL; brace = strstr(start, "{}")) {
+			buffer_append(&word, start, brace - start);
+			buffer_puts(&word, input);
+			start = brace + 2;
+		}
+		buffer_puts(&word, start);
+
+		argv[i] = arena_strndup(&line_arena, word.data, word.length);
+		free(word.data);
 	}
-	
 
+	if (!substituted)
+		argv[no_words++] = input;
+	argv[no_words] = NULL;
+	return argv;
 }
 
+// the lines of stdin, split in place in text
+char** parallel_read_inputs(struct text_buffer* text, int* no_inputs) {
+	while (true) {
+		buffer_reserve(text, 1 << 16);
+		ssize_t done = read(STDIN_FILENO, text->data + text->length, text->capacity - text->length - 1);
+		if (done < 0 && errno == EINTR)
+			continue;
+		if (done <= 0)
+			break;
+		text->length += done;
+	}
 
+	*no_inputs = 0;
+	if (text->length == 0)
+		return NULL;
 
-void exec_command(char* command) {
-	char* command_path = malloc(MAX_INPUT_LENGTH * sizeof(*command_path));
-	char** args = create_arguments_matrix();;
-	int args_counter = 0;
-	
-	get_command_name(command_path, command);
-	//get the absolute path
-	command_path = get_absolute_path(command_path);
-	args_counter = get_arguments(args, command);
+	text->data[text->length] = '\0';
+	int capacity = count_newlines(text->data, text->length) + 1;
+	char** inputs = malloc(capacity * sizeof(*inputs));
 
-	//we need to change the structure of arguments
-	for (int i = args_counter; i >= 1; --i) {
-		strcpy(args[args_counter], args[args_counter - 1]);
-	}
-	for (int i = args_counter + 1; i < MAX_NUMBER_ARGUMENTS; ++i) {
-		free(args[i]);
-		args[i] = NULL;
+	for (char* line = text->data; line < text->data + text->length; ) {
+		char* end = strchrnul(line, '\n');
+		*end = '\0';
+		inputs[(*no_inputs)++] = line;
+		line = end + 1;
 	}
+	return inputs;
+}
 
-	strcpy(args[0], command_path);
+void funct_parallel(char** args) {
+	exit_status = 1;
 
-	pid = 0;
-	pid = fork();
-	if (pid < 0) {
-		perror("Error while forking\n");
-		free(command_path);
-		free_arguments_matrix(args);
-		return;
+	int no_workers = no_cpus();
+	int first = 0;
+	if (strcmp(args[0], "-j") == 0) {
+		if (args[1] == NULL || (no_workers = atoi(args[1])) < 1) {
+			sink_puts(&stdout_sink, "Invalid command\n");
+			return;
+		}
+		first = 2;
 	}
-	else if (pid == 0) {
-		execve(command_path, args, NULL);
-		perror(NULL);
-		exit(0);
+
+	char** command = args + first;
+	int no_words = 0;
+	while (command[no_words] != NULL && strcmp(command[no_words], ":::") != 0)
+		++no_words;
+	if (no_words == 0) {
+		sink_puts(&stdout_sink, "Invalid command\n");
+		return;
 	}
-	else if (pid > 0) {
-		wait(NULL);
-		//the process is dead 
-		pid = -1;
-		free(command_path);
-		free_arguments_matrix(args);
+
+	struct text_buffer input_text = {NULL, 0, 0};
+	char** inputs;
+	int no_inputs = 0;
+	bool inputs_from_stdin = command[no_words] == NULL;
+	if (inputs_from_stdin)
+		inputs = parallel_read_inputs(&input_text, &no_inputs);
+	else {
+		inputs = command + no_words + 1;
+		while (inputs[no_inputs] != NULL)
+			++no_inputs;
 	}
 
-}
+	// the children must not read the inputs or the terminal
+	int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+	struct parallel_job* jobs = calloc(no_inputs ? no_inputs : 1, sizeof(*jobs));
+	struct pollfd* fds = malloc(no_workers * sizeof(*fds));
+	int* fd_jobs = malloc(no_workers * sizeof(*fd_jobs));
+	int next_start = 0, next_emit = 0, running = 0, failed = 0;
+
+	flush_output();
+
+	while (next_emit < no_inputs) {
+		while (running < no_workers && next_start < no_inputs) {
+			struct parallel_job* job = &jobs[next_start];
+			char** argv = parallel_argv(command, no_words, inputs[next_start]);
+			++next_start;
+
+			int pipe_fds[2];
+			job->fd = -1;
+			job->done = true;
+			job->status = 127;
+
+			if (pipe2(pipe_fds, O_CLOEXEC) < 0) {
+				perror("Error pipe");
+				continue;
+			}
+
+			job->pid = spawn_program(argv, null_fd, pipe_fds[1], NULL, 0, -1, -1);
+			close(pipe_fds[1]);
+			if (job->pid == -1) {
+				close(pipe_fds[0]);
+				continue;
+			}
+
+			job->fd = pipe_fds[0];
+			job->done = false;
+			++running;
+		}
+
+		// the outputs are printed in input order, as soon as possible
+		while (next_emit < no_inputs && jobs[next_emit].done) {
+			struct parallel_job* job = &jobs[next_emit++];
+			if (job->output.length > 0 && sink_write_buffer(&stdout_sink, &job->output) < 0)
+				perror("Error parallel");
+			free(job->output.data);
+			if (job->status != 0)
+				++failed;
+		}
+		sink_flush(&stdout_sink);
+
+		if (running == 0)
+			continue;
 
-void find_command(char* command) {
-	if (stdin_redirect) {
-		strcat(command, " \0");
-		strcat(command, stdin_buffer);
-		stdin_redirect = false;
+		int no_fds = 0;
+		for (int i = next_emit; i < next_start; ++i) {
+			if (jobs[i].fd != -1) {
+				fds[no_fds] = (struct pollfd){jobs[i].fd, POLLIN, 0};
+				fd_jobs[no_fds++] = i;
+			}
+		}
+
+		if (poll(fds, no_fds, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("Error poll");
+			break;
+		}
+
+		for (int i = 0; i < no_fds; ++i) {
+			if (fds[i].revents == 0)
+				continue;
+
+			struct parallel_job* job = &jobs[fd_jobs[i]];
+			buffer_reserve(&job->output, 1 << 16);
+			ssize_t done = read(job->fd, job->output.data + job->output.length, job->output.capacity - job->output.length);
+			if (done < 0 && errno == EINTR)
+				continue;
+			if (done > 0) {
+				job->output.length += done;
+				continue;
+			}
+
+			// end of its output, the child is done
+			close(job->fd);
+			job->fd = -1;
+			job->status = wait_status(job->pid);
+			job->done = true;
+			--running;
+		}
+	}
+
+	// only after an error: stop waiting for the output of the rest
+	for (int i = next_emit; i < next_start; ++i) {
+		if (jobs[i].fd != -1) {
+			close(jobs[i].fd);
+			wait_status(jobs[i].pid);
+		}
+		free(jobs[i].output.data);
 	}
 
-	int command_idx = valid_command(command);
+	close(null_fd);
+	free(fds);
+	free(fd_jobs);
+	free(jobs);
+	free(input_text.data);
+	if (inputs_from_stdin)
+		free(inputs);
+
+	// like GNU parallel: the number of jobs that failed, at most 101
+	exit_status = failed > 101 ? 101 : failed;
+}
+
+// every builtin of the shell
+// the lookup table is built from it at startup
+const struct builtin builtins[] = {
+	{"ls", funct_ls, 0, -1, BUILTIN_PIPE_SAFE},
+	{"echo", funct_echo, 1, -1, BUILTIN_PIPE_SAFE},
+	{"touch", funct_touch, 1, -1, BUILTIN_PIPE_SAFE},
+	{"mkdir", funct_mkdir, 1, -1, BUILTIN_PIPE_SAFE},
+	{"grep", funct_grep, 1, -1, BUILTIN_PIPE_SAFE},
+	{"pwd", funct_pwd, 0, 0, BUILTIN_PIPE_SAFE},
+	{"cd", funct_cd, 1, 1, BUILTIN_PARENT_ONLY},
+	{"mv", funct_mv, 2, 2, BUILTIN_PIPE_SAFE},
+	{"rm", funct_rm, 1, -1, BUILTIN_PIPE_SAFE},
+	{"rmdir", funct_rmdir, 1, -1, BUILTIN_PIPE_SAFE},
+	{"cat", funct_cat, 0, -1, BUILTIN_PIPE_SAFE},
+	{"sort", funct_sort, 0, -1, BUILTIN_PIPE_SAFE},
+	{"uniq", funct_uniq, 0, 2, BUILTIN_PIPE_SAFE},
+	{"wc", funct_wc, 0, -1, BUILTIN_PIPE_SAFE},
+	{"head", funct_head, 0, -1, BUILTIN_PIPE_SAFE},
+	{"tail", funct_tail, 0, -1, BUILTIN_PIPE_SAFE},
+	{"history", funct_history, 0, 2, BUILTIN_PIPE_SAFE},
+	{"clear", funct_clear, 0, 0, BUILTIN_PIPE_SAFE},
+	{"cp", funct_cp, 2, 3, BUILTIN_PIPE_SAFE},
+	{"false", funct_false, 0, 0, BUILTIN_PIPE_SAFE},
+	{"true", funct_true, 0, 0, BUILTIN_PIPE_SAFE},
+	{"exit", funct_exit, 0, 0, BUILTIN_PARENT_ONLY},
+	{"load", funct_load, 1, 1, BUILTIN_PARENT_ONLY},
+	{"hash", funct_hash, 0, -1, BUILTIN_PIPE_SAFE},
+	{"jobs", funct_jobs, 0, 0, BUILTIN_PIPE_SAFE},
+	{"fg", funct_fg, 0, 1, BUILTIN_PARENT_ONLY},
+	{"bg", funct_bg, 0, 1, BUILTIN_PARENT_ONLY},
+	{"wait", funct_wait, 0, -1, BUILTIN_PARENT_ONLY},
+	{"parallel", funct_parallel, 1, -1, BUILTIN_PIPE_SAFE},
+	{"time", funct_time, 1, -1, BUILTIN_PIPE_SAFE},
+	{"stats", funct_stats, 0, 1, BUILTIN_PIPE_SAFE},
+	{"trace", funct_trace, 0, 2, BUILTIN_PIPE_SAFE},
+};
 
+void find_command(char** argv, int argc) {
+	uint64_t start = trace_start();
+	int command_idx = valid_command(argv, argc);
+	trace_event("lookup", argv[0], start);
 	if (command_idx == -1) {
-		//need to check if we need to run a program 
-		if (command[0] == '.' || command[0] == '/')
-			exec_command(command);
-		else if (strcmp(command, "exit") == 0)
-			kill_signal = 1;
-		else {
-			exit_status = 1;
-			printf("Invalid command\n");
-		}
+		exit_status = 1;
+		sink_puts(&stdout_sink, "Invalid command\n");
 		return;
 	}
 	if (kill_signal == 1)
 		return;
 
-	char* command_name = malloc(MAX_INPUT_LENGTH * sizeof(*command_name));
-	char** arguments;
-	int args_counter;
-
-	arguments = create_arguments_matrix(); 
-
-	get_command_name(command_name, command);
-	args_counter = get_arguments(arguments, command);
-
-	if (command_idx == 0)
-		funct_ls(arguments);
-	else if (command_idx == 1)
-		funct_echo(arguments);
-	else if (command_idx == 2)
-		funct_touch(arguments);
-	else if (command_idx == 3)
-		funct_mkdir(arguments);
-	else if (command_idx == 4)
-		funct_grep(arguments);
-	else if (command_idx == 5)
-		funct_pwd(arguments);
-	else if (command_idx == 6)
-		funct_cd(arguments);
-	else if (command_idx == 7)
-		funct_mv(arguments);
-	else if (command_idx == 8)
-		funct_rm(arguments);
-	else if (command_idx == 9)
-		funct_rmdir(arguments);
-	else if (command_idx == 10)
-		funct_cat(arguments);
-	else if (command_idx == 11)
-		funct_history(arguments);
-	else if (command_idx == 12)
-		funct_clear(arguments);
-	else if (command_idx == 13)
-		funct_cp(arguments);
-	else if (command_idx == 14)
+	const struct builtin* command = commands[command_idx];
+
+	// a forked stage cannot change the shell
+	if (in_pipeline && (command->flags & BUILTIN_PARENT_ONLY)) {
 		exit_status = 1;
-	else if (command_idx == 15)
-		exit_status = 0;
+		fprintf(stderr, "Error %s: cannot run inside a pipeline\n", command->name);
+		return;
+	}
 
-	free_arguments_matrix(arguments);
-	free(command_name);
+	sink_begin(&stdout_sink);
+	uint64_t bytes = stdout_sink.bytes;
+	start = now_ns();
+	command->run(argv + 1);
+	sink_flush(&stdout_sink);
+	stats_record(command_idx, now_ns() - start, stdout_sink.bytes - bytes);
+	trace_event("run", argv[0], start);
 }
 
+bool is_builtin(struct simple_command* command) {
+	return da_search(&command_table, command->argv[0]) != -1;
+}
 
+// apply the redirections of a command and run it in this process
+void run_simple_command(struct simple_command* command) {
+	int saved[3];
 
-
-// read input from stdin
-void read_input(char* input) {
-	
-	if(kill_signal)
+	if (!redirect_fds(command->redirects, command->no_redirects, saved)) {
+		exit_status = 1;
 		return;
+	}
 
-	//to be able to read char by char and not put stdin in a buffer
-	char * command = malloc(MAX_INPUT_LENGTH*sizeof(*command));
-	int temp_index = -1;
-	char c;
-
-	char* temp=readline("\n$ ");
+	if (is_builtin(command))
+		find_command(command->argv, command->argc);
+	else
+		exec_command(command->argv);
 
+	restore_fds(saved);
+}
 
-	if (strlen(temp) > 0) {
-        add_history(temp);
-		strcpy(input, temp);
-    }
-	input[strlen(input)] = '\0';
+// true if the command reads the terminal: it has no input redirection
+// and the shell's standard input is a terminal
+bool reads_terminal(struct simple_command* command) {
+	for (int i = 0; i < command->no_redirects; ++i)
+		if (command->redirects[i].type == REDIRECT_IN || command->redirects[i].type == REDIRECT_HERE_STRING)
+			return false;
+	return isatty(STDIN_FILENO);
+}
 
-	char* input_ptr;
-	int token = 1, type;
-	input_ptr = input;
+// true if the command is a builtin that may run in the shell process
+// as the last stage of a pipeline; parent only builtins are forked, and
+// refuse to run there
+bool runs_in_shell(struct simple_command* command) {
+	int command_idx = da_search(&command_table, command->argv[0]);
+	return command_idx != -1 && (commands[command_idx]->flags & BUILTIN_PIPE_SAFE);
+}
 
-	bool flag = true;
+// run every stage at the same time, connected through kernel pipes
+// programs are spawned and builtins run inside their own forked child
+// (but the last stage may run in the shell), so data is streamed
+// between the stages and never staged on disk
+// the processes form one job, waited for unless it runs in the background
+void run_pipeline(struct command_line* line, int index, bool background) {
+	struct pipeline* pipeline = &line->pipelines[index];
+	int no_stages = pipeline->no_commands;
+
+	// a builtin alone runs in the shell
+	if (no_stages == 1 && !background && is_builtin(&pipeline->commands[0])) {
+		run_simple_command(&pipeline->commands[0]);
+		return;
+	}
 
-	char chunk[MAX_INPUT_LENGTH + 10];
+	exit_status = 1;
 
-	while (token >= 0) {
-		if (kill_signal)
-			return;
-		token = token_str(input_ptr);
+	struct job* job = job_new(job_text(line, index, index));
+	int prev_read = -1;
+
+	// a foreground job gets the terminal as soon as its group exists,
+	// before its first stage can read it (from the background group it
+	// would be stopped by SIGTTIN)
+	int terminal = job_control && !background ? shell_terminal : -1;
+
+	// nothing buffered may be duplicated into the children
+	flush_output();
+
+	for (int i = 0; i < no_stages; ++i) {
+		struct simple_command* command = &pipeline->commands[i];
+		int fds[2] = {-1, -1};
+
+		// the last stage runs in the shell itself when its builtin
+		// allows it, which saves a fork per pipeline; not when the first
+		// stage reads the terminal: a stop (ctrl-z) of that stage would
+		// leave the shell waiting on the pipe for good
+		if (i == no_stages - 1 && !background && runs_in_shell(command)
+			&& !(terminal != -1 && reads_terminal(&pipeline->commands[0]))) {
+			int saved_stdin = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0);
+			dup2(prev_read, STDIN_FILENO);
+			close(prev_read);
+			prev_read = -1;
+
+			// the other stages keep the terminal (ctrl-c goes to them,
+			// and ends their output) while the shell reads the pipe
+			bool handed = terminal != -1 && job->pgid > 0;
+			if (handed)
+				tcsetpgrp(terminal, job->pgid);
+			foreground_job = job;
+			run_simple_command(command);
+			foreground_job = NULL;
+			flush_output();
+			if (handed)
+				tcsetpgrp(terminal, shell_pgid);
+
+			// closing the read end stops the stages still writing
+			dup2(saved_stdin, STDIN_FILENO);
+			close(saved_stdin);
+			job_add_process(job, -1, exit_status);
+			break;
+		}
 
-		if (token == -1) {
-			copy_str(command, input_ptr, strlen(input_ptr));
-			find_command(command);
+		// the pipe ends only survive where they are dup2ed to 0 or 1
+		if (i < no_stages - 1 && pipe2(fds, O_CLOEXEC) < 0) {
+			perror("Error pipe");
 			break;
 		}
-		else if (token == -2) {
-			printf("Invalid command\n");
+
+		if (!is_builtin(command)) {
+			// programs are spawned straight from the shell, a stage that
+			// cannot start just ends its pipes
+			pid_t child = spawn_program(command->argv, prev_read, fds[1], command->redirects, command->no_redirects,
+				job->pgid, job->pgid == 0 ? terminal : -1);
+			job_add_process(job, child, 127);
 		}
 		else {
-			//read the command before a separator
-			type = token % 10;
-			token = token / 10;
-			copy_str(command, input_ptr, token);
-			input_ptr += token;
-			
-			// ||
-			if (type == 1) {
-				//call the function 
-				find_command(command);
-				
-				if (exit_status == 0) {
-					flag = false;
-					break;
+			uint64_t start = trace_start();
+			pid_t child = fork();
+			if (child > 0)
+				trace_event("fork", command->argv[0], start);
+			if (child < 0) {
+				perror("Error while forking");
+				if (fds[0] != -1) {
+					close(fds[0]);
+					close(fds[1]);
 				}
-				input_ptr += 2;
+				break;
 			}
-			// &&
-			else if (type == 2) {
-				
-				
-				find_command(command);
-				
-				if (exit_status != 0) {
-					flag = false;
-					break;
+
+			if (child == 0) {
+				if (job_control)
+					setpgid(0, job->pgid);
+				// still ignoring SIGTTOU, so this does not stop the child
+				if (terminal != -1 && job->pgid == 0)
+					tcsetpgrp(terminal, getpgrp());
+				default_signals();
+				job_control = false;
+
+				if (prev_read != -1) {
+					dup2(prev_read, STDIN_FILENO);
+					close(prev_read);
+				}
+				if (fds[1] != -1) {
+					dup2(fds[1], STDOUT_FILENO);
+					close(fds[1]);
+					close(fds[0]);
 				}
-				input_ptr += 2;
+
+				in_pipeline = true;
+				run_simple_command(command);
+
+				flush_output();
+				_exit(exit_status);
 			}
-			// <
-			else if (type == 3) {
-				char* file_name = malloc(MAX_INPUT_LENGTH * sizeof(*file_name));
 
-				++input_ptr;
-				token = token_str(input_ptr);
-				if (token == -1)
-					token = strlen(input_ptr) * 10;
+			// both sides set the group and hand the terminal, whichever
+			// runs first
+			if (job_control)
+				setpgid(child, job->pgid ? job->pgid : child);
+			if (terminal != -1 && job->pgid == 0)
+				tcsetpgrp(terminal, child);
+			job_add_process(job, child, 1);
+		}
+
+		if (prev_read != -1)
+			close(prev_read);
+		if (fds[1] != -1)
+			close(fds[1]);
+		prev_read = fds[0];
+	}
 
-				copy_str(file_name, input_ptr, token / 10);
+	if (prev_read != -1)
+		close(prev_read);
 
-				stdin_redirect = true;
-				strcpy(stdin_buffer, file_name);
+	if (background) {
+		start_background_job(job);
+		return;
+	}
 
-				find_command(command);
+	// the status of a pipeline is the status of its last stage
+	finish_foreground_job(job, false);
+}
 
-				free(file_name);
+// run the pipelines [first, last] of a line, following && and ||
+// returns true if every pipeline that ran succeeded
+bool run_list(struct command_line* line, int first, int last) {
+	bool succeeded = true;
 
-				//check if we have more commands to process or don't
-				token = token_str(input_ptr);
-				if (token == -1)
-					break; 			
-			}
-			// >
-			else if (type == 4) {
-				char* file_name = malloc(MAX_INPUT_LENGTH * sizeof(*file_name));
-
-				++input_ptr;
-				token = token_str(input_ptr);
-				if (token == -1)
-					token = strlen(input_ptr) * 10;
-
-				copy_str(file_name, input_ptr, token / 10);
-
-				// redirect stdout to file
-				stdout_redirect = true;
-				strcpy(stdout_buffer, file_name);
-				freopen(stdout_buffer, "w", stdout); 
-				
-				find_command(command);
-
-				// restore stdout
-				stdout_redirect = false; 
-				freopen("/dev/tty", "w", stdout);
-				
-				free(file_name);
-
-				//check if we have more commands to process or don't
-				token = token_str(input_ptr);
-				if (token == -1)
-					break; 
+	for (int i = first; i <= last; ++i) {
+		if (kill_signal)
+			break;
+
+		if (i > first) {
+			int operator = line->pipelines[i - 1].next_operator;
+			if (operator == TOKEN_AND && exit_status != 0)
+				continue;
+			if (operator == TOKEN_OR && exit_status == 0)
+				continue;
+		}
+
+		run_pipeline(line, i, false);
+		if (exit_status)
+			succeeded = false;
+	}
+
+	return succeeded;
+}
+
+// run an && / || list in a forked copy of the shell, as one background job
+void run_background_list(struct command_line* line, int first, int last) {
+	struct job* job = job_new(job_text(line, first, last));
+
+	flush_output();
+
+	pid_t child = fork();
+	if (child < 0) {
+		perror("Error while forking");
+		job_free(job);
+		exit_status = 1;
+		return;
+	}
+
+	if (child == 0) {
+		if (job_control)
+			setpgid(0, 0);
+		default_signals();
+		job_control = false;
+
+		run_list(line, first, last);
+
+		flush_output();
+		_exit(exit_status);
+	}
+
+	if (job_control)
+		setpgid(child, child);
+	job_add_process(job, child, 1);
+	start_background_job(job);
+}
+
+// run the lists of a line, the ones ended by & in the background
+// returns true if every pipeline that ran in the foreground succeeded
+bool run_line(struct command_line* line) {
+	bool succeeded = true;
+
+	for (int first = 0; first < line->no_pipelines && !kill_signal; ) {
+		int last = first;
+		while (line->pipelines[last].next_operator == TOKEN_AND || line->pipelines[last].next_operator == TOKEN_OR)
+			++last;
+
+		if (line->pipelines[last].next_operator != TOKEN_BACKGROUND) {
+			if (!run_list(line, first, last))
+				succeeded = false;
+		}
+		else if (first == last)
+			run_pipeline(line, first, true);
+		else
+			run_background_list(line, first, last);
+
+		first = last + 1;
+	}
+
+	return succeeded;
+}
+
+// readline in callback mode, so children are reaped while the prompt
+// waits (the SIGCHLD handler wakes it through child_pipe) and finished
+// background jobs are reported right away
+char* callback_line = NULL;
+bool callback_done = false;
+
+void line_handler(char* line) {
+	// the line runs outside of readline, with the terminal restored
+	rl_callback_handler_remove();
+	callback_line = line;
+	callback_done = true;
+	history_cursor = -1;
+}
+
+char* read_line(const char* prompt) {
+	flush_output();
+	callback_done = false;
+	prompt_interrupted = 0;
+	rl_callback_handler_install(prompt, line_handler);
+
+	while (!callback_done) {
+		fd_set fds;
+		FD_ZERO(&fds);
+		FD_SET(STDIN_FILENO, &fds);
+		FD_SET(child_pipe[0], &fds);
+
+		if (select(child_pipe[0] + 1, &fds, NULL, NULL, NULL) < 0) {
+			if (errno != EINTR) {
+				perror("Error select");
+				rl_callback_handler_remove();
+				return NULL;
 			}
-			// |
-			else if (type == 5) {
-				// redirect stdout to file
-				stdout_redirect = true;
-				strcpy(stdout_buffer, pipe_buffer);
-				freopen(stdout_buffer, "w", stdout); 
-				
-				find_command(command);
-
-				// restore stdout
-				stdout_redirect = false;
-				freopen("/dev/tty", "w", stdout); 
-				
-				if (exit_status == 1) {
-					perror("Invalid Commnad");
-					flag = false;
-					break;
-				}
 
-				stdin_redirect = true;
-				strcpy(stdin_buffer, pipe_buffer);
+			// ctrl-c drops the line being typed
+			if (prompt_interrupted) {
+				prompt_interrupted = 0;
+				rl_crlf();
+				rl_replace_line("", 0);
+				rl_on_new_line();
+				rl_redisplay();
+			}
+			continue;
+		}
 
-				++input_ptr;
+		if (FD_ISSET(child_pipe[0], &fds)) {
+			reap_jobs();
+			if (any_job_done()) {
+				rl_crlf();
+				fflush(rl_outstream);
+				notify_jobs();
+				rl_on_new_line();
+				rl_redisplay();
 			}
 		}
-		if (exit_status)
-			flag = false;
 
+		if (FD_ISSET(STDIN_FILENO, &fds))
+			rl_callback_read_char();
 	}
-	if (flag == true)
-		add_command_to_history(command);
 
-	free(command);
+	return callback_line;
+}
+
+// run one line of input (any number of commands)
+// returns true if every command that ran succeeded
+bool run_input_line(char* input) {
+	// the tokens, the command tree and their words all live in the arena
+	arena_reset(&line_arena);
+	uint64_t start = trace_start();
+	struct command_line* line = parse_input(&line_arena, input);
+	trace_event("parse", input, start);
+
+	if (line == NULL) {
+		exit_status = 1;
+		sink_puts(&stdout_sink, "Invalid command\n");
+		return false;
+	}
+	return run_line(line);
 }
 
-// store the possible commands
-void populate_trie() {
-	trie_root = get_new_node();
+// read input from stdin
+void read_input() {
+	
+	if(kill_signal)
+		return;
 
-	FILE* fin = fopen("commands.txt", "r");
+	char* input = read_line("\n$ ");
 
-	char chunk[MAX_INPUT_LENGTH + 10], command_text[MAX_INPUT_LENGTH];
-	int command_min_arg, command_max_arg;
+	// end of input
+	if (input == NULL) {
+		kill_signal = 1;
+		return;
+	}
 
-	int idx_command = 0;
+	if (strspn(input, " \t") == strlen(input)) {
+		free(input);
+		return;
+	}
 
-	while(fgets(chunk, sizeof(chunk), fin) != NULL) {
-        char* token = strtok(chunk, " \n");
-        strcpy(command_text, token);
+	add_command_to_history(input);
+	run_input_line(input);
 
-        token = strtok(NULL, " \n");
-        command_min_arg = atoi(token);
+	free(input);
+}
 
-        token = strtok(NULL, " \n");
-        command_max_arg = atoi(token);
+// ------------------------- SCRIPTS -----------------------------
 
-        insert(command_text, command_min_arg, command_max_arg,idx_command);
+// without a terminal there is no prompt, no readline and no history:
+// the input is read in blocks and run line by line as it arrives
 
-    	++idx_command;
-    }
+// background jobs of a script are reaped silently
+void drop_done_jobs() {
+	reap_jobs();
+	for (int i = 0; i < no_jobs; ) {
+		if (job_state(jobs[i]) == JOB_DONE)
+			job_remove(jobs[i]);
+		else
+			++i;
+	}
+}
 
-	fclose(fin);
+void run_script(int fd) {
+	struct text_buffer buffer = {NULL, 0, 0};
+	size_t start = 0; // the first byte not run yet
+	bool end_of_input = false;
+
+	while (!kill_signal) {
+		char* newline = NULL;
+		if (start < buffer.length)
+			newline = memchr(buffer.data + start, '\n', buffer.length - start);
+
+		if (newline == NULL) {
+			if (end_of_input) {
+				// a last line without a newline
+				if (start < buffer.length) {
+					buffer_append(&buffer, "", 1);
+					run_input_line(buffer.data + start);
+				}
+				break;
+			}
+
+			// keep the partial line and read the next block after it
+			memmove(buffer.data, buffer.data + start, buffer.length - start);
+			buffer.length -= start;
+			start = 0;
+			buffer_reserve(&buffer, SCRIPT_BLOCK_SIZE + 1);
+
+			ssize_t done = read(fd, buffer.data + buffer.length, SCRIPT_BLOCK_SIZE);
+			if (done < 0 && errno == EINTR)
+				continue;
+			if (done < 0) {
+				perror("Error read");
+				break;
+			}
+			if (done == 0)
+				end_of_input = true;
+			buffer.length += done;
+			continue;
+		}
+
+		*newline = '\0';
+		run_input_line(buffer.data + start);
+		start = newline + 1 - buffer.data;
+
+		if (no_jobs > 0)
+			drop_done_jobs();
+	}
+
+	free(buffer.data);
 }
 
+// shell -c: the lines of one string
+void run_text(char* text) {
+	while (!kill_signal) {
+		char* newline = strchr(text, '\n');
+		if (newline)
+			*newline = '\0';
+		run_input_line(text);
+		if (newline == NULL)
+			break;
+		text = newline + 1;
+
+		if (no_jobs > 0)
+			drop_done_jobs();
+	}
+}
 
 // initialize everything before starting the program
-void init() {
-	populate_trie();
-	// pipe buffer has to be hidden
-	strcpy(pipe_buffer, ".pipe_buffer.txt\0");
+// only an interactive shell takes the terminal and controls jobs
+void init(bool interactive) {
+	register_builtins(builtins, sizeof(builtins) / sizeof(*builtins));
+	atexit(flush_output);
 	signal(SIGINT, sig_handler);
+	// the interrupt at the prompt is handled by read_line
+	rl_catch_signals = 0;
+
+	// children are reaped in the main loop, the handler only wakes it up
+	pipe2(child_pipe, O_CLOEXEC | O_NONBLOCK);
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = child_handler;
+	action.sa_flags = SA_RESTART;
+	sigaction(SIGCHLD, &action, NULL);
+
+	// on a terminal the shell gets its own process group, and hands the
+	// terminal to the foreground job; ctrl-z only stops that job
+	shell_pgid = getpgrp();
+	job_control = interactive;
+	if (interactive) {
+		history_open();
+		history_bind_keys();
+
+		shell_terminal = STDIN_FILENO;
+		while (tcgetpgrp(shell_terminal) != (shell_pgid = getpgrp()))
+			kill(-shell_pgid, SIGTTIN);
+
+		signal(SIGTSTP, SIG_IGN);
+		signal(SIGTTIN, SIG_IGN);
+		signal(SIGTTOU, SIG_IGN);
+
+		setpgid(0, 0);
+		shell_pgid = getpgrp();
+		tcsetpgrp(shell_terminal, shell_pgid);
+	}
 }
 
-int main() {
-	init();
-	char input[MAX_INPUT_LENGTH];
+#ifndef SHELL_NO_MAIN
+int main(int argc, char** argv) {
+	if (argc > 1 && strcmp(argv[1], "-X") == 0) {
+		trace_enable(true);
+		atexit(trace_dump_at_exit);
+		++argv;
+		--argc;
+	}
+
+	bool interactive = argc == 1 && isatty(STDIN_FILENO);
+	init(interactive);
+
+	// shell -c commands
+	if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+		if (argc < 3) {
+			fprintf(stderr, "Error -c: option requires an argument\n");
+			return 2;
+		}
+		run_text(argv[2]);
+		return exit_status;
+	}
+
+	// shell script
+	if (argc > 1) {
+		int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			fprintf(stderr, "Error %s: %s\n", argv[1], strerror(errno));
+			return 127;
+		}
+		run_script(fd);
+		close(fd);
+		return exit_status;
+	}
+
+	// commands piped in
+	if (!interactive) {
+		run_script(STDIN_FILENO);
+		return exit_status;
+	}
+
 	while(true) {
 		if(kill_signal)
-			return 0;
+			break;
+		reap_jobs();
+		notify_jobs();
 		print_curr_dir();
-		read_input(input);
+		read_input();
+	}
+
+	// stopped jobs would never run again
+	for (int i = 0; i < no_jobs; ++i) {
+		if (jobs[i]->pgid > 0 && job_state(jobs[i]) == JOB_STOPPED) {
+			kill(-jobs[i]->pgid, SIGHUP);
+			kill(-jobs[i]->pgid, SIGCONT);
+		}
 	}
 
 	return 0;
-}
\ No newline at end of file
+}
+#endif
@@ -0,0 +1,41 @@
+// interface between the shell and the builtins it runs
+//
+// the builtins of the shell and the ones loaded at runtime with
+// "load file.so" are described the same way; a plugin is a shared
+// object exporting shell_plugin_init, which returns its builtins
+//
+// a builtin gets the arguments after its name as a NULL terminated
+// array and reports its result in exit_status (0 for success); the
+// shell is linked with -rdynamic so plugins can use it
+#ifndef SHELL_PLUGIN_H
+#define SHELL_PLUGIN_H
+
+#define SHELL_PLUGIN_VERSION 1
+
+// the builtin may run inside the shell process as the last stage of
+// a pipeline, instead of in a forked child
+#define BUILTIN_PIPE_SAFE 1
+// the builtin changes the state of the shell (cd, exit...), so it
+// has no effect inside a forked pipeline stage
+#define BUILTIN_PARENT_ONLY 2
+
+typedef void (*builtin_function)(char** args);
+
+struct builtin {
+	const char* name;
+	builtin_function run;
+	int min_arg, max_arg; // max_arg is -1 for no limit
+	int flags;
+};
+
+struct shell_plugin {
+	int version; // SHELL_PLUGIN_VERSION
+	const struct builtin* builtins;
+	int no_builtins;
+};
+
+extern int exit_status;
+
+const struct shell_plugin* shell_plugin_init(void);
+
+#endif
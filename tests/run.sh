@@ -0,0 +1,24 @@
+#!/bin/sh
+# build and run the tests from the repository root
+#
+# usage: tests/run.sh [test...]
+#   test  the tests to run (grep...), all of them by default
+# the script fails if a test does
+set -e
+cd "$(dirname "$0")/.."
+mkdir -p tests/bin
+
+tests=$*
+if [ -z "$tests" ]; then
+	for test in tests/test_*.c; do
+		name=$(basename "$test" .c)
+		tests="$tests ${name#test_}"
+	done
+fi
+
+failed=0
+for name in $tests; do
+	gcc -Wall -O2 -DSHELL_NO_MAIN "tests/test_$name.c" -lreadline -lpthread -ldl -o "tests/bin/test_$name"
+	"./tests/bin/test_$name" || failed=1
+done
+exit $failed
@@ -0,0 +1,140 @@
+// parallel grep over more files than the fd limit allows open at once,
+// and over a file big enough to be cut in several chunks; the span
+// coloured in a line is the leftmost match, the longest one there
+// build: gcc -O2 -DSHELL_NO_MAIN tests/test_grep.c -lreadline -lpthread -ldl -o test_grep
+#include "../shell.c"
+
+#define NO_FILES 300
+#define FD_LIMIT 64
+
+// runs the builtin with its output in a file, returns the lines printed
+size_t run_grep(char** argv, int argc, const char* output) {
+	int fd = open(output, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	int saved = dup(STDOUT_FILENO);
+	dup2(fd, STDOUT_FILENO);
+	find_command(argv, argc);
+	flush_output();
+	dup2(saved, STDOUT_FILENO);
+	close(saved);
+
+	struct stat st;
+	fstat(fd, &st);
+	char* data = malloc(st.st_size + 1);
+	size_t length = pread(fd, data, st.st_size, 0);
+	close(fd);
+	size_t lines = count_newlines(data, length);
+	free(data);
+	return lines;
+}
+
+struct span_case {
+	bool regex;
+	char* patterns[3];
+	char* line;
+	size_t from;
+	bool found;
+	size_t start, length;
+};
+
+struct span_case span_cases[] = {
+	{false, {"abcd", "bc"}, "abcd", 0, true, 0, 4},
+	{false, {"bc", "abcd"}, "xabcd", 0, true, 1, 4},
+	{false, {"cd", "b"}, "abcd", 2, true, 2, 2},
+	{false, {"", "ab"}, "abc", 0, true, 0, 2},
+	{true, {"abcd|bc"}, "abcd", 0, true, 0, 4},
+	{true, {"b+", "ab"}, "xabbb", 0, true, 1, 2},
+	{true, {"a*b"}, "caaab", 0, true, 1, 4},
+	{true, {"^ab"}, "abab", 1, false, 0, 0},
+	{true, {"ab$"}, "abab", 0, true, 2, 2},
+	{true, {"x*"}, "abc", 1, true, 1, 0},
+};
+
+int check_spans() {
+	int failures = 0;
+	for (size_t i = 0; i < sizeof(span_cases) / sizeof(*span_cases); ++i) {
+		struct span_case* c = &span_cases[i];
+		int no_patterns = c->patterns[1] ? 2 : 1;
+		struct grep_matcher matcher;
+		struct matcher_cache cache = {0};
+		build_matcher(&matcher, c->patterns, no_patterns, c->regex);
+
+		size_t start = 0, length = 0;
+		bool found = matcher_span(&matcher, &cache, c->line, strlen(c->line), c->from, &start, &length);
+		if (found != c->found || (found && (start != c->start || length != c->length))) {
+			fprintf(stderr, "FAIL span %zu: %s in \"%s\" at %zu,%zu\n", i, c->patterns[0], c->line, start, length);
+			++failures;
+		}
+		matcher_cache_free(&cache);
+		free_matcher(&matcher);
+	}
+	return failures;
+}
+
+int main() {
+	register_builtins(builtins, sizeof(builtins) / sizeof(*builtins));
+
+	char root[] = "/tmp/test_grep_XXXXXX";
+	if (mkdtemp(root) == NULL) {
+		perror("Error mkdtemp");
+		return 1;
+	}
+
+	char** argv = calloc(NO_FILES + 5, sizeof(*argv));
+	int argc = 0;
+	argv[argc++] = "grep";
+	argv[argc++] = "-j";
+	argv[argc++] = "4";
+	argv[argc++] = "needle";
+
+	char path[MAX_PATH_LENGTH];
+	for (int i = 0; i < NO_FILES; ++i) {
+		snprintf(path, sizeof(path), "%s/file_%d", root, i);
+		int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		dprintf(fd, "hay\nneedle %d\nhay\n", i);
+		close(fd);
+		argv[argc++] = strdup(path);
+	}
+
+	// the limit is set after the files exist, the grep has to live with it
+	struct rlimit limit;
+	getrlimit(RLIMIT_NOFILE, &limit);
+	limit.rlim_cur = FD_LIMIT;
+	setrlimit(RLIMIT_NOFILE, &limit);
+
+	int failures = check_spans();
+	char output[MAX_PATH_LENGTH];
+	snprintf(output, sizeof(output), "%s/output", root);
+
+	size_t lines = run_grep(argv, argc, output);
+	if (lines != NO_FILES || exit_status != 0) {
+		fprintf(stderr, "FAIL many files: %zu matches of %d, status %d\n", lines, NO_FILES, exit_status);
+		++failures;
+	}
+
+	// 3 chunks of a mapped file, every 100th line a match
+	snprintf(path, sizeof(path), "%s/big", root);
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	struct text_buffer buffer = {NULL, 0, 0};
+	size_t expected = 0;
+	for (size_t i = 0; buffer.length < 3 * GREP_CHUNK_SIZE; ++i) {
+		char line[64];
+		expected += i % 100 == 0;
+		buffer_append(&buffer, line, snprintf(line, sizeof(line), "%zu %s\n", i, i % 100 == 0 ? "needle" : "hay"));
+	}
+	buffer_flush(&buffer, fd);
+	free(buffer.data);
+	close(fd);
+
+	char* big_argv[] = {"grep", "-j", "4", "needle", path, NULL};
+	lines = run_grep(big_argv, 5, output);
+	if (lines != expected) {
+		fprintf(stderr, "FAIL chunked file: %zu matches of %zu\n", lines, expected);
+		++failures;
+	}
+
+	char* remove_argv[] = {"rm", "-r", root, NULL};
+	find_command(remove_argv, 3);
+
+	printf("grep: %s\n", failures ? "FAILED" : "ok");
+	return failures != 0;
+}